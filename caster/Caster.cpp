@@ -67,6 +67,10 @@ bool ShowHelp = false;
 unsigned Retries = 10;
 unsigned RetryTime = 5;
 unsigned short FragSize = 1400;
+unsigned FecGroup = 0;
+bool Carousel = false;
+unsigned Layers = 1;
+unsigned Decoders = 0;
 bool ReadMBR = true;
 
 static int doParseArgs(int argOffset, int argc, char* argv[], const char* argList) {
@@ -106,6 +110,14 @@ static int doParseArgs(int argOffset, int argc, char* argv[], const char* argLis
 		Retries = max(atoi(env), 1);
 	if(env = getenv("CASTERRETRYTIME"))
 		RetryTime = max(atoi(env), 1);
+	if(env = getenv("CASTERFEC"))
+		FecGroup = atoi(env);
+	if(env = getenv("CASTERCAROUSEL"))
+		Carousel = atoi(env) != 0;
+	if(env = getenv("CASTERLAYERS"))
+		Layers = atoi(env);
+	if(env = getenv("CASTERDECODERS"))
+		Decoders = atoi(env);
 
 	// Wczytaj argumenty
 	optind = argOffset;
@@ -183,6 +195,22 @@ static int doParseArgs(int argOffset, int argc, char* argv[], const char* argLis
 				FragSize = atoi(optarg);
 				break;
 
+			case 'E':
+				FecGroup = atoi(optarg);
+				break;
+
+			case 'C':
+				Carousel = true;
+				break;
+
+			case 'L':
+				Layers = atoi(optarg);
+				break;
+
+			case 'D':
+				Decoders = atoi(optarg);
+				break;
+
 			case 'h':
 				ShowHelp = true;
 				break;
@@ -216,6 +244,22 @@ checkArgs:
 	if(strchr(argList, 'F'))
 		if(FragSize < 64 || FragSize > 65000)
 			throw invalid_argument("FragSize");
+	if(strchr(argList, 'E'))
+		if(FecGroup > UDPCAST_FEC_MAX_GROUP)
+			throw invalid_argument("FecGroup");
+	if(strchr(argList, 'L')) {
+		if(Layers < 1 || Layers > UDPCAST_MAX_LAYERS)
+			throw invalid_argument("Layers");
+		// warstwy wysyla tylko karuzela
+		if(Layers > 1)
+			Carousel = true;
+	}
+	if(strchr(argList, 'C'))
+		if(Carousel && !Rate)
+			throw invalid_argument("Rate");
+	if(strchr(argList, 'D'))
+		if(Decoders > MAX_CLIENT_DECODERS)
+			throw invalid_argument("Decoders");
 	return 0;
 }
 
@@ -284,6 +328,15 @@ static int doOptimize() {
 	return 0;
 }
 
+#ifdef USE_DISK_FILE
+static int doPack() {
+	auto_ptr<ImageDesc> imageDesc(ImageDesc::loadImageFromFile(Image));
+	unsigned packed = imageDesc->packBlocks();
+	printf("Packed %i blocks.\n", packed);
+	return 0;
+}
+#endif // USE_DISK_FILE
+
 static CasterServer* createServer() {
 	CasterServerArgs args;
 	args.ImageName = Image;
@@ -292,6 +345,9 @@ static CasterServer* createServer() {
 	args.Maddress = Multicast;
 	args.Rate = Rate;
 	args.FragSize = FragSize;
+	args.FecGroup = FecGroup;
+	args.Carousel = Carousel;
+	args.Layers = Layers;
 	return new CasterServer(args);
 }
 
@@ -320,6 +376,7 @@ static int doClient() {
 	args.DeviceName = Name;
 	args.BindAddress = Bind;
 	args.Update = Update;
+	args.Decoders = Decoders;
 
 	for(unsigned i = 0; i < Retries; ++i) {
 		try {
@@ -404,14 +461,17 @@ CmdFunc CmdFuncList[] = {
 	{"create", "i:V:h", doCreate, "create new image"},
 	{"add", "i:f:n:s:V:h", doAdd, "add file to image"},
 	{"optimize", "i:V:h", doOptimize, "optimize image disk usage"},
+#ifdef USE_DISK_FILE
+	{"pack", "i:V:h", doPack, "move image blocks into pack files"},
+#endif // USE_DISK_FILE
 	{"show", "i:V:h", doShow, "show image statistics"},
 	{"showdevices", "i:V:h", doShowDevices, "show image devices"},
-	{"server", "i:p:b:m:r:V:F:h", doServer, "start an server"},
-	{"client", "f:cH:p:n:b:R:T:V:u:h", doClient, "start an client"},
+	{"server", "i:p:b:m:r:V:F:E:CL:h", doServer, "start an server"},
+	{"client", "f:cH:p:n:b:R:T:V:u:D:h", doClient, "start an client"},
 	{"send", "f:cH:p:n:B:s:R:T:V:hM:", doSend, "send a file to remote server"},
 #ifdef _DEBUG
-	{"clientloop", "i:b:m:r:F:f:cH:p:n:b:R:T:V:u:h", doClientLoop, "start an client in loop"},
-	{"sendloop", "i:b:m:r:F:f:cH:p:n:B:s:R:T:V:hM:", doSendLoop, "send a file to server in loop"},
+	{"clientloop", "i:b:m:r:F:E:CL:f:cH:p:n:b:R:T:V:u:D:h", doClientLoop, "start an client in loop"},
+	{"sendloop", "i:b:m:r:F:E:CL:f:cH:p:n:B:s:R:T:V:hM:", doSendLoop, "send a file to server in loop"},
 #endif // _DEBUG
 	{"remove", "i:n:V:h", doRemove, "remove a device"},
 	{"clone", "i:n:N:V:h", doClone, "clone a device"}
@@ -461,6 +521,14 @@ static int showHelp(const char* self, const char* target = NULL, const char* arg
 			fprintf(stderr, "  -V : verbosity : 0 - quiet : %i\n", Verbosity);
 		if(strchr(argList, 'F'))
 			fprintf(stderr, "  -F : multicast fragment size in bytes (affect multicast performance): %i\n", FragSize);
+		if(strchr(argList, 'E'))
+			fprintf(stderr, "  -E <count> : multicast FEC group size in packets (0 - disable) : %i\n", FecGroup);
+		if(strchr(argList, 'C'))
+			fprintf(stderr, "  -C : send multicast as a fountain-coded carousel without receiver feedback (requires -r) : %i\n", Carousel);
+		if(strchr(argList, 'L'))
+			fprintf(stderr, "  -L <count> : carousel layers, each doubles the total rate; receivers join as many as their loss allows (implies -C) : %i\n", Layers);
+		if(strchr(argList, 'D'))
+			fprintf(stderr, "  -D <count> : decompression threads (0 - one per cpu) : %i\n", Decoders);
 		if(strchr(argList, 'M'))
 			fprintf(stderr, "  -M : read mbr: %i\n", ReadMBR);
 		if(strchr(argList, 'h'))
@@ -5,11 +5,18 @@
 #include "../AsyncLib/ForEach.hpp"
 #include "../UdpCast/UdpCastServer.hpp"
 #include "../UdpCast/UdpCastClient.hpp"
+#include "../UdpCast/UdpCastCarouselServer.hpp"
+#include "../UdpCast/UdpCastCarouselClient.hpp"
 #include "../HashLib/Hash.hpp"
 #include "../CompressLib/Compress.hpp"
 #include "../ImageLib/Image.hpp"
 
-#define VERSION 1
+#define VERSION 5
+#define VERSION_BLOCK_DATA_PART 2
+#define VERSION_MANIFEST 3
+#define VERSION_MANIFEST_STREAM 4
+#define VERSION_CAROUSEL 5
+#define VERSION_MULTICAST_WINDOW 5
 #define CASTERLIB_INFO	"Caster date:" __DATE__ " " __TIME__
 
 const unsigned MIN_BLOCK_SIZE = 4 * 1024; // 4kB
@@ -17,7 +24,20 @@ const unsigned MAX_BLOCK_SIZE = 64 * 1024 * 1024; // 64MB
 const unsigned DEFAULT_BLOCK_SIZE = 1024 * 1024; // 1MB
 const int MAX_DEVICE_NAME = 32;
 const int MAX_IMAGE_NAME = 32;
-const int MAX_BLOCKS_IN_WRITE_QUEUE = 10;
+const long long MIN_WRITE_QUEUE_SIZE = 64 * 1024 * 1024; // 64MB
+const long long MAX_WRITE_QUEUE_SIZE = 1024 * 1024 * 1024; // 1GB
+const unsigned WRITE_QUEUE_MEMORY_SHARE = 4; // 1/4 wolnej pamieci
+const long long VERIFY_QUEUE_SIZE = 256 * 1024 * 1024; // 256MB
+const long long VERIFY_READAHEAD_SIZE = 32 * 1024 * 1024; // 32MB
+const double CLIENT_VERIFY_INTERVAL = 0.25; // zadanie blokow nie przechodzacych sprawdzenia
+const unsigned CLIENT_CLONE_RETRIES = 3; // ponowienia kopiowania obszaru po bledzie
+const unsigned BLOCK_DATA_PART_SIZE = 64 * 1024; // 64kB
+const unsigned DEFAULT_DISK_WORKERS = 2;
+const unsigned MAX_DISK_WORKERS = 8;
+const unsigned MAX_CLIENT_DECODERS = 16;
+const unsigned READ_AHEAD_BLOCKS = 2;
+const unsigned MAX_PENDING_SEND_BLOCKS = 8;
+const unsigned MAX_GOT_DATA_BLOCKS = 64;
 
 #define CLIENT_DEBUG_LEVEL 4
 #define SERVER_DEBUG_LEVEL 4
@@ -27,6 +47,7 @@ bool checkImageName(const string& imageName);
 bool checkDeviceName(const string& deviceName);
 
 #include "Packet.hpp"
+#include "DiskQueue.hpp"
 #include "Client.hpp"
 #include "Sender.hpp"
 #include "SessionClient.hpp"
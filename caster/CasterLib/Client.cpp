@@ -6,46 +6,61 @@
 const double CLIENT_PROGRESS_INTERVAL = 0.5;
 
 CasterCastClient::CasterCastClient(CasterClient& client) : Client(client) {
+	m_offset = 0;
+	m_receiving = false;
 }
 
 void CasterCastClient::onJoinTimeout() {
 }
 
 void CasterCastClient::onJoin() {
+	// (ponowne) dolaczenie w trakcie bloku: czekaj na naglowek kolejnego
+	m_block.reset();
+	m_receiving = false;
 }
 
-bool CasterCastClient::onConsumeData(const string& data) {
+bool CasterCastClient::onConsumeData(const void* data, unsigned size) {
 	// hold on stream till end of finish
 	if(!Client.waitForRead())
 		return false;
 
-	// receive data
-	if(!data.empty()) {
-		Data += data;
+	// end of block
+	if(size == 0) {
+		if(m_block.get() && m_offset == m_block->DataSize)
+			Client.finishBlock(m_block.release());
+		m_block.reset();
+		m_receiving = false;
 		return true;
 	}
 
-	// no data to intercept
-	if(Data.empty())
-		return true;
+	// block header: prepare buffer for whole block
+	if(!m_receiving) {
+		m_receiving = true;
+		m_offset = 0;
+
+		const CasterPacketBlockData* block = (const CasterPacketBlockData*)data;
+		if(size != sizeof(CasterPacketBlockData) || block->Type != SERVERPT_BlockData)
+			return true;
 
-	// invalid data
-	if(Data.size() < sizeof(CasterPacketBlockData)) {
-InvalidData:
-		Data.clear();
+		ClientBlockList::iterator itor = Client.m_blockList.find(block->Id);
+		if(itor == Client.m_blockList.end() || itor->second.DataSize != block->DataSize)
+			return true;
+
+		m_block.reset(ClientBlockData::alloc(itor->second));
 		return true;
 	}
 
-	// check data
-	CasterPacketBlockData* block = (CasterPacketBlockData*)&Data[0];
-	if(block->Type != SERVERPT_BlockData)
-		goto InvalidData;
-	if(block->size() != Data.size())
-		goto InvalidData;
+	// skip unwanted or invalid block
+	if(!m_block.get())
+		return true;
 
-	// intercept data
-	Client.onBlockDataPacket(*block);
-	Data.clear();
+	if(size > m_block->DataSize - m_offset) {
+		m_block.reset();
+		return true;
+	}
+
+	memcpy(m_block->Data + m_offset, data, size);
+	m_offset += size;
 	return true;
 }
 
@@ -57,8 +72,61 @@ void CasterCastClient::onAliveTimeout() {
 
 }
 
+void CasterCastClient::onSkip() {
+	// lost part of stream: drop current block and wait for its end
+	m_block.reset();
+	m_receiving = true;
+}
+
+CasterCarouselClient::CasterCarouselClient(CasterClient& client) : Client(client) {
+}
+
+bool CasterCarouselClient::waitForRead() const {
+	return Client.waitForRead();
+}
+
+bool CasterCarouselClient::onWantObject(unsigned id, unsigned size) {
+	ClientBlockList::iterator itor = Client.m_blockList.find(id);
+	return itor != Client.m_blockList.end() && itor->second.DataSize == size;
+}
+
+void CasterCarouselClient::onObject(unsigned id, const void* data, unsigned size) {
+	ClientBlockList::iterator itor = Client.m_blockList.find(id);
+	if(itor == Client.m_blockList.end() || itor->second.DataSize != size)
+		return;
+
+	Client.finishBlock(ClientBlockData::alloc(itor->second, data, size));
+
+	// zglos odbior paczkami, ostatni blok od razu
+	Client.m_gotList.push_back(id);
+	if(Client.m_gotList.size() >= MAX_GOT_DATA_BLOCKS || Client.m_blockList.empty())
+		Client.sendGotData();
+}
+
 CasterClient::CasterClient(const CasterClientArgs& args) : CasterClientArgs(args) {
-	m_blockCloneList.reserve(64);
+	m_cloneStop = false;
+	m_clonePos = 0;
+	m_cloneFailed = 0;
+	m_streamOffset = 0;
+	m_blockCount = 0;
+	m_streaming = false;
+	m_requestDone = false;
+	m_carousel = 0;
+	m_decoderCount = 0;
+	m_decodeStop = false;
+	m_decodeSeq = m_writeSeq = 0;
+	m_queuedBlocks = 0;
+	m_queueBudget = MIN_WRITE_QUEUE_SIZE;
+	m_decodeBudget = MIN_WRITE_QUEUE_SIZE / WRITE_QUEUE_MEMORY_SHARE;
+	m_compressedBytes = m_decodedBytes = 0;
+	m_verifyBytes = 0;
+	m_verifyStop = false;
+	m_verifying = false;
+	m_verifyFinished = m_verifyAbort = false;
+	m_verifyIndex = 0;
+	m_verifyTotal = 0;
+	m_decodeBusy = m_writeBusy = 0;
+	m_busyTime = m_shownDecodeBusy = m_shownWriteBusy = 0;
 
 	infof("Receiving %s...", FileName.c_str());
 
@@ -77,12 +145,13 @@ CasterClient::CasterClient(const CasterClientArgs& args) : CasterClientArgs(args
 
 
 bool CasterClient::waitForRead() const {
-	return m_blockFinishList.size() <= MAX_BLOCKS_IN_WRITE_QUEUE;
+	return queuedBytes() <= m_queueBudget;
 }
 
 CasterClient::~CasterClient() {
 	// Anuluj timery
 	Timer::cancel(TimerDelegate(this, &CasterClient::onShowProgress));	
+	Timer::cancel(TimerDelegate(this, &CasterClient::onVerifyTick));
 
 	try {
 		if(m_castClient.get()) {
@@ -92,36 +161,15 @@ CasterClient::~CasterClient() {
 	catch(...) {
 	}
 
-	// Czekaj na zakonczenie watku
-	if(m_worker) {
-		infof("Waiting for worker...");
-
-		// Czekaj az worker dokonczy prace
-		while(m_blockFinishList.size()) {
-			m_workerCond.signal();
-			usleep(300 * 1000);
-		}
-
-		// Wyczysc liste blokow
-		MutexMe(m_mutex, m_blockList.clear());
-
-		// Zamknij workera
-		m_workerCond.signal();
-		m_worker.join();
-	}
-
-	// Finalizuj obraz
-	if(m_state == Commit)
-		finishImage();
+	// Czekaj na zakonczenie watkow (i kopiowania obszarow)
+	stopVerify();
+	stopWorkers();
 
-	// Usun wszystkie klonowane bloki
-	delete_all(m_blockCloneList.begin(), m_blockCloneList.end());
-			
 	// Zamknij plik
 	fclose(m_file);
 }
 
-void CasterClient::onImagePacket(const CasterPacketImage& image) {
+void CasterClient::onImagePacket(const CasterPacketImage& image, unsigned size) {
 	assert(m_state == Idle);
 	m_state = Image;
 
@@ -133,7 +181,10 @@ void CasterClient::onImagePacket(const CasterPacketImage& image) {
 	m_imageName.assign(image.ImageName, strnlen(image.ImageName, COUNT_OF(image.ImageName)));
 	m_maddress = image.Multicast;
 
-	debugp("client", "image [version=%i, name=%s, multicast=%08x]", m_version, m_imageName.c_str(), m_maddress);
+	// starsze serwery nie wysylaja informacji o karuzeli
+	m_carousel = size >= sizeof(image) ? image.Carousel : 0;
+
+	debugp("client", "image [version=%i, name=%s, multicast=%08x, carousel=%i]", m_version, m_imageName.c_str(), m_maddress, m_carousel);
 }
 
 void CasterClient::onBlockDataPacket(const CasterPacketBlockData& block) {
@@ -150,9 +201,64 @@ void CasterClient::onBlockDataPacket(const CasterPacketBlockData& block) {
 	MutexLock mutex(m_mutex);
 
 	// dodaj blok do finalizacji
-	m_blockFinishList.push_back(ClientBlockData::alloc(desc, block.data(), block.DataSize));
+	queueBlock(ClientBlockData::alloc(desc, block.data(), block.DataSize));
+	m_blockList.erase(itor);
+}
+
+void CasterClient::onBlockDataStreamPacket(const CasterPacketBlockData& block) {
+	assert(m_state == Ready);
+
+	m_streamBlock.reset();
+	m_streamOffset = 0;
+
+	// znajdz blok
+	ClientBlockList::iterator itor = m_blockList.find(block.Id);
+	if(itor == m_blockList.end())
+		return;
+	if(itor->second.DataSize != block.DataSize)
+		return;
+
+	// przygotuj bufor na cale dane bloka
+	m_streamBlock.reset(ClientBlockData::alloc(itor->second));
+
+	if(block.DataSize == 0)
+		finishStreamBlock();
+}
+
+void CasterClient::onBlockDataPartPacket(const CasterPacketBlockDataPart& part, unsigned size) {
+	if(!m_streamBlock.get() || m_streamBlock->Id != part.Id)
+		return;
+
+	// czesci przychodza po kolei
+	if(part.Offset != m_streamOffset || size > m_streamBlock->DataSize - m_streamOffset) {
+		m_streamBlock.reset();
+		return;
+	}
+
+	memcpy(m_streamBlock->Data + m_streamOffset, part.data(), size);
+	m_streamOffset += size;
+
+	if(m_streamOffset == m_streamBlock->DataSize)
+		finishStreamBlock();
+}
+
+void CasterClient::finishStreamBlock() {
+	finishBlock(m_streamBlock.release());
+}
+
+void CasterClient::finishBlock(ClientBlockData* block) {
+	// blok mogl juz przyjsc inna droga
+	ClientBlockList::iterator itor = m_blockList.find(block->Id);
+	if(itor == m_blockList.end()) {
+		delete block;
+		return;
+	}
+
+	MutexLock mutex(m_mutex);
+
+	// dodaj blok do finalizacji
+	queueBlock(block);
 	m_blockList.erase(itor);
-	m_workerCond.signal();
 }
 
 void CasterClient::onBlockPacket(const CasterPacketBlock& block) {
@@ -169,34 +275,135 @@ void CasterClient::onBlockPacket(const CasterPacketBlock& block) {
 	desc.Ranges.assign(block.List, block.List + block.Count);
 }
 
+void CasterClient::onManifestPacket(const CasterPacketManifest& manifest, unsigned size) {
+	assert(m_state == Image || m_streaming);
+
+	string data = Compressor::decompress(manifest.data(), size - sizeof(manifest), manifest.RealSize);
+	unsigned offset = 0;
+
+	// przy aktualizacji trzeba najpierw sprawdzic istniejace dane
+	bool stream = m_version >= VERSION_MANIFEST_STREAM && !Update;
+	vector<unsigned> blockList;
+
+	{
+		MutexLock lock(m_mutex);
+
+		for(unsigned i = 0; i < manifest.BlockCount; ++i) {
+			// sprawdz rozmiar opisu bloka
+			if(offset + CasterManifestBlock::size(0) > data.size())
+				throw runtime_error("invalid manifest");
+			const CasterManifestBlock* block = (const CasterManifestBlock*)&data[offset];
+			if(block->Count > (data.size() - offset - CasterManifestBlock::size(0)) / sizeof(CasterManifestExtent))
+				throw runtime_error("invalid manifest");
+			offset += block->size();
+
+			// wczytaj blok
+			ClientBlockDesc& desc = m_blockList[block->Id];
+			desc.Id = block->Id;
+			desc.DataSize = block->DataSize;
+			desc.RealSize = block->RealSize;
+			desc.Hash = block->Hash;
+			desc.Ranges.clear();
+
+			// rozwin zakresy przesuniec
+			for(unsigned j = 0; j < block->Count; ++j) {
+				const CasterManifestExtent& extent = block->List[j];
+				for(unsigned k = 0; k < extent.Count; ++k)
+					desc.Ranges.push_back(extent.Start + extent.Stride * k);
+			}
+
+			if(!stream)
+				continue;
+
+			// Gdy blok jest pusty usun go!
+			if(desc.RealSize == 0 || desc.Ranges.empty()) {
+				m_blockList.erase(block->Id);
+				continue;
+			}
+			blockList.push_back(block->Id);
+		}
+	}
+
+	debugp("client", "manifest [blocks=%i, size=%i, requested=%i]", manifest.BlockCount, data.size(), blockList.size());
+
+	if(blockList.empty())
+		return;
+
+	// Zadaj bloki z tej czesci opisu nie czekajac na reszte
+	m_blockCount += blockList.size();
+	sendGetDataPart(blockList);
+
+	if(!m_streaming) {
+		m_streaming = true;
+		m_state = Ready;
+		startReceiving();
+	}
+}
+
+void CasterClient::startReceiving() {
+	// Utworz gniazdo karuzeli (bez dolaczania)
+	if(m_maddress && m_carousel) {
+		m_carouselClient.reset(new CasterCarouselClient(*this));
+		m_carouselClient->createServer(Port, BindAddress, false);
+		m_carouselClient->setBlocking(true);
+		if((m_maddress&0xFFFF)==0xffef) {
+			m_carouselClient->addGroupAddress(m_maddress);
+		}
+		m_carouselClient->setRecvBufferSize(262144);
+
+		// kolejne warstwy sa dolaczane, gdy pozwalaja na to straty
+		m_carouselClient->setLayers(m_carousel, Port, BindAddress, (m_maddress&0xFFFF)==0xffef ? m_maddress : 0);
+	}
+	// Utworz gniazdo (starsze serwery uzywaja innego protokolu multicast, dane ida przez TCP)
+	else if(m_maddress && m_version >= VERSION_MULTICAST_WINDOW) {
+		m_castClient.reset(new CasterCastClient(*this));
+		m_castClient->createServer(Port, BindAddress, false);
+		m_castClient->setBlocking(true);
+		if((m_maddress&0xFFFF)==0xffef) {
+			m_castClient->addGroupAddress(m_maddress);
+		}
+		m_castClient->setRecvBufferSize(262144);
+		m_castClient->setSendAddress(Port, Address);
+		m_castClient->sendJoin();
+	}
+
+	// Pokaz postep
+	Timer::after(TimerDelegate(this, &CasterClient::onShowProgress), 1.0);
+
+	// Utworz watki dekompresji i zapisu
+	startWorkers();
+}
+
 void CasterClient::onReadyPacket() {
-	assert(m_state <= Image);
+	assert(m_state <= Image || m_streaming);
+
+	// Bloki zostaly juz zadane w trakcie odbierania opisu
+	if(m_streaming) {
+		m_requestDone = true;
+		infof("Receiving %i blocks...", m_blockCount);
+		m_workerCond.signal();
+		sendGetDataDone();
+		return;
+	}
+
 	m_state = Ready;
 
+	// Serwer przyjmuje zadania w czesciach: sprawdzanie w tle, brakujace bloki od razu
+	if(Update && m_version >= VERSION_MANIFEST_STREAM) {
+		prepareVerify();
+		startVerify();
+		return;
+	}
+
+	m_requestDone = true;
+
 	// Sprawdz aktualne dane
 	removeExistingBlocks();
 	m_blockCount = m_blockList.size();
 
 	// Wyslij informacje o brakujacych blokach
 	if(sendGetRemainingData()) {
-		// Utworz gniazdo
-		if(m_maddress) {
-			m_castClient.reset(new CasterCastClient(*this));
-			m_castClient->createServer(Port, BindAddress, false);
-			m_castClient->setBlocking(true);
-			if((m_maddress&0xFFFF)==0xffef) {
-				m_castClient->addGroupAddress(m_maddress);
-			}
-			m_castClient->setRecvBufferSize(262144);
-			m_castClient->setSendAddress(Port, Address);
-			m_castClient->sendJoin();
-		}
-
-		// Pokaz postep
-		Timer::after(TimerDelegate(this, &CasterClient::onShowProgress), 1.0);
-
-		// Utworz watek pracownika
-		m_worker.start(ThreadDelegate(this, &CasterClient::onWorkerThread));
+		startReceiving();
 		return;
 	}
 
@@ -221,6 +428,9 @@ void CasterClient::onFinishedPacket(const CasterPacketFinished& finished) {
 			{
 			assert(m_state <= Ready);
 
+			// bloki z bledem zapisu wracaja na liste dopiero po przejsciu przez kolejke
+			waitForWorker();
+
 			// wypelnij kolejke
 			if(sendGetRemainingData())
 				return;
@@ -258,17 +468,33 @@ void CasterClient::onPacket(const void* data, unsigned size) {
 	// Przetworz pakiet
 	switch(packet->Type) {
 		case SERVERPT_Image:
-			onImagePacket(*(const CasterPacketImage*)data);
+			onImagePacket(*(const CasterPacketImage*)data, size);
 			break;
 
 		case SERVERPT_Block:
 			onBlockPacket(*(const CasterPacketBlock*)data);
 			break;
 
+		case SERVERPT_Manifest:
+			if(size < sizeof(CasterPacketManifest))
+				break;
+			onManifestPacket(*(const CasterPacketManifest*)data, size);
+			break;
+
 		case SERVERPT_BlockData:
 			onBlockDataPacket(*(const CasterPacketBlockData*)data);
 			break;
 
+		case SERVERPT_BlockDataStream:
+			onBlockDataStreamPacket(*(const CasterPacketBlockData*)data);
+			break;
+
+		case SERVERPT_BlockDataPart:
+			if(size < sizeof(CasterPacketBlockDataPart))
+				break;
+			onBlockDataPartPacket(*(const CasterPacketBlockDataPart*)data, size - sizeof(CasterPacketBlockDataPart));
+			break;
+
 		case SERVERPT_Ready:
 			onReadyPacket();
 			break;
@@ -294,6 +520,7 @@ void CasterClient::sendGetImage(const string& deviceName) {
 	CasterPacketGetImage image;
 	image.Type = CLIENTPT_GetImage;
 	strncpy(image.DeviceName, deviceName.c_str(), COUNT_OF(image.DeviceName));
+	image.Version = VERSION;
 	sendPacket(&image, sizeof(image));
 }
 
@@ -311,6 +538,36 @@ void CasterClient::sendGetData(const vector<unsigned>& blockList) {
 	sendPacket(data.get(), data->size());
 }
 
+void CasterClient::sendGetDataPart(const vector<unsigned>& blockList) {
+	debugp("client", "requesting part [blocks=%i]", blockList.size());
+
+	// wyslij pakiet
+	auto_ptr<CasterPacketGetData> data(CasterPacketGetData::alloc(blockList.size()));
+	data->Type = CLIENTPT_GetDataPart;
+	std::copy(blockList.begin(), blockList.end(), &data->List[0]);
+	sendPacket(data.get(), data->size());
+}
+
+void CasterClient::sendGetDataDone() {
+	CasterPacket done;
+	done.Type = CLIENTPT_GetDataDone;
+	sendPacket(&done, sizeof(done));
+}
+
+void CasterClient::sendGotData() {
+	if(m_gotList.empty())
+		return;
+
+	debugp("client", "reporting received [blocks=%i]", m_gotList.size());
+
+	// wyslij pakiet
+	auto_ptr<CasterPacketGetData> data(CasterPacketGetData::alloc(m_gotList.size()));
+	data->Type = CLIENTPT_GotData;
+	std::copy(m_gotList.begin(), m_gotList.end(), &data->List[0]);
+	sendPacket(data.get(), data->size());
+	m_gotList.clear();
+}
+
 bool CasterClient::sendGetRemainingData() {
 	// Dodaj wszystkie pozostale bloki
 	vector<unsigned> blockList;
@@ -334,18 +591,75 @@ bool CasterClient::sendGetRemainingData() {
 	// Pokaz postep
 	Timer::after(TimerDelegate(this, &CasterClient::onShowProgress), 1.0);	
 
+	// Ponowienie tez przez multicast: dolacz, jesli serwer nas odlaczyl
+	if(m_castClient.get() && m_castClient->idle())
+		m_castClient->sendJoin();
+
 	// Wyslij liste blokow
 	sendGetData(blockList);
 	return true;
 }
 
+double CasterClient::onVerifyTick(unsigned id) {
+	vector<unsigned> blockList;
+	bool finished = takeMissingBlocks(blockList);
+
+	// Zadaj bloki, ktore nie przeszly sprawdzenia
+	if(blockList.size()) {
+		m_blockCount += blockList.size();
+		sendGetDataPart(blockList);
+	}
+
+	if(!finished)
+		return CLIENT_VERIFY_INTERVAL;
+
+	m_verifyReader.join();
+	m_verifying = false;
+	m_verifyRanges.clear();
+
+	infof("Checked existing data, receiving %i blocks...", m_blockCount);
+
+	// Wszystkie bloki zostaly zadane
+	m_requestDone = true;
+	m_workerCond.signal();
+	sendGetDataDone();
+	return DESTROY_TIMER;
+}
+
 double CasterClient::onShowProgress(unsigned id) {
 	if(m_state != Ready)
 		return DESTROY_TIMER;
 
-	updatef("-- %i/%i blocks [%5ikB/s] -- %i in write --", 
-		m_blockCount - m_blockList.size(), m_blockCount,
-		unsigned((m_castClient->recvRate() + recvRate()) / 1024),  m_blockFinishList.size());
+	// zglos bloki odebrane z karuzeli
+	sendGotData();
+
+	float decode, write;
+	stageUtilization(decode, write);
+
+	// Sprawdzanie istniejacych danych w tle
+	string verify;
+	if(m_verifying && m_verifyRanges.size())
+		verify = va("-- verify %2i%% ", m_verifyIndex * 100 / m_verifyRanges.size());
+
+	unsigned clones;
+	MutexMe(m_mutex, clones = m_cloneList.size());
+
+	if(m_carouselClient.get()) {
+		updatef("%s-- %i/%i blocks [%5ikB/s] -- %i in write (%iMB/%iMB) -- inflate %3.0f%% x%i -- write %3.0f%% -- %i to copy -- %i decoding -- %.2f symbols/block -- %i/%i layers %.1f%% loss --", 
+			verify.c_str(), m_blockCount - m_blockList.size(), m_blockCount,
+			unsigned((m_carouselClient->layerRecvRate() + recvRate()) / 1024),  m_queuedBlocks,
+			unsigned(queuedBytes() >> 20), unsigned(m_queueBudget >> 20),
+			decode * 100, m_decoderCount, write * 100, clones,
+			m_carouselClient->decoderCount(), m_carouselClient->overhead(),
+			m_carouselClient->layers(), m_carousel, m_carouselClient->Loss * 100);
+		return CLIENT_PROGRESS_INTERVAL;
+	}
+
+	updatef("%s-- %i/%i blocks [%5ikB/s] -- %i in write (%iMB/%iMB) -- inflate %3.0f%% x%i -- write %3.0f%% -- %i to copy --", 
+		verify.c_str(), m_blockCount - m_blockList.size(), m_blockCount,
+		unsigned(((m_castClient.get() ? m_castClient->recvRate() : 0) + recvRate()) / 1024),  m_queuedBlocks,
+		unsigned(queuedBytes() >> 20), unsigned(m_queueBudget >> 20),
+		decode * 100, m_decoderCount, write * 100, clones);
 
 	// Uaktualnij w kazdej sekundzie
 	return CLIENT_PROGRESS_INTERVAL;
@@ -25,34 +25,57 @@ struct ClientBlockData : ClientBlockDesc {
 		return self;
 	}
 
+	static ClientBlockData* alloc(const ClientBlockDesc& desc) {
+		return new(sizeof(ClientBlockData) + desc.DataSize) ClientBlockData(desc);
+	}
+
 	ClientBlockData(const ClientBlockDesc& desc) : ClientBlockDesc(desc) {
 	}
 };
 
 typedef map<unsigned, ClientBlockDesc> ClientBlockList;
 
-struct ClientBlockCloneDesc {
-	//! Podstawowe przesuniecie
-	long long Offset;
+//! Obszar kopiowany z zapisanego (lub sprawdzonego) obszaru tego samego bloku
+struct ClientCloneRange {
+	//! Przesuniecie zrodla
+	long long Source;
 
 	//! Rozmiar danych
 	unsigned Size;
 
-	//! Obszary do zapisu
-	unsigned RangeCount;
-	long long Ranges[1];
-	
-	// Constructor
-	ClientBlockCloneDesc() {
-		Offset = 0;
-		Size = 0;
-		RangeCount = 0;
+	//! Ilosc nieudanych prob kopiowania
+	unsigned Retries;
+};
+
+//! Obszary do skopiowania wg przesuniecia docelowego
+typedef multimap<long long, ClientCloneRange> ClientCloneList;
+
+//! Blok po dekompresji, czeka na zapis w kolejnosci odbioru
+struct ClientBlockWrite : ClientBlockDesc {
+	string Data;
+	bool Valid;
+
+	ClientBlockWrite(const ClientBlockDesc& desc) : ClientBlockDesc(desc), Valid(false) {
 	}
+};
 
-	static ClientBlockCloneDesc* alloc(long long offset, unsigned size, unsigned rangeCount, long long* ranges);
+typedef map<unsigned, ClientBlockWrite*> ClientBlockWriteList;
+
+//! Obszar sprawdzany przy aktualizacji (odczyt wg przesuniecia, hash w watkach)
+struct ClientVerifyRange {
+	long long Offset;
+	ClientBlockDesc* Block;
+	unsigned Index;
+	string Data;
+	bool Valid;
+
+	bool operator < (const ClientVerifyRange& other) const {
+		return Offset < other.Offset;
+	}
 };
 
-typedef vector<ClientBlockCloneDesc*> ClientBlockCloneList;
+typedef vector<ClientVerifyRange> ClientVerifyList;
+typedef deque<ClientVerifyRange*> ClientVerifyQueue;
 
 struct CasterClientArgs
 {
@@ -76,6 +99,9 @@ struct CasterClientArgs
 	
 	//! Uaktualnia obraz, sciagajac tylko zmiany
 	bool Update;
+
+	//! Ilosc watkow dekompresji (0 - po jednym na procesor)
+	unsigned Decoders;
 };
 
 class CasterClient;
@@ -83,7 +109,11 @@ class CasterClient;
 class CasterCastClient : public UdpCastClient
 {
 	CasterClient& Client;
-	string Data;
+
+	//! Blok skladany bezposrednio z kolejnych pakietow
+	auto_ptr<ClientBlockData> m_block;
+	unsigned m_offset;
+	bool m_receiving;
 
 public:
 	CasterCastClient(CasterClient& client);
@@ -91,9 +121,25 @@ public:
 protected:
 	void onJoinTimeout();
 	void onJoin();
-	bool onConsumeData(const string& data);
+	bool onConsumeData(const void* data, unsigned size);
 	void onLeave();
 	void onAliveTimeout();
+	void onSkip();
+};
+
+class CasterCarouselClient : public UdpCastCarouselClient
+{
+	CasterClient& Client;
+
+public:
+	CasterCarouselClient(CasterClient& client);
+
+	//! Nie czytaj symboli, gdy kolejka zapisu jest pelna (karuzela wysle kolejne)
+	bool waitForRead() const;
+
+protected:
+	bool onWantObject(unsigned id, unsigned size);
+	void onObject(unsigned id, const void* data, unsigned size);
 };
 
 typedef deque<ClientBlockData*> ClientBlockFinishList;
@@ -115,12 +161,72 @@ private:
 	//! Plik docelowy
 	FILE* m_file;
 
-	//! Watek workera
+	//! Watek zapisu (pwrite w kolejnosci odbioru)
 	Thread m_worker;
 	mutable Mutex m_mutex;
 	mutable Cond m_workerCond;
 
+	//! Watki dekompresji
+	Thread m_decoders[MAX_CLIENT_DECODERS];
+	unsigned m_decoderCount;
+	Cond m_decodeCond;
+	bool m_decodeStop;
+
+	//! Bloki zdekompresowane, wg numeru kolejnego nadanego przy pobraniu z m_blockFinishList
+	ClientBlockWriteList m_writeList;
+	unsigned m_decodeSeq, m_writeSeq;
+
+	//! Bloki odebrane i jeszcze niezapisane (kolejka, dekompresja, zapis)
+	volatile unsigned m_queuedBlocks;
+
+	//! Budzet pamieci kolejki zapisu i jego czesc na bloki po dekompresji
+	long long m_queueBudget, m_decodeBudget;
+
+	//! Bloki czekajace na dekompresje (rozmiar skompresowany) i po niej (rozmiar rzeczywisty).
+	//! Gdy dysk nie nadaza, nadmiar czeka skompresowany.
+	volatile long long m_compressedBytes, m_decodedBytes;
+
+	//! Watek klonowania, kopiuje obszary w kolejnosci przesuniec od ostatniej pozycji
+	Thread m_cloner;
+	Cond m_cloneCond;
+	bool m_cloneStop;
+	long long m_clonePos;
+
+	//! Ilosc obszarow, ktorych nie udalo sie skopiowac (obraz jest niekompletny)
+	unsigned m_cloneFailed;
+
+	//! Watki sprawdzania danych przy aktualizacji
+	Thread m_verifiers[MAX_CLIENT_DECODERS];
+	Mutex m_verifyMutex;
+	Cond m_verifyCond, m_verifyDoneCond;
+	ClientVerifyQueue m_verifyQueue;
+	long long m_verifyBytes;
+	bool m_verifyStop;
+
+	//! Sprawdzanie w tle w trakcie pobierania (watek odczytu i zadanie blokow z timera)
+	Thread m_verifyReader;
+	bool m_verifying;
+	bool m_verifyFinished, m_verifyAbort;
+	volatile unsigned m_verifyIndex;
+
+	//! Bloki w trakcie sprawdzania (poza m_blockList), ich obszary wg przesuniecia
+	ClientBlockList m_verifyBlocks;
+	ClientVerifyList m_verifyRanges;
+	long long m_verifyTotal;
+
+	//! Niesprawdzone obszary bloku i pierwszy poprawny obszar
+	map<unsigned, unsigned> m_verifyPending;
+	map<unsigned, long long> m_verifyOffsets;
+
+	//! Bloki bez poprawnego obszaru, do zadania
+	vector<unsigned> m_verifyMissing;
+
+	//! Czas pracy etapow i stan przy ostatnim pokazaniu postepu
+	double m_decodeBusy, m_writeBusy;
+	double m_busyTime, m_shownDecodeBusy, m_shownWriteBusy;
+
 	auto_ptr<CasterCastClient> m_castClient;
+	auto_ptr<CasterCarouselClient> m_carouselClient;
 
 	// Getting Fields
 private:
@@ -128,16 +234,31 @@ private:
 	unsigned m_version;
 	string m_imageName;
 	unsigned m_maddress;
+	//! Ilosc warstw karuzeli (0 - multicast z dolaczaniem)
+	unsigned m_carousel;
+
+	//! Bloki odebrane z karuzeli, jeszcze nie zgloszone serwerowi
+	vector<unsigned> m_gotList;
 	//! Lista blokow do pobrania
 	ClientBlockList m_blockList;
 	unsigned m_blockCount;
 
-	//! Lista blokow do zapisu
-	ClientBlockCloneList m_blockCloneList;
+	//! Bloki sa zadane w trakcie odbierania opisu urzadzenia
+	bool m_streaming;
+
+	//! Wszystkie bloki do pobrania zostaly juz zadane
+	volatile bool m_requestDone;
+
+	//! Obszary do skopiowania (watek klonowania w trakcie odbioru)
+	ClientCloneList m_cloneList;
 
 	//! Lista blokw do zapisu
 	ClientBlockFinishList m_blockFinishList;
 
+	//! Blok odbierany w czesciach
+	auto_ptr<ClientBlockData> m_streamBlock;
+	unsigned m_streamOffset;
+
 	// Constructor
 public:
 	CasterClient(const CasterClientArgs& args);
@@ -148,14 +269,51 @@ public:
 
 	// Helpers
 private:
-	void finishImage();
 	void removeExistingBlocks();
+	unsigned workerCount() const;
+
+	//! Usuwa puste bloki, przy aktualizacji przenosi bloki obecne w pliku do sprawdzenia (zwraca ilosc obszarow)
+	unsigned prepareVerify();
+	void verifyRanges();
+	void startVerify();
+	void stopVerify();
+
+	//! Wynik sprawdzenia obszaru (m_verifyMutex zablokowany)
+	void finishVerifyRange(ClientVerifyRange& range);
+
+	//! Przenosi bloki bez poprawnego obszaru do m_blockList, zwraca true gdy sprawdzanie jest skonczone
+	bool takeMissingBlocks(vector<unsigned>& blockList);
+	void startReceiving();
+	void startWorkers();
+	void stopWorkers();
+
+	//! Czeka az wszystkie odebrane bloki zostana zapisane
+	void waitForWorker();
+
+	//! Cofa zatwierdzenie obrazu, jesli nie wszystkie obszary zostaly skopiowane
+	void checkClones();
+
+	//! Dodaje obszary do skopiowania z obszaru offset (m_mutex zablokowany)
+	void queueClone(long long offset, unsigned size, unsigned rangeCount, const long long* ranges);
+	void cloneRanges();
+
+	//! Dodaje odebrany blok do dekompresji (m_mutex zablokowany)
+	void queueBlock(ClientBlockData* block);
+	long long queuedBytes() const { return m_compressedBytes + m_decodedBytes; }
+
+	//! Czesc czasu pracy dekompresji (na watek) i zapisu od ostatniego wywolania
+	void stageUtilization(float& decode, float& write);
 
 	// Handlers
 private:
-	void onImagePacket(const CasterPacketImage& image);
+	void onImagePacket(const CasterPacketImage& image, unsigned size);
 	void onBlockDataPacket(const CasterPacketBlockData& block);
+	void onBlockDataStreamPacket(const CasterPacketBlockData& block);
+	void onBlockDataPartPacket(const CasterPacketBlockDataPart& part, unsigned size);
+	void finishStreamBlock();
+	void finishBlock(ClientBlockData* block);
 	void onBlockPacket(const CasterPacketBlock& block);
+	void onManifestPacket(const CasterPacketManifest& manifest, unsigned size);
 	void onReadyPacket();
 	void onFinishedPacket(const CasterPacketFinished& finished);
 	void onPacket(const void* data, unsigned size);
@@ -163,6 +321,11 @@ private:
 
 	double onShowProgress(unsigned id);
 	void* onWorkerThread(void*);
+	void* onDecodeThread(void*);
+	void* onVerifyThread(void*);
+	void* onVerifyReadThread(void*);
+	void* onCloneThread(void*);
+	double onVerifyTick(unsigned id);
 
 	bool waitForRead() const;
 
@@ -170,8 +333,12 @@ private:
 public:
 	void sendGetImage(const string& deviceName);
 	void sendGetData(const vector<unsigned>& blockList);
+	void sendGetDataPart(const vector<unsigned>& blockList);
+	void sendGetDataDone();
+	void sendGotData();
 	bool sendGetRemainingData();
 	void sendGetBlockData(unsigned id, const FragList& frags);
 
 	friend class CasterCastClient;
+	friend class CasterCarouselClient;
 };
@@ -2,28 +2,20 @@
 #include "CasterLib.hpp"
 #include "Common.hpp"
 #include "../AsyncLib/Common.hpp"
+#include <errno.h>
+#include <fcntl.h>
 
-ClientBlockCloneDesc* ClientBlockCloneDesc::alloc(long long offset, unsigned size, unsigned rangeCount, long long* ranges) {
-	ClientBlockCloneDesc* desc;
-	desc = new(sizeof(long long) * rangeCount) ClientBlockCloneDesc();
-	desc->Offset = offset;
-	desc->Size = size;
-	desc->RangeCount = rangeCount;
-	std::copy(&ranges[0], &ranges[rangeCount], &desc->Ranges[0]);
-	return desc;
-}
-
-void CasterClient::removeExistingBlocks() {
-	infof("Checking existing data...");
-	
+unsigned CasterClient::prepareVerify() {
 	MutexLock lock(m_mutex);
 
-	unsigned totalCount = 0;
-	long long totalSize = 0;
-	unsigned blockCount = 0;
-	long long dataSize = 0, realSize = 0;
+	// Obszary za koncem pliku na pewno trzeba pobrac
+	long long fileSize = lseek64(fileno(m_file), 0, SEEK_END);
+	if(fileSize < 0)
+		fileSize = ~0ULL >> 1;
+
+	m_verifyRanges.clear();
+	m_verifyTotal = 0;
 
-	// Oblicz ilosc obszarow do zapisu
 	FurEach(ClientBlockList, block, m_blockList) {
 		ClientBlockDesc& desc = block->second;
 
@@ -33,139 +25,229 @@ void CasterClient::removeExistingBlocks() {
 			continue;
 		}
 
-		totalCount += desc.Ranges.size();
-		totalSize += desc.Ranges.size() * desc.RealSize;
-		blockCount++;
-		dataSize += desc.DataSize;
-		realSize += desc.RealSize;
-	}
-
-	long long toRecvDataSize = dataSize, toRecvRealSize = realSize;
-
-	unsigned processedIndex = 0;
-	long long processedData = 0;
-	Hash hash;
-	Rate rate;
-	string data;
-
-	if(!Update)
-		goto noUpdate;
+		if(!Update)
+			continue;
 
-	// Sprawdz dysk
-	FurEach(ClientBlockList, block, m_blockList) {
-		ClientBlockDesc& desc = block->second;
-		
 		assert(desc.RealSize <= MAX_BLOCK_SIZE);
 
-		long long dataOffset = ~0ULL;
-		unsigned rangeCount = desc.Ranges.size();
-		
-		// Znajdz prawidlowy blok
-		for(unsigned i = desc.Ranges.size(); i-- > 0; ) {
-			long long offset = desc.Ranges[i];
+		bool inFile = false;
+		for(unsigned i = 0; i < desc.Ranges.size(); ++i) {
+			if(desc.Ranges[i] + desc.RealSize <= fileSize)
+				inFile = true;
+		}
+		if(!inFile)
+			continue;
 
-			++processedIndex;
+		// Przenies blok do sprawdzenia
+		ClientBlockDesc& verify = m_verifyBlocks[desc.Id];
+		verify = desc;
+		m_verifyPending[desc.Id] = verify.Ranges.size();
+		m_verifyTotal += verify.Ranges.size() * verify.RealSize;
+
+		for(unsigned i = 0; i < verify.Ranges.size(); ++i) {
+			ClientVerifyRange range;
+			range.Offset = verify.Ranges[i];
+			range.Block = &verify;
+			range.Index = i;
+			range.Valid = false;
+			m_verifyRanges.push_back(range);
+		}
 
-			if(fseeko64(m_file, offset, SEEK_SET))
-				continue;
+		m_blockList.erase(block);
+	}
 
-			// Wczytaj dane
-			data.resize(desc.RealSize);
-			int readed = fread((void*)data.c_str(), 1, desc.RealSize, m_file);
-			if(readed > 0) {
-				rate.addBytes(readed);
-				if(rate.manualUpdate()) {
-					updatef("-- %2i%% -- %3i of %3i blocks -- %iMB of %iMB processed -- %3iMB/s --   ", processedIndex * 100 / totalCount, processedIndex, totalCount, unsigned(processedData >> 20), unsigned(totalSize >> 20), rate.CurrentRate >> 20);
-				}
-			}
-			if(readed < 0 || readed != desc.RealSize)
-				continue;
+	// Sprawdz dysk w kolejnosci przesuniec
+	sort(m_verifyRanges.begin(), m_verifyRanges.end());
+	return m_verifyRanges.size();
+}
 
-			// Uaktualnij dane
-			processedData += readed;
+void CasterClient::removeExistingBlocks() {
+	infof("Checking existing data...");
 
-			// Sprawdz czy blok sie zgadza
-			if(readed == desc.RealSize && 
-				desc.Hash == Hash::calculateHash(data.c_str(), desc.RealSize)) 
-			{
-				dataOffset = offset;
-				fast_erase(desc.Ranges, desc.Ranges.begin()+i);
-			}
-		}
-		
-		// Sklonuj obszar, gdy mamy poprawne przesuniecie
-		if(dataOffset != ~0ULL && desc.Ranges.size()) {
-			// Statystyki
-			blockCount--;
-			dataSize -= desc.DataSize * rangeCount;
-			realSize -= desc.RealSize * rangeCount;
-
-			debugp("client", "creating CloneDesc [block=%i, ranges=%i]", desc.Id, desc.Ranges.size());
-			// Dodaj obszar do sklonowania
-			m_blockCloneList.push_back(ClientBlockCloneDesc::alloc(dataOffset, desc.RealSize, desc.Ranges.size(), &desc.Ranges[0]));
-			m_blockList.erase(block);	
-			continue;
-		}
+	if(prepareVerify()) {
+		vector<unsigned> blockList;
+		verifyRanges();
+		takeMissingBlocks(blockList);
+		m_verifyRanges.clear();
+	}
 
-		// Usun blok, wszystkie bloky sa poprawne!
-		else if(desc.Ranges.empty()) {
-			blockCount--;
-			dataSize -= desc.DataSize * rangeCount;
-			realSize -= desc.RealSize * rangeCount;
-			m_blockList.erase(block);
-			continue;
-		}
+	MutexLock lock(m_mutex);
 
-		toRecvDataSize += desc.DataSize * rangeCount;
-		toRecvRealSize += desc.RealSize * rangeCount;
+	long long toRecvDataSize = 0, toRecvRealSize = 0;
+	cFurEach(ClientBlockList, block, m_blockList) {
+		toRecvDataSize += block->second.DataSize;
+		toRecvRealSize += block->second.RealSize * block->second.Ranges.size();
 	}
 
-noUpdate:
 	// Komunikat
 	infof("Receiving %i blocks (%iMB|%iMB)...", m_blockList.size(), unsigned(toRecvDataSize >> 20), unsigned(toRecvRealSize >> 20));
 }
 
-void CasterClient::finishImage() {
-	MutexLock lock(m_mutex);
+void CasterClient::startVerify() {
+	vector<unsigned> blockList;
+
+	{
+		MutexLock lock(m_mutex);
+		cFurEach(ClientBlockList, itor, m_blockList)
+			blockList.push_back(itor->first);
+	}
+
+	m_verifying = true;
+	m_verifyFinished = m_verifyAbort = false;
+	m_verifyIndex = 0;
+	m_blockCount = blockList.size();
+
+	infof("Checking existing data, receiving %i missing blocks...", m_blockCount);
+
+	// Bloki spoza pliku od razu, pozostale po sprawdzeniu
+	if(blockList.size())
+		sendGetDataPart(blockList);
+	startReceiving();
+
+	m_verifyReader.start(ThreadDelegate(this, &CasterClient::onVerifyReadThread));
+	Timer::after(TimerDelegate(this, &CasterClient::onVerifyTick), CLIENT_VERIFY_INTERVAL);
+}
 
-	if(!m_file) {
-		assert(m_blockCloneList.empty());
+void CasterClient::stopVerify() {
+	if(!m_verifying)
 		return;
+
+	MutexMe(m_verifyMutex, m_verifyAbort = true);
+	m_verifyReader.join();
+	m_verifying = false;
+}
+
+void CasterClient::finishVerifyRange(ClientVerifyRange& range) {
+	ClientBlockDesc& desc = *range.Block;
+
+	// Zaznacz poprawny obszar, pierwszy z nich bedzie zrodlem klonowania
+	if(range.Valid) {
+		m_verifyOffsets.insert(make_pair(desc.Id, range.Offset));
+		desc.Ranges[range.Index] = ~0ULL;
 	}
 
-	infof("Finalizing image...\n");
+	if(--m_verifyPending[desc.Id])
+		return;
+	m_verifyPending.erase(desc.Id);
 
-	unsigned totalCount = 0;
-	unsigned index = 0;
-	
-	FurEach(ClientBlockCloneList, blockCloneItor, m_blockCloneList) {
-		totalCount += (*blockCloneItor)->RangeCount;
+	// Brak poprawnego obszaru, blok do pobrania
+	map<unsigned, long long>::iterator found = m_verifyOffsets.find(desc.Id);
+	if(found == m_verifyOffsets.end()) {
+		m_verifyMissing.push_back(desc.Id);
+		return;
 	}
 
-	string data;
+	long long dataOffset = found->second;
+	m_verifyOffsets.erase(found);
+
+	desc.Ranges.erase(remove(desc.Ranges.begin(), desc.Ranges.end(), (long long)~0ULL), desc.Ranges.end());
+
+	// Sklonuj obszar, pozostale obszary sa poprawne
+	if(desc.Ranges.size()) {
+		debugp("client", "creating CloneDesc [block=%i, ranges=%i]", desc.Id, desc.Ranges.size());
+		MutexMe(m_mutex, queueClone(dataOffset, desc.RealSize, desc.Ranges.size(), &desc.Ranges[0]));
+	}
+
+	m_verifyBlocks.erase(desc.Id);
+}
+
+bool CasterClient::takeMissingBlocks(vector<unsigned>& blockList) {
+	MutexLock lock(m_verifyMutex);
+
+	{
+		MutexLock blockLock(m_mutex);
+
+		FurEach(vector<unsigned>, id, m_verifyMissing) {
+			ClientBlockList::iterator itor = m_verifyBlocks.find(*id);
+			m_blockList[*id] = itor->second;
+			m_verifyBlocks.erase(itor);
+			blockList.push_back(*id);
+		}
+	}
+
+	m_verifyMissing.clear();
+	return m_verifyFinished;
+}
+
+void CasterClient::verifyRanges() {
+	int fd = fileno(m_file);
+	unsigned count = workerCount();
+	unsigned processedIndex = 0;
+	long long processedData = 0;
+	Rate rate;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	// Hash liczony w watkach, odczyt w tym watku
+	m_verifyStop = false;
+	for(unsigned i = 0; i < count; ++i)
+		m_verifiers[i].start(ThreadDelegate(this, &CasterClient::onVerifyThread));
+
+	unsigned ahead = 0;
+
+	FurEach(ClientVerifyList, range, m_verifyRanges) {
+		unsigned size = range->Block->RealSize;
+
+		// Zapowiedz odczyt kolejnych obszarow
+		for( ; ahead < m_verifyRanges.size() && m_verifyRanges[ahead].Offset < range->Offset + VERIFY_READAHEAD_SIZE; ++ahead)
+			posix_fadvise(fd, m_verifyRanges[ahead].Offset, m_verifyRanges[ahead].Block->RealSize, POSIX_FADV_WILLNEED);
+
+		// Ogranicz ilosc danych czekajacych na hash
+		{
+			MutexLock lock(m_verifyMutex);
+			while(m_verifyBytes && m_verifyBytes + size > VERIFY_QUEUE_SIZE)
+				m_verifyDoneCond.wait(m_verifyMutex);
+			if(m_verifyAbort)
+				break;
+		}
+
+		m_verifyIndex = ++processedIndex;
 
-	FurEach(ClientBlockCloneList, blockCloneItor, m_blockCloneList) {
-		ClientBlockCloneDesc* desc = *blockCloneItor;
-		
 		// Wczytaj dane
-		data.resize(desc->Size);
-		assert(!fseeko64(m_file, desc->Offset, SEEK_SET));
-		assert(fread((void*)data.c_str(), desc->Size, 1, m_file) == 1);
-
-		// Zapisz do obszarow
-		for(unsigned i = 0; i < desc->RangeCount; ++i) {
-			++index;
-			updatef("-- %3i%% -- %3i of %3i range(s) --", 100 * index / totalCount, index, totalCount);
-			assert(!fseeko64(m_file, desc->Ranges[i], SEEK_SET));
-			assert(fwrite(data.c_str(), desc->Size, 1, m_file) == 1);
+		range->Data.resize(size);
+		unsigned done = 0;
+		while(done < size) {
+			ssize_t result = pread64(fd, (char*)range->Data.c_str() + done, size - done, range->Offset + done);
+			if(result < 0 && errno == EINTR)
+				continue;
+			if(result <= 0)
+				break;
+			done += result;
+		}
+
+		// W trakcie pobierania postep pokazuje onShowProgress
+		processedData += done;
+		rate.addBytes(done);
+		if(rate.manualUpdate() && !m_verifying) {
+			updatef("-- %2i%% -- %3i of %3i blocks -- %iMB of %iMB processed -- %3iMB/s --   ", processedIndex * 100 / (unsigned)m_verifyRanges.size(), processedIndex, (unsigned)m_verifyRanges.size(), unsigned(processedData >> 20), unsigned(m_verifyTotal >> 20), rate.CurrentRate >> 20);
+		}
+
+		MutexLock lock(m_verifyMutex);
+
+		// Obszar poza koncem pliku lub blad odczytu, do pobrania
+		if(done != size) {
+			string().swap(range->Data);
+			finishVerifyRange(*range);
+			continue;
 		}
-		fflush(m_file);
+
+		m_verifyBytes += size;
+		m_verifyQueue.push_back(&*range);
+		m_verifyCond.signal();
 	}
 
-	if(m_blockCloneList.size())
-		infof("");
+	// Czekaj na sprawdzenie wszystkich obszarow
+	{
+		MutexLock lock(m_verifyMutex);
+		while(m_verifyBytes)
+			m_verifyDoneCond.wait(m_verifyMutex);
+		m_verifyStop = true;
+	}
 
-	delete_all(m_blockCloneList.begin(), m_blockCloneList.end());
+	for(unsigned i = 0; i < count; ++i)
+		m_verifyCond.signal();
+	for(unsigned i = 0; i < count; ++i)
+		m_verifiers[i].join();
 }
 
 template<typename Type>
@@ -189,21 +271,233 @@ static void onWorkerThreadException() {
 	}
 }
 
-void* CasterClient::onWorkerThread(void*) {
-	Mutex mutex;
-	MutexLock lock(mutex);
+void CasterClient::startWorkers() {
+	m_decoderCount = workerCount();
+	m_busyTime = timef();
+
+	// Kolejka zapisu dostaje czesc wolnej pamieci, bloki po dekompresji czesc kolejki
+	long long memory = (long long)sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+	m_queueBudget = min(max(memory / WRITE_QUEUE_MEMORY_SHARE, MIN_WRITE_QUEUE_SIZE), MAX_WRITE_QUEUE_SIZE);
+	m_decodeBudget = m_queueBudget / WRITE_QUEUE_MEMORY_SHARE;
+
+	for(unsigned i = 0; i < m_decoderCount; ++i)
+		m_decoders[i].start(ThreadDelegate(this, &CasterClient::onDecodeThread));
+
+	// Utworz watek zapisu i klonowania
+	m_worker.start(ThreadDelegate(this, &CasterClient::onWorkerThread));
+	m_cloner.start(ThreadDelegate(this, &CasterClient::onCloneThread));
+
+	debugp("client", "started %i decoders [queue=%iMB, decoded=%iMB]", m_decoderCount, unsigned(m_queueBudget >> 20), unsigned(m_decodeBudget >> 20));
+}
+
+void CasterClient::stopWorkers() {
+	// Bez odbioru danych obszary sa kopiowane w tym watku
+	if(!m_worker) {
+		m_cloneStop = true;
+		if(m_state == Commit)
+			cloneRanges();
+		checkClones();
+		return;
+	}
+
+	infof("Waiting for worker...");
+
+	// Czekaj az worker dokonczy prace
+	waitForWorker();
+
+	// Wyczysc liste blokow
+	{
+		MutexLock lock(m_mutex);
+
+		// bloki z bledem zapisu nie zostaly juz pobrane ponownie
+		if(m_state == Commit && m_blockList.size()) {
+			infof("%i block(s) failed to write, image is not complete!", (unsigned)m_blockList.size());
+			m_state = Ready;
+		}
+		m_blockList.clear();
+		m_requestDone = true;
+		m_decodeStop = true;
+	}
+
+	// Zamknij workery
+	for(unsigned i = 0; i < m_decoderCount; ++i)
+		m_decodeCond.signal();
+	for(unsigned i = 0; i < m_decoderCount; ++i)
+		m_decoders[i].join();
+
+	m_workerCond.signal();
+	m_worker.join();
+
+	// Dokoncz kopiowanie tylko dla odebranego obrazu
+	{
+		MutexLock lock(m_mutex);
+		if(m_state != Commit)
+			m_cloneList.clear();
+		else if(m_cloneList.size())
+			infof("Finalizing image, %i range(s) left to copy...", (unsigned)m_cloneList.size());
+		m_cloneStop = true;
+	}
+
+	m_cloneCond.signal();
+	m_cloner.join();
+	checkClones();
+}
+
+void CasterClient::checkClones() {
+	if(m_cloneFailed && m_state == Commit) {
+		infof("Failed to copy %i range(s), image is not complete!", m_cloneFailed);
+		m_state = Ready;
+	}
+}
+
+void CasterClient::waitForWorker() {
+	while(m_queuedBlocks)
+		usleep(300 * 1000);
+}
+
+unsigned CasterClient::workerCount() const {
+	unsigned count = Decoders ? Decoders : (unsigned)max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+	return min(count, MAX_CLIENT_DECODERS);
+}
+
+void CasterClient::queueClone(long long offset, unsigned size, unsigned rangeCount, const long long* ranges) {
+	for(unsigned i = 0; i < rangeCount; ++i) {
+		ClientCloneRange range;
+		range.Source = offset;
+		range.Size = size;
+		range.Retries = 0;
+		m_cloneList.insert(make_pair(ranges[i], range));
+	}
+	m_cloneCond.signal();
+}
+
+void CasterClient::queueBlock(ClientBlockData* block) {
+	m_blockFinishList.push_back(block);
+	++m_queuedBlocks;
+	m_compressedBytes += block->DataSize;
+	m_decodeCond.signal();
+}
+
+void CasterClient::stageUtilization(float& decode, float& write) {
+	MutexLock lock(m_mutex);
+
+	double currentTime = timef();
+	double elapsed = max(currentTime - m_busyTime, 0.001);
+
+	decode = float((m_decodeBusy - m_shownDecodeBusy) / elapsed / max(m_decoderCount, 1U));
+	write = float((m_writeBusy - m_shownWriteBusy) / elapsed);
+
+	m_busyTime = currentTime;
+	m_shownDecodeBusy = m_decodeBusy;
+	m_shownWriteBusy = m_writeBusy;
+}
+
+static void writeData(int fd, const string& data, long long offset) {
+	for(unsigned done = 0; done < data.size(); ) {
+		ssize_t result = pwrite64(fd, data.c_str() + done, data.size() - done, offset + done);
+		if(result < 0 && errno == EINTR)
+			continue;
+		if(result <= 0)
+			throw runtime_error(va("pwrite failed at %lli: %s", offset + done, strerror(errno)));
+		done += result;
+	}
+}
+
+static void copyRange(int fd, long long source, long long offset, unsigned size, bool& kernelCopy, string& buffer) {
+	// Kopia w jadrze, dane nie przechodza przez pamiec procesu
+	while(kernelCopy && size) {
+		loff_t in = source, out = offset;
+		ssize_t result = copy_file_range(fd, &in, fd, &out, size, 0);
+		if(result < 0 && errno == EINTR)
+			continue;
+		if(result <= 0) {
+			// Brak obslugi w jadrze lub systemie plikow (np. urzadzenie blokowe)
+			kernelCopy = false;
+			break;
+		}
+		source += result;
+		offset += result;
+		size -= result;
+	}
+
+	if(!size)
+		return;
+
+	buffer.resize(size);
+	for(unsigned done = 0; done < size; ) {
+		ssize_t result = pread64(fd, (char*)buffer.c_str() + done, size - done, source + done);
+		if(result < 0 && errno == EINTR)
+			continue;
+		if(result <= 0)
+			throw runtime_error(va("pread failed at %lli: %s", source + done, strerror(errno)));
+		done += result;
+	}
+	writeData(fd, buffer, offset);
+}
+
+void CasterClient::cloneRanges() {
+	int fd = fileno(m_file);
+	bool kernelCopy = true;
+	string buffer;
+
+	while(true) {
+		long long offset;
+		ClientCloneRange range;
 
+		// Kolejny obszar za ostatnio skopiowanym, po koncu od poczatku
+		{
+			MutexLock lock(m_mutex);
+			while(!m_cloneStop && m_cloneList.empty())
+				m_cloneCond.wait(m_mutex);
+			if(m_cloneList.empty())
+				break;
+
+			ClientCloneList::iterator itor = m_cloneList.lower_bound(m_clonePos);
+			if(itor == m_cloneList.end())
+				itor = m_cloneList.begin();
+			offset = itor->first;
+			range = itor->second;
+			m_cloneList.erase(itor);
+		}
+
+		try {
+			copyRange(fd, range.Source, offset, range.Size, kernelCopy, buffer);
+		}
+		catch(exception& e) {
+			infof("-- cloner -- got exception (%s): %s --", typeid(e).name(), e.what());
+
+			// ponow po przejsciu pozostalych obszarow, potem obraz jest niekompletny
+			MutexLock lock(m_mutex);
+			if(++range.Retries < CLIENT_CLONE_RETRIES)
+				m_cloneList.insert(make_pair(offset, range));
+			else
+				++m_cloneFailed;
+		}
+		m_clonePos = offset + range.Size;
+	}
+}
+
+void* CasterClient::onDecodeThread(void*) {
 	set_unexpected(onWorkerThreadException);
 	set_terminate(onWorkerThreadException);
 
-	assert(m_file);
+	while(true) {
+		auto_ptr<ClientBlockData> desc;
+		unsigned seq;
 
-	while(m_blockList.size() || m_blockFinishList.size()) {
-		try {
-		// Uspij mnie
-		if(m_blockFinishList.empty()) {
-			m_workerCond.wait(mutex);
-			continue;
+		{
+			MutexLock lock(m_mutex);
+			// Gdy zapis nie nadaza, nadmiar czeka w kolejce skompresowany
+			while(!m_decodeStop && (m_blockFinishList.empty() || 
+				(m_decodedBytes && m_decodedBytes + m_blockFinishList.front()->RealSize > m_decodeBudget)))
+				m_decodeCond.wait(m_mutex);
+			if(m_decodeStop)
+				break;
+
+			desc.reset(popFromQueue(m_blockFinishList));
+			seq = m_decodeSeq++;
+			m_compressedBytes -= desc->DataSize;
+			m_decodedBytes += desc->RealSize;
 		}
 
 #ifndef _DEBUG
@@ -211,49 +505,145 @@ void* CasterClient::onWorkerThread(void*) {
 			usleep(atoi(getenv("CASTERWORKER_SLEEP")) * 1000);
 #endif
 
-		// Przetworz kolejny blok
-		auto_ptr<ClientBlockData> desc;
+		double startTime = timef();
+
+		// Dekompresuj dane, blok z bledem tez trafia do zapisu (zachowuje kolejnosc)
+		auto_ptr<ClientBlockWrite> block(new ClientBlockWrite(*desc));
+		try {
+			block->Data = Compressor::decompress(desc->Data, desc->DataSize, desc->RealSize);
+			block->Valid = block->Data.size() == desc->RealSize;
+		}
+		catch(exception& e) {
+			infof("-- decoder -- got exception (%s): %s --", typeid(e).name(), e.what());
+		}
+		desc.reset();
+
+		{
+			MutexLock lock(m_mutex);
+			m_decodeBusy += timef() - startTime;
+			m_writeList[seq] = block.release();
+		}
+		m_workerCond.signal();
+	}
+	return NULL;
+}
+
+void* CasterClient::onVerifyThread(void*) {
+	set_unexpected(onWorkerThreadException);
+	set_terminate(onWorkerThreadException);
+
+	while(true) {
+		ClientVerifyRange* range;
+
+		{
+			MutexLock lock(m_verifyMutex);
+			while(!m_verifyStop && m_verifyQueue.empty())
+				m_verifyCond.wait(m_verifyMutex);
+			if(m_verifyQueue.empty())
+				break;
+
+			range = popFromQueue(m_verifyQueue);
+		}
+
+		unsigned size = range->Data.size();
+		range->Valid = range->Block->Hash == Hash::calculateHash(range->Data.c_str(), size);
+		string().swap(range->Data);
+
+		{
+			MutexLock lock(m_verifyMutex);
+			finishVerifyRange(*range);
+			m_verifyBytes -= size;
+		}
+		m_verifyDoneCond.signal();
+	}
+	return NULL;
+}
+
+void* CasterClient::onCloneThread(void*) {
+	set_unexpected(onWorkerThreadException);
+	set_terminate(onWorkerThreadException);
+
+	cloneRanges();
+	return NULL;
+}
+
+void* CasterClient::onVerifyReadThread(void*) {
+	set_unexpected(onWorkerThreadException);
+	set_terminate(onWorkerThreadException);
+
+	verifyRanges();
+
+	MutexMe(m_verifyMutex, m_verifyFinished = true);
+	return NULL;
+}
+
+void* CasterClient::onWorkerThread(void*) {
+	set_unexpected(onWorkerThreadException);
+	set_terminate(onWorkerThreadException);
+
+	assert(m_file);
+	int fd = fileno(m_file);
+
+	while(true) {
+		auto_ptr<ClientBlockWrite> block;
+
+		// Bloki sa zapisywane w kolejnosci odbioru
 		{
 			MutexLock lock(m_mutex);
-			desc.reset(m_blockFinishList.front());
-			m_blockFinishList.pop_front();
+			ClientBlockWriteList::iterator itor;
+			while((itor = m_writeList.find(m_writeSeq)) == m_writeList.end()) {
+				if(m_requestDone && m_blockList.empty() && !m_queuedBlocks)
+					return NULL;
+				m_workerCond.wait(m_mutex);
+			}
+
+			block.reset(itor->second);
+			m_writeList.erase(itor);
+			++m_writeSeq;
 		}
 
-		// Dekompresuj dane
-		string data = Compressor::decompress(desc->Data, desc->DataSize, desc->RealSize);
-		assert(data.size() == desc->RealSize);
+		double startTime = timef();
+		bool failed = !block->Valid;
 
+		try {
 		// Zapisz tylko do okreslonej ilosci obszarow
 		unsigned written = 0;
 
-		for( ; written < desc->Ranges.size(); ++written) {
-			// przerwij jeli ilo blokw w kolejce dojdzie do limitu
-			if(written > 1 && m_blockFinishList.size() >= MAX_BLOCKS_IN_WRITE_QUEUE/2)
+		for( ; block->Valid && written < block->Ranges.size(); ++written) {
+			// przerwij jesli kolejka zajmie polowe budzetu
+			if(written > 1 && queuedBytes() >= m_queueBudget/2)
 				break;
 
-			assert(!fseeko64(m_file, desc->Ranges[written], SEEK_SET));
-			assert(fwrite(data.c_str(), data.size(), 1, m_file) == 1);
+			writeData(fd, block->Data, block->Ranges[written]);
 		}
-		
-		fflush(m_file);
 
 		// Dodaj do listy obszarow do klonowania
-		if(desc->Ranges.size() > written) {
-			debugp("client", "creating CloneDesc [block=%i, ranges=%i]", desc->Id, desc->Ranges.size() - written);
-			m_blockCloneList.push_back(ClientBlockCloneDesc::alloc(desc->Ranges[0], desc->RealSize, desc->Ranges.size() - written, &desc->Ranges[written]));
+		if(block->Valid && block->Ranges.size() > written) {
+			debugp("client", "creating CloneDesc [block=%i, ranges=%i]", block->Id, block->Ranges.size() - written);
+			MutexMe(m_mutex, queueClone(block->Ranges[0], block->RealSize, block->Ranges.size() - written, &block->Ranges[written]));
 		}
 
-		// Timeout!
-		debugp("clientworker", "finished block [block=%i]", desc->Id);
+		debugp("clientworker", "finished block [block=%i, valid=%i]", block->Id, block->Valid);
 		}
 		catch(exception& e) {
 			infof("-- worker -- got exception (%s): %s --", typeid(e).name(), e.what());
-			//exit(-2);
+			failed = true;
 		}
-		catch(...) {
-			infof("-- worker -- got unhandled exception --");
-			//exit(-1);
+
+		if(failed)
+			infof("Block %i failed to decode or write, requesting it again", block->Id);
+
+		{
+			MutexLock lock(m_mutex);
+			m_writeBusy += timef() - startTime;
+			m_decodedBytes -= block->RealSize;
+
+			// blok z bledem wraca na liste, pobierze go kolejne zadanie
+			if(failed)
+				m_blockList[block->Id] = *block;
+			--m_queuedBlocks;
 		}
+		m_decodeCond.signal();
 	}
 	return NULL;
 }
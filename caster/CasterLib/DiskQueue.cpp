@@ -0,0 +1,128 @@
+#define DEBUG_LEVEL SERVER_DEBUG_LEVEL
+#include "CasterLib.hpp"
+
+const double DISK_POLL_INTERVAL = 0.002;
+
+void CasterDiskJob::release(CasterDiskJob* job) {
+	if(!job)
+		return;
+
+	// zadanie wciaz jest w kolejce
+	if(!job->m_finished) {
+		job->m_detached = true;
+		return;
+	}
+	delete job;
+}
+
+#ifdef USE_DISK_FILE
+void CasterBlockReadJob::run() {
+	// osobny plik bloka otwierany jest tutaj, nie w petli zdarzen
+	if(File.open() && File.map())
+		File.prefetch();
+}
+
+BlockDataFile CasterBlockReadJob::take() {
+	BlockDataFile file = File;
+	File = BlockDataFile();
+	return file;
+}
+#endif // USE_DISK_FILE
+
+CasterDiskQueue::CasterDiskQueue(unsigned workerCount) {
+	m_workerCount = min<unsigned>(max<unsigned>(workerCount, 1), MAX_DISK_WORKERS);
+	m_pending = 0;
+	m_polling = false;
+	m_stop = false;
+
+	for(unsigned i = 0; i < m_workerCount; ++i)
+		m_workers[i].start(ThreadDelegate(this, &CasterDiskQueue::onWorkerThread));
+
+	debugp("diskqueue", "started %i workers", m_workerCount);
+}
+
+CasterDiskQueue::~CasterDiskQueue() {
+	Timer::cancel(TimerDelegate(this, &CasterDiskQueue::onPoll));
+
+	// Zatrzymaj watki
+	MutexMe(m_mutex, m_stop = true);
+
+	for(unsigned i = 0; i < m_workerCount; ++i)
+		m_cond.signal();
+	for(unsigned i = 0; i < m_workerCount; ++i)
+		m_workers[i].join();
+
+	// Usun niewykonane zadania
+	delete_all(m_jobList.begin(), m_jobList.end());
+	delete_all(m_doneList.begin(), m_doneList.end());
+}
+
+void* CasterDiskQueue::onWorkerThread(void*) {
+	while(true) {
+		CasterDiskJob* job = NULL;
+
+		{
+			MutexLock lock(m_mutex);
+			while(!m_stop && m_jobList.empty())
+				m_cond.wait(m_mutex);
+			if(m_stop)
+				break;
+
+			job = m_jobList.front();
+			m_jobList.pop_front();
+		}
+
+		try {
+			job->run();
+		}
+		catch(exception& e) {
+			infof("-- diskqueue -- got exception (%s): %s --", typeid(e).name(), e.what());
+		}
+
+		MutexMe(m_mutex, m_doneList.push_back(job));
+	}
+	return NULL;
+}
+
+double CasterDiskQueue::onPoll(unsigned) {
+	poll();
+	if(m_pending)
+		return DISK_POLL_INTERVAL;
+
+	m_polling = false;
+	return DESTROY_TIMER;
+}
+
+void CasterDiskQueue::push(CasterDiskJob* job) {
+	assert(job && !job->m_finished);
+
+	++m_pending;
+
+	// Sprawdzaj wyniki dopoki sa zadania w kolejce
+	if(!m_polling) {
+		m_polling = true;
+		Timer::after(TimerDelegate(this, &CasterDiskQueue::onPoll), DISK_POLL_INTERVAL);
+	}
+
+	MutexMe(m_mutex, m_jobList.push_back(job));
+	m_cond.signal();
+}
+
+unsigned CasterDiskQueue::poll() {
+	CasterDiskJobList doneList;
+	MutexMe(m_mutex, doneList.swap(m_doneList));
+
+	FurEach(CasterDiskJobList, itor, doneList) {
+		CasterDiskJob* job = *itor;
+		--m_pending;
+		job->m_finished = true;
+
+		// wlasciciel juz nie czeka na wynik
+		if(job->m_detached) {
+			delete job;
+			continue;
+		}
+		job->done();
+	}
+	return doneList.size();
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+class CasterDiskQueue;
+
+//! Zadanie wykonywane poza petla zdarzen
+class CasterDiskJob
+{
+	// Fields
+private:
+	bool m_finished;
+	bool m_detached;
+
+	// Constructor
+public:
+	CasterDiskJob() : m_finished(false), m_detached(false) {}
+
+	// Destructor
+public:
+	virtual ~CasterDiskJob() {}
+
+	// Handlers
+protected:
+	//! Wykonywane w watku dyskowym
+	virtual void run() = 0;
+
+	//! Wykonywane w petli zdarzen po zakonczeniu run()
+	virtual void done() {}
+
+	// Methods
+public:
+	bool finished() const { return m_finished; }
+
+	//! Zwalnia zadanie, jesli jest jeszcze wykonywane usunie je kolejka
+	static void release(CasterDiskJob* job);
+
+	friend class CasterDiskQueue;
+};
+
+typedef deque<CasterDiskJob*> CasterDiskJobList;
+
+#ifdef USE_DISK_FILE
+//! Otwiera i mapuje dane bloka, wczytuje je do pamieci
+class CasterBlockReadJob : public CasterDiskJob
+{
+	// Fields
+public:
+	unsigned Id;
+	BlockDataFile File;
+
+	// Constructor
+public:
+	CasterBlockReadJob(unsigned id, const BlockDataFile& file) : Id(id), File(file) {}
+
+	// Destructor
+public:
+	~CasterBlockReadJob() { File.close(); }
+
+	// Handlers
+protected:
+	void run();
+
+	// Methods
+public:
+	//! Przekazuje otwarty plik wlascicielowi
+	BlockDataFile take();
+};
+#endif // USE_DISK_FILE
+
+//! Pula watkow wykonujaca operacje dyskowe, wyniki wracaja do petli zdarzen
+class CasterDiskQueue
+{
+	// Fields
+private:
+	Thread m_workers[MAX_DISK_WORKERS];
+	unsigned m_workerCount;
+
+	Mutex m_mutex;
+	Cond m_cond;
+	CasterDiskJobList m_jobList;
+	CasterDiskJobList m_doneList;
+	unsigned m_pending;
+	bool m_polling;
+	bool m_stop;
+
+	// Constructor
+public:
+	CasterDiskQueue(unsigned workerCount = DEFAULT_DISK_WORKERS);
+
+	// Destructor
+public:
+	~CasterDiskQueue();
+
+	// Handlers
+private:
+	void* onWorkerThread(void*);
+	double onPoll(unsigned);
+
+	// Methods
+public:
+	//! Dodaje zadanie do wykonania
+	void push(CasterDiskJob* job);
+
+	//! Konczy wykonane zadania (wywoluje done())
+	unsigned poll();
+
+	unsigned pending() const { return m_pending; }
+};
@@ -33,7 +33,20 @@ enum ClientPacketType
 	CLIENTPT_SendData,
 
 	//! Koniec transmisji
-	CLIENTPT_SendCommit
+	CLIENTPT_SendCommit,
+
+	//! Rzada kolejnej czesci danych, gdy opis urzadzenia jest jeszcze odbierany
+	// <length>
+	//	<sector-id:unsigned>
+	CLIENTPT_GetDataPart,
+
+	//! Konczy zadanie wysylane w czesciach
+	CLIENTPT_GetDataDone,
+
+	//! Bloki odebrane z karuzeli (jedyna informacja zwrotna odbiorcy karuzeli)
+	// <length>
+	//	<sector-id:unsigned>
+	CLIENTPT_GotData
 };
 
 enum ServerPacketType
@@ -58,7 +71,28 @@ enum ServerPacketType
 	SERVERPT_SendImage,
 	SERVERPT_BlockList,
 
-	SERVERPT_Message
+	SERVERPT_Message,
+
+	//! Naglowek bloka wysylanego w czesciach (bez danych)
+	// <sector-id:unsigned>
+	// <hash:Hash>
+	// <data-size:unsigned>
+	SERVERPT_BlockDataStream,
+
+	//! Kolejna czesc danych bloka
+	// <sector-id:unsigned>
+	// <offset:unsigned>
+	// <data>
+	SERVERPT_BlockDataPart,
+
+	//! Skompresowana lista blokow urzadzenia (zamiast SERVERPT_Block, moze byc wyslana w kilku czesciach)
+	// <block-count:unsigned>
+	// <real-size:unsigned>
+	// <data:compressed>
+	//   <sector-id:unsigned> <data-size:unsigned> <real-size:unsigned> <hash:Hash>
+	//   <length:unsigned>
+	//     <start:long long> <stride:long long> <count:unsigned>
+	SERVERPT_Manifest
 };
 
 enum CasterFinishedErrorCode {
@@ -91,6 +125,7 @@ struct CasterPacketFinished : CasterPacket {
 
 struct CasterPacketGetImage : CasterPacket {
 	char DeviceName[MAX_DEVICE_NAME];
+	unsigned short Version;
 };
 
 struct CasterPacketGetPong : CasterPacket {
@@ -118,6 +153,7 @@ struct CasterPacketImage : CasterPacket {
 	unsigned short Version;
 	char ImageName[MAX_IMAGE_NAME];
 	unsigned Multicast;
+	byte Carousel; // ilosc warstw karuzeli, ktora wysyla multicast (bez dolaczania), 0 - brak
 };
 
 struct CasterPacketBlock : CasterPacket {
@@ -176,6 +212,49 @@ struct CasterPacketBlockData : CasterPacket {
 	}
 };
 
+struct CasterPacketBlockDataPart : CasterPacket {
+	unsigned Id;
+	unsigned Offset;
+
+	const char* data() const {
+		return (const char*)(this+1);
+	}
+	char* data() {
+		return (char*)(this+1);
+	}
+};
+
+struct CasterManifestExtent {
+	long long Start;
+	long long Stride;
+	unsigned Count;
+};
+
+struct CasterManifestBlock {
+	unsigned Id;
+	unsigned DataSize, RealSize;
+	::Hash Hash;
+	unsigned Count;
+	CasterManifestExtent List[1];
+
+	static unsigned size(unsigned count) {
+		return sizeof(CasterManifestBlock) + count * sizeof(CasterManifestExtent) - sizeof(CasterManifestExtent);
+	}
+
+	unsigned size() const {
+		return size(Count);
+	}
+};
+
+struct CasterPacketManifest : CasterPacket {
+	unsigned BlockCount;
+	unsigned RealSize;
+
+	const char* data() const {
+		return (const char*)(this+1);
+	}
+};
+
 struct CasterPacketSenderHash {
 	unsigned Id;
 	::Hash Hash;
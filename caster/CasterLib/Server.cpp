@@ -3,31 +3,171 @@
 #include "Common.hpp"
 
 const double STATS_INTERVAL = 1.0;
+const unsigned MANIFEST_FILE_MAGIC = 0x464d4343; // CCMF
+const unsigned MANIFEST_FILE_VERSION = 2;
+const unsigned MANIFEST_CHUNK_BLOCKS = 1024;
+
+struct CasterManifestFileHeader {
+	unsigned Magic;
+	unsigned Version;
+	unsigned Count;
+	unsigned Size;
+	unsigned Crc32;
+
+	//! Wersja urzadzenia w bazie, z ktorej zbudowano opis
+	unsigned Revision;
+};
 
 #ifdef _WIN32
 //#define LOCALHOST
 #endif
 
+void CasterServerBlockUsage::link(unsigned id, Usage& usage) {
+	if(usage.Count >= m_buckets.size())
+		m_buckets.resize(usage.Count + 1);
+
+	UsageBucket& bucket = m_buckets[usage.Count];
+	usage.Index = bucket.size();
+	bucket.push_back(id);
+
+	m_maxCount = max(m_maxCount, usage.Count);
+}
+
+void CasterServerBlockUsage::unlink(unsigned id, Usage& usage) {
+	UsageBucket& bucket = m_buckets[usage.Count];
+	assert(usage.Index < bucket.size() && bucket[usage.Index] == id);
+
+	// przenies ostatni element na zwolnione miejsce
+	unsigned lastId = bucket.back();
+	if(lastId != id) {
+		bucket[usage.Index] = lastId;
+		m_usage[lastId].Index = usage.Index;
+	}
+	bucket.pop_back();
+
+	while(m_maxCount && m_buckets[m_maxCount].empty())
+		--m_maxCount;
+}
+
+unsigned CasterServerBlockUsage::add(unsigned id) {
+	pair<UsageList::iterator, bool> result = m_usage.insert(make_pair(id, Usage()));
+	Usage& usage = result.first->second;
+
+	if(result.second)
+		usage.Count = 0;
+	else
+		unlink(id, usage);
+
+	++usage.Count;
+	link(id, usage);
+	return usage.Count;
+}
+
+unsigned CasterServerBlockUsage::remove(unsigned id) {
+	UsageList::iterator itor = m_usage.find(id);
+	if(itor == m_usage.end())
+		return 0;
+
+	Usage& usage = itor->second;
+	unlink(id, usage);
+
+	if(--usage.Count == 0) {
+		m_usage.erase(itor);
+		return 0;
+	}
+
+	link(id, usage);
+	return usage.Count;
+}
+
+void CasterServerBlockUsage::erase(unsigned id) {
+	UsageList::iterator itor = m_usage.find(id);
+	if(itor == m_usage.end())
+		return;
+
+	unlink(id, itor->second);
+	m_usage.erase(itor);
+}
+
+unsigned CasterServerBlockUsage::count(unsigned id) const {
+	UsageList::const_iterator itor = m_usage.find(id);
+	if(itor == m_usage.end())
+		return 0;
+	return itor->second.Count;
+}
+
+unsigned CasterServerBlockUsage::next(unsigned& count, const vector<unsigned>& exclude) const {
+	for(unsigned i = m_maxCount; i > 0; --i) {
+		const UsageBucket& bucket = m_buckets[i];
+		if(bucket.empty())
+			continue;
+
+		// randomize send block (skip excluded ones, list is short)
+		unsigned start = rand() % bucket.size();
+		for(unsigned j = 0; j < bucket.size(); ++j) {
+			unsigned id = bucket[(start + j) % bucket.size()];
+			if(std::find(exclude.begin(), exclude.end(), id) != exclude.end())
+				continue;
+
+			count = i;
+			return id;
+		}
+	}
+
+	count = 0;
+	return 0;
+}
+
 CasterServer::CasterServer(const CasterServerArgs& args) : CasterServerArgs(args) {
 	debugp("server", "creating...");
 
 	m_imageDesc = ImageDesc::loadImageFromFile(ImageName);
+	m_diskQueue.reset(new CasterDiskQueue());
 
 	createServer(Port, Address);
 
 	m_castServer.reset(new CasterUdpServer(*this));//
 #ifndef LOCALHOST
 	m_castServer->createServer(Port, Address, false);
-	m_castServer->setSendAddress(Port, Maddress);
+	m_castServer->setGroupAddress(Port, Maddress);
 #else
 	m_castServer->createServer(Port+1, Address, false);
-	m_castServer->setSendAddress(Port, Address);
+	m_castServer->setGroupAddress(Port, Address);
 #endif
 	m_castServer->setBlocking(true);
-	m_castServer->setLimitSendRate(Rate);
+	// predkosc ogranicza pacer serwera, wiec paczki sendmmsg moga byc zawsze
+	m_castServer->PaceRate = Rate;
+	m_castServer->BatchSend = true;
 	m_castServer->setSendBufferSize(262144);
 	m_castServer->SlownessFactor = 5;
 	m_castServer->MaxSize = args.FragSize;
+	m_castServer->TargetRate = Rate;
+	m_castServer->FecGroup = args.FecGroup;
+
+	if(Carousel) {
+		// karuzela tylko wysyla, port jest dowolny
+		m_carouselServer.reset(new CasterCarouselServer(*this));
+		m_carouselServer->createServer(0, Address, false);
+#ifndef LOCALHOST
+		m_carouselServer->setSendAddress(Port, Maddress);
+#else
+		m_carouselServer->setSendAddress(Port, Address);
+#endif
+		m_carouselServer->setBlocking(true);
+		m_carouselServer->setLimitSendRate(Rate);
+		m_carouselServer->setSendBufferSize(262144);
+		m_carouselServer->MaxSize = args.FragSize;
+
+		if(Layers > 1) {
+#ifndef LOCALHOST
+			m_carouselServer->setLayers(Layers, Port, Maddress);
+#else
+			m_carouselServer->setLayers(Layers, Port, Address);
+#endif
+			// szybsi odbiorcy nie czekaja na wolniejszych, ci dokoncza blok w kolejnej turze
+			m_carouselServer->ObjectRound = 2;
+		}
+	}
 
 	Timer::after(TimerDelegate(this, &CasterServer::showServerStats), STATS_INTERVAL);
 }
@@ -52,51 +192,214 @@ void CasterServer::sendBlockInfo(unsigned id, Hash hash) {
 	}
 }
 
-void CasterServer::addBlockToSend(CasterSessionClient* owner, unsigned id) {
-	if(!owner->m_multiCast) {
-		return;
+void CasterServer::buildManifest(const DeviceManifest& manifest, CasterManifestPacketList& packets) {
+	packets.clear();
+
+	for(unsigned first = 0; first < manifest.size(); first += MANIFEST_CHUNK_BLOCKS) {
+		unsigned last = min<unsigned>(first + MANIFEST_CHUNK_BLOCKS, manifest.size());
+
+		// policz rozmiar danych
+		unsigned size = 0;
+		for(unsigned i = first; i < last; ++i)
+			size += CasterManifestBlock::size(manifest[i].Extents.size());
+
+		// zapisz bloki z zakresami przesuniec
+		string data(size, 0);
+		unsigned offset = 0;
+
+		for(unsigned i = first; i < last; ++i) {
+			const BlockManifestInfo& block = manifest[i];
+			CasterManifestBlock* info = (CasterManifestBlock*)&data[offset];
+			info->Id = block.Id;
+			info->DataSize = block.DataSize;
+			info->RealSize = block.RealSize;
+			info->Hash = block.Hash;
+			info->Count = block.Extents.size();
+
+			for(unsigned j = 0; j < info->Count; ++j) {
+				info->List[j].Start = block.Extents[j].Start;
+				info->List[j].Stride = block.Extents[j].Stride;
+				info->List[j].Count = block.Extents[j].Count;
+			}
+			offset += info->size();
+		}
+
+		CasterPacketManifest packet;
+		packet.Type = SERVERPT_Manifest;
+		packet.BlockCount = last - first;
+		packet.RealSize = data.size();
+
+		packets.push_back(string((const char*)&packet, sizeof(packet)));
+		packets.back() += Compressor::compress(data.c_str(), data.size(), CmZlib);
+	}
+}
+
+bool CasterServer::loadManifest(const string& fileName, unsigned revision, CasterManifestPacketList& packets) {
+	FILE* file = fopen64(fileName.c_str(), "rb");
+	if(!file)
+		return false;
+
+	string data;
+	CasterManifestFileHeader header;
+	bool valid = fread(&header, sizeof(header), 1, file) == 1 &&
+		header.Magic == MANIFEST_FILE_MAGIC && header.Version == MANIFEST_FILE_VERSION && header.Revision == revision;
+
+	if(valid) {
+		data.resize(header.Size);
+		valid = (data.empty() || fread(&data[0], data.size(), 1, file) == 1) &&
+			Hash::crc32(data.c_str(), data.size()) == header.Crc32;
+	}
+
+	fclose(file);
+
+	// podziel na pakiety: <size:unsigned> <packet>
+	packets.clear();
+
+	for(unsigned offset = 0; valid && offset < data.size(); ) {
+		unsigned size;
+		valid = offset + sizeof(size) <= data.size();
+		if(!valid)
+			break;
+		memcpy(&size, &data[offset], sizeof(size));
+		offset += sizeof(size);
+
+		valid = size >= sizeof(CasterPacketManifest) && size <= data.size() - offset;
+		if(!valid)
+			break;
+		packets.push_back(data.substr(offset, size));
+		offset += size;
 	}
 
-	unsigned& count = m_blockList[id];
+	valid = valid && packets.size() == header.Count;
+	if(!valid)
+		packets.clear();
+	return valid;
+}
 
-	// add to internal list
-	if(count == 0) {
-		++count;
+void CasterServer::saveManifest(const string& fileName, unsigned revision, const CasterManifestPacketList& packets) {
+	string data;
+	cFurEach(CasterManifestPacketList, packet, packets) {
+		unsigned size = packet->size();
+		data.append((const char*)&size, sizeof(size));
+		data.append(*packet);
 	}
 
-	// remove from internal list
-	else if(count == 1) {
-		++count;
+	CasterManifestFileHeader header;
+	header.Magic = MANIFEST_FILE_MAGIC;
+	header.Version = MANIFEST_FILE_VERSION;
+	header.Count = packets.size();
+	header.Size = data.size();
+	header.Crc32 = Hash::crc32(data.c_str(), data.size());
+	header.Revision = revision;
+
+	// zapisz do pliku tymczasowego i podmien
+	string tempName = fileName + ".tmp";
+	FILE* file = fopen64(tempName.c_str(), "wb");
+	if(!file)
+		return;
+
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1 && 
+		(data.empty() || fwrite(data.c_str(), data.size(), 1, file) == 1);
+
+	if(fclose(file) == 0 && written)
+		rename(tempName.c_str(), fileName.c_str());
+	else
+		unlink(tempName.c_str());
+}
+
+const CasterManifestPacketList& CasterServer::deviceManifest(const DeviceDesc& device) {
+	string fileName = m_imageDesc->manifestFileName(device.id());
+	CasterServerManifest& manifest = m_manifestList[device.id()];
+
+	// urzadzenie moglo zostac zmienione przez inny proces (add, clone)
+	unsigned revision = device.revision();
+
+	// opis w pamieci jest aktualny dopoki plik nie zostal usuniety lub podmieniony
+	struct stat64 info;
+	bool exists = stat64(fileName.c_str(), &info) == 0;
+	if(exists && manifest.FileInode && manifest.Revision == revision &&
+		manifest.FileSize == info.st_size && manifest.FileTime == info.st_mtime && manifest.FileInode == (unsigned long long)info.st_ino)
+		return manifest.Packets;
+
+	if(!exists || !loadManifest(fileName, revision, manifest.Packets)) {
+		// zbuduj opis z bazy danych (brakujacy blok przerywa budowe, niepelny opis nie jest zapisywany)
+		DeviceManifest blocks;
+		device.manifest(blocks);
+		buildManifest(blocks, manifest.Packets);
+		saveManifest(fileName, revision, manifest.Packets);
+
+		debugp("server", "built manifest [device=%i, blocks=%i, packets=%i]", device.id(), blocks.size(), manifest.Packets.size());
+
+		exists = stat64(fileName.c_str(), &info) == 0;
 	}
 
-	// increase counter
-	else {
-		++count;
+	// zapamietaj stan pliku
+	manifest.FileSize = exists ? info.st_size : 0;
+	manifest.FileTime = exists ? info.st_mtime : 0;
+	manifest.FileInode = exists ? info.st_ino : 0;
+	manifest.Revision = revision;
+	return manifest.Packets;
+}
+
+void CasterServer::addBlockToSend(CasterSessionClient* owner, unsigned id) {
+	if(!owner->m_multiCast) {
+		return;
 	}
+
+	// increase counter
+	m_blockOwners[id].insert(owner);
+	updateBlockUsage(id, m_blockList.add(id));
 }
 
 void CasterServer::removeBlockFromSend(CasterSessionClient* owner, unsigned id) {
 	if(!owner->m_multiCast)
 		return;
 
-	unsigned& count = m_blockList[id];
+	// blok usuniety z multicastu (dropBlock) nie jest juz liczony
+	CasterServerBlockOwners::iterator owners = m_blockOwners.find(id);
+	if(owners == m_blockOwners.end() || !owners->second.erase(owner))
+		return;
+	if(owners->second.empty())
+		m_blockOwners.erase(owners);
 
-	assert(count != 0);
+	assert(m_blockList.count(id) != 0);
 
-	// remove from internal list
-	if(count == 1) {
-		m_blockList.erase(id);
+	// decrease counter (removes block from list on zero)
+	updateBlockUsage(id, m_blockList.remove(id));
+}
+
+void CasterServer::dropBlock(unsigned id, bool invalid) {
+	m_blockList.erase(id);
+	updateBlockUsage(id, 0);
+
+	// sesje nie czekaja juz na blok z multicastu
+	set<CasterSessionClient*> owners;
+	CasterServerBlockOwners::iterator itor = m_blockOwners.find(id);
+	if(itor != m_blockOwners.end()) {
+		owners.swap(itor->second);
+		m_blockOwners.erase(itor);
 	}
 
-	// add to internal list
-	else if(count == 2) {
-		--count;
+	// blok bez danych nie moze byc wyslany, pozostale ida przez TCP
+	FurEach(set<CasterSessionClient*>, owner, owners) {
+		if(invalid)
+			(*owner)->removeBlockFromList(id);
+		else
+			(*owner)->sendBlockLocally(id);
 	}
+}
 
-	// decrease counter
-	else {
-		--count;
+void CasterServer::updateBlockUsage(unsigned id, unsigned count) {
+	// tylko sesje multicast czekajace na blok uzywaja licznika
+	CasterServerBlockOwners::iterator owners = m_blockOwners.find(id);
+	if(owners != m_blockOwners.end()) {
+		FurEach(set<CasterSessionClient*>, client, owners->second)
+			(*client)->updateBlockUsage(id, count);
 	}
+
+	// zaden klient nie czeka juz na blok
+	if(!count && m_carouselServer.get())
+		m_carouselServer->removeObject(id);
 }
 
 double CasterServer::showServerStats(unsigned) {
@@ -104,11 +407,25 @@ double CasterServer::showServerStats(unsigned) {
 	FurEach(CasterSessionClientList, sessionItor, m_clientList) {
 		queuedBlocks += (*sessionItor)->m_blockList.size();
 	}
+
+	if(m_carouselServer.get()) {
+		updatef("-- %5ikB/s -- %i [%i / %i] sessions -- %5ikB send length -- %i blocks in carousel -- %i symbols -- %i layers -- ", 
+			unsigned(m_carouselServer->sendRate() >> 10), queuedBlocks, m_blockList.size(),
+			m_sessionList.size() + m_clientList.size() + m_senderList.size(), unsigned(m_carouselServer->SendLength >> 10),
+			m_carouselServer->objectCount(), m_carouselServer->SendCount, m_carouselServer->layerCount());
+
+		if(m_sessionList.empty() || m_carouselServer->objectCount())
+			return STATS_INTERVAL * 2;
+		return STATS_INTERVAL;
+	}
 	
-	updatef("-- %5ikB/s -- %i [%i / %i] sessions -- %5ikB send length -- %i/%.2f%% -- ", 
-		unsigned(m_castServer->sendRate() >> 10), queuedBlocks, m_blockList.size(),
+	updatef("-- %5ikB/s -- %i [%i / %i] sessions -- %5ikB send length -- %i/%.2f%% -- %i lagging -- %i skipped -- %.1f/%i per batch -- %.1f/%i per burst -- %5ikB/s pace -- %i/%i fec -- ", 
+		unsigned((m_castServer->sendRate() + m_castServer->BatchRate.CurrentRate) >> 10), queuedBlocks, m_blockList.size(),
 		m_sessionList.size() + m_clientList.size() + m_senderList.size(), unsigned(m_castServer->SendLength >> 10), m_castServer->clientCount(),
-		m_castServer->NakCount * 100.0f / m_castServer->SendCount);
+		m_castServer->NakCount * 100.0f / m_castServer->SendCount, m_castServer->laggingCount(), m_castServer->LateNakCount,
+		m_castServer->batchSize(), m_castServer->MaxBatchSize,
+		m_castServer->burstSize(), m_castServer->MaxBurstSize, unsigned((long long)m_castServer->paceRate() >> 10),
+		m_castServer->FecParity, m_castServer->FecCount);
 
 	if(m_sessionList.empty() || !m_castServer->empty())
 		return STATS_INTERVAL * 2;
@@ -116,61 +433,33 @@ double CasterServer::showServerStats(unsigned) {
 	return STATS_INTERVAL;
 }
 
-#ifdef USE_DISK_FILE
-bool CasterServer::getNextBlock(unsigned& id, FILE*& data, unsigned& dataSize, Hash& hash) {
-#else
-bool CasterServer::getNextBlock(unsigned& id, string& data, unsigned& dataSize, Hash& hash) {
-#endif
+unsigned CasterServer::nextBlock(unsigned& count, const vector<unsigned>& exclude) {
+	count = 0;
 	if(m_blockList.empty())
-		return false;
-
-	unsigned maxCount = 0;
-	vector<unsigned> sendList;
-	sendList.reserve(1000);
-
-	// find block with max usage count
-	cFurEach(CasterServerBlockUsage, block, m_blockList) {
-		if(m_castServer->id() == block->first)
-			continue;
-
-		if(block->second < maxCount)
-			continue;
-		
-		// just append block to sendList
-		if(block->second == maxCount) {
-			if(sendList.size() < sendList.capacity())
-				sendList.push_back(block->first);
-			continue;
-		}
-
-		maxCount = block->second;
-		sendList.resize(0);
-		sendList.push_back(block->first);
-
-		// if found block with max clients, send it first!
-		if(maxCount == m_clientList.size())
-			break;
+		return 0;
+
+	// find random block with max usage count
+	unsigned id = m_blockList.next(count, exclude);
+	if(!id || count < 2)
+		return id;
+
+	// check sector data
+	BlockDesc desc(*m_imageDesc, id);
+	if(!desc.valid()) {
+		dropBlock(id, true);
+		return 0;
 	}
+	return id;
+}
 
-	// randomize send block
-	if(sendList.empty())
-		return false;
-	id = sendList[rand() % sendList.size()];
-
-	if(maxCount == 1) {
+void CasterServer::scheduleBlock(unsigned id, unsigned count) {
+	if(count == 1) {
 		// schedules local send!
 		FurEach(CasterSessionClientList, client, m_clientList) {
 			(*client)->m_sendLocally = true;
 		}
 	}
-	else if(maxCount) {
-		// check sector data
-		BlockDesc desc(*m_imageDesc, id);
-		if(!desc.valid()) {
-			m_blockList.erase(id);
-			return false;
-		}
-
+	else if(count) {
 		// schedules one send! (amazing)
 		FurEach(CasterSessionClientList, client, m_clientList) {
 			if((*client)->wantsBlock(id))
@@ -178,24 +467,45 @@ bool CasterServer::getNextBlock(unsigned& id, string& data, unsigned& dataSize,
 			else
 				(*client)->m_sendLocally = true;
 		}
-
-#ifdef USE_DISK_FILE
-		data = desc.dataOpen();
-#else
-		data = desc.data();
-#endif
-		dataSize = desc.dataSize();
-		hash = desc.hash();
-		return true;
 	}
-	return false;
 }
 
+#ifndef USE_DISK_FILE
+bool CasterServer::getNextBlock(unsigned& id, string& data, unsigned& dataSize, Hash& hash, const vector<unsigned>& exclude) {
+	unsigned maxCount;
+	id = nextBlock(maxCount, exclude);
+	if(!id)
+		return false;
+
+	scheduleBlock(id, maxCount);
+	if(maxCount < 2)
+		return false;
+
+	BlockDesc desc(*m_imageDesc, id);
+	data = desc.data();
+	dataSize = desc.dataSize();
+	hash = desc.hash();
+	return true;
+}
+#endif
+
 void CasterServer::finishedBlock(unsigned id) {
 	debugp("server", "finished block [id=%i]", id);
 	
 	FurEach(CasterSessionClientList, sessionItor, m_clientList) {
-		(*sessionItor)->removeBlockFromList(id);
+		CasterSessionClient* session = *sessionItor;
+
+		// klienci spoza multicastu odbieraja bloki przez TCP
+		if(!session->m_multiCast)
+			continue;
+
+		// dolaczyl w trakcie bloku, dostanie go w kolejnej kolejce
+		if(session->m_joinBlock == id) {
+			session->m_joinBlock = 0;
+			continue;
+		}
+
+		session->removeBlockFromList(id);
 	}
 }
 	
@@ -208,10 +518,18 @@ CasterSessionClient* CasterServer::findClient(const SockDesc& desc) {
 }
 
 CasterUdpServer::CasterUdpServer(CasterServer& server) : Server(server) {
+	Id = 0;
+	Offset = 0;
 }
 
 CasterUdpServer::~CasterUdpServer() {
 	onReset();
+
+#ifdef USE_DISK_FILE
+	FurEach(ReadAheadList, job, m_readAhead)
+		CasterDiskJob::release(*job);
+	m_readAhead.clear();
+#endif
 }
 
 void CasterUdpServer::onReset() {
@@ -220,50 +538,136 @@ void CasterUdpServer::onReset() {
 	}
 
 #ifdef USE_DISK_FILE
-	if(Data) {
-		fclose(Data);
-		Data = NULL;
-	}
+	Data.close();
 #else
-	Offset = 0;
 	Data.clear();
+#endif
+	Offset = 0;
+}
+
+void CasterUdpServer::onTick() {
+	readAhead();
+}
+
+bool CasterUdpServer::hasData() const {
+#ifdef USE_DISK_FILE
+	return Id || (m_readAhead.size() && m_readAhead.front()->finished());
+#else
+	return true;
 #endif
 }
 
-bool CasterUdpServer::onGetData(string& data, unsigned maxSize) {
+void CasterUdpServer::readAhead() {
+#ifdef USE_DISK_FILE
+	if(!clientCount())
+		return;
+
+	while(m_readAhead.size() < READ_AHEAD_BLOCKS) {
+		// skip blocks already being sent or read
+		vector<unsigned> exclude;
+		exclude.push_back(Id);
+		FurEach(ReadAheadList, job, m_readAhead)
+			exclude.push_back((*job)->Id);
+
+		// only select block, sessions are switched when it is sent
+		unsigned count;
+		unsigned id = Server.nextBlock(count, exclude);
+		if(!id)
+			break;
+
+		if(count < 2) {
+			// nothing worth multicast, send locally once nothing is in flight
+			if(!Id && m_readAhead.empty())
+				Server.scheduleBlock(id, count);
+			break;
+		}
+
+		// block file is opened by disk worker
+		BlockDesc desc(*Server.m_imageDesc, id);
+		CasterBlockReadJob* job = new CasterBlockReadJob(id, desc.dataLocate());
+		m_readAhead.push_back(job);
+		Server.m_diskQueue->push(job);
+	}
+#endif
+}
+
+bool CasterUdpServer::onGetData(void* data, unsigned& size, unsigned maxSize) {
 	if(!Id) {
+		CasterPacketBlockData& packet = *(CasterPacketBlockData*)data;
+
+#ifdef USE_DISK_FILE
+		readAhead();
+
+		// get next block already read from disk
+		while(true) {
+			if(m_readAhead.empty() || !m_readAhead.front()->finished())
+				return false;
+
+			auto_ptr<CasterBlockReadJob> job(m_readAhead.front());
+			m_readAhead.pop_front();
+
+			// block could be received in meantime
+			unsigned count = Server.m_blockList.count(job->Id);
+			BlockDesc desc(*Server.m_imageDesc, job->Id);
+			if(count < 2 || !desc.valid())
+				continue;
+
+			if(!job->File) {
+				infof("Failed to open block %i!", job->Id);
+				Server.dropBlock(job->Id);
+				continue;
+			}
+
+			// usage could change while block was read
+			Server.scheduleBlock(job->Id, count);
+
+			packet.Id = job->Id;
+			packet.DataSize = desc.dataSize();
+			packet.Hash = desc.hash();
+			Data = job->take();
+			break;
+		}
+#else
 		// get next block
-		CasterPacketBlockData packet;
-		if(!Server.getNextBlock(packet.Id, Data, packet.DataSize, packet.Hash))
+		vector<unsigned> exclude;
+		if(!Server.getNextBlock(packet.Id, Data, packet.DataSize, packet.Hash, exclude))
 			return false;
+#endif
 			
 		debugp("udpserver", "sending block [id=%i]", packet.Id);
 
 		// send header
 		Id = packet.Id;
 		packet.Type = SERVERPT_BlockData;
-		data.assign((const char*)&packet, (const char*)(&packet+1));
-#ifndef USE_DISK_FILE
+		size = sizeof(packet);
 		Offset = 0;
+#ifdef USE_DISK_FILE
+		readAhead();
 #endif
 		return true;
 	}
 
 	// send part of data
 #ifdef USE_DISK_FILE
-	if(!feof(Data)) {
-		data.resize(maxSize);
-		data.resize(fread(&data[0], 1, maxSize, Data));
-		return true;
+	if(Offset < Data.Size) {
+		size = min(maxSize, Data.Size - Offset);
+		if(const byte* mapped = Data.mapped())
+			memcpy(data, mapped + Offset, size);
+		else
+			size = Data.read(data, Offset, size);
+		Offset = size ? Offset + size : Data.Size;
+		if(size)
+			return true;
 	}
 
 	// end transmission
-	fclose(Data);
-	Data = NULL;
+	Data.close();
+	Offset = 0;
 #else
 	if(Offset < Data.size()) {
-		data = Data.substr(Offset, maxSize);
-		Offset += data.size();
+		size = min<unsigned>(maxSize, Data.size() - Offset);
+		memcpy(data, &Data[Offset], size);
+		Offset += size;
 		return true;
 	}
 
@@ -277,27 +681,36 @@ bool CasterUdpServer::onGetData(string& data, unsigned maxSize) {
 	Id = 0;
 
 	// send null data
-	data.clear();
+	size = 0;
 	return true;	
 }
 
 bool CasterUdpServer::onJoin(const SockDesc& desc) {
 	CasterSessionClient* session = Server.findClient(desc);
 
-	// only first time allow to connect
-	if(!session || session->m_gotGetData > 1) {
+	// karuzela zastepuje multicast z potwierdzeniami, starsi klienci dostaja dane przez TCP
+	if(Server.m_carouselServer.get()) {
+		debugp("udpserver", "disallow join, carousel mode [%s]", va(desc).c_str());
+		return false;
+	}
+
+	// klient moze dolaczyc w dowolnej chwili, takze przy ponawianiu zadania
+	if(!session) {
 		debugp("udpserver", "disallow join [%s]", va(desc).c_str());
 		return false;
 	}
 
-	debugp("udpserver", "join [%s]", va(desc).c_str());
+	debugp("udpserver", "join [%s, block=%i]", va(desc).c_str(), Id);
+
+	// poczatek biezacego bloku juz wyslany
+	session->m_joinBlock = Id;
 
 	// update block usage
 	if(session && session->m_multiCast == false) {
 		session->m_multiCast = true;
 		session->m_sendLocally = false;
 		FurEach(SessionBlockList, itor, session->m_blockList)
-			Server.addBlockToSend(session, *itor);
+			Server.addBlockToSend(session, itor->first);
 	}
 	return true;
 }
@@ -310,7 +723,7 @@ void CasterUdpServer::onLeave(const SockDesc& desc) {
 	// update block usage
 	if(session && session->m_multiCast == true) {
 		FurEach(SessionBlockList, itor, session->m_blockList)
-			Server.removeBlockFromSend(session, *itor);
+			Server.removeBlockFromSend(session, itor->first);
 		session->m_multiCast = false;
 		session->m_sendLocally = true;
 	}
@@ -319,3 +732,126 @@ void CasterUdpServer::onLeave(const SockDesc& desc) {
 void CasterUdpServer::onTimeout(const SockDesc& desc) {
 	onLeave(desc);
 }
+
+CasterCarouselServer::CasterCarouselServer(CasterServer& server) : Server(server) {
+}
+
+CasterCarouselServer::~CasterCarouselServer() {
+#ifdef USE_DISK_FILE
+	FurEach(ReadAheadList, job, m_readAhead)
+		CasterDiskJob::release(*job);
+	m_readAhead.clear();
+#endif
+}
+
+void CasterCarouselServer::onTick() {
+	readAhead();
+}
+
+bool CasterCarouselServer::hasData() const {
+#ifdef USE_DISK_FILE
+	return m_readAhead.size() && m_readAhead.front()->finished();
+#else
+	return Server.m_blockList.size() > objectCount();
+#endif
+}
+
+void CasterCarouselServer::excludeList(vector<unsigned>& exclude) const {
+	// skip blocks already in carousel or being read
+	cFurEach(ObjectList, object, objects())
+		exclude.push_back((*object)->Id);
+#ifdef USE_DISK_FILE
+	cFurEach(ReadAheadList, job, m_readAhead)
+		exclude.push_back((*job)->Id);
+#endif
+}
+
+void CasterCarouselServer::readAhead() {
+#ifdef USE_DISK_FILE
+	while(m_readAhead.size() < READ_AHEAD_BLOCKS && objectCount() + m_readAhead.size() < MaxObjects) {
+		vector<unsigned> exclude;
+		excludeList(exclude);
+
+		// most wanted block first
+		unsigned count;
+		unsigned id = Server.m_blockList.next(count, exclude);
+		if(!id)
+			break;
+
+		BlockDesc desc(*Server.m_imageDesc, id);
+		BlockDataFile file;
+		if(desc.valid())
+			file = desc.dataLocate();
+		if(!file.located()) {
+			Server.dropBlock(id, !desc.valid());
+			continue;
+		}
+
+		CasterBlockReadJob* job = new CasterBlockReadJob(id, file);
+		m_readAhead.push_back(job);
+		Server.m_diskQueue->push(job);
+	}
+#endif
+}
+
+bool CasterCarouselServer::onGetObject(unsigned& id, string& data) {
+#ifdef USE_DISK_FILE
+	readAhead();
+
+	// get next block already read from disk
+	while(true) {
+		if(m_readAhead.empty() || !m_readAhead.front()->finished())
+			return false;
+
+		auto_ptr<CasterBlockReadJob> job(m_readAhead.front());
+		m_readAhead.pop_front();
+
+		// block could be received by all clients in meantime
+		if(!Server.m_blockList.count(job->Id))
+			continue;
+
+		BlockDataFile file = job->take();
+		if(!file) {
+			Server.dropBlock(job->Id);
+			continue;
+		}
+		data.resize(file.Size);
+
+		bool valid = true;
+		if(file.Size) {
+			if(const byte* mapped = file.mapped())
+				memcpy(&data[0], mapped, file.Size);
+			else
+				valid = file.read(&data[0], 0, file.Size) == file.Size;
+		}
+		file.close();
+
+		if(!valid) {
+			infof("Carousel failed to read block %i!", job->Id);
+			continue;
+		}
+
+		id = job->Id;
+		readAhead();
+		break;
+	}
+#else
+	vector<unsigned> exclude;
+	excludeList(exclude);
+
+	unsigned count;
+	id = Server.m_blockList.next(count, exclude);
+	if(!id)
+		return false;
+
+	BlockDesc desc(*Server.m_imageDesc, id);
+	if(!desc.valid()) {
+		Server.dropBlock(id, true);
+		return false;
+	}
+	data = desc.data();
+#endif
+
+	debugp("carousel", "sending block [id=%i, size=%i]", id, data.size());
+	return true;
+}
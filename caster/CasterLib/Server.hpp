@@ -13,6 +13,13 @@ struct CasterServerArgs
 	string Maddress;
 	long long Rate;
 	unsigned FragSize;
+	unsigned FecGroup;
+
+	//! Multicast jako karuzela kodu fontannowego (bez informacji zwrotnej przez UDP)
+	bool Carousel;
+
+	//! Ilosc warstw karuzeli, odbiorcy dolaczaja tyle, ile pozwalaja straty
+	unsigned Layers;
 };
 
 class CasterUdpServer : public UdpCastServer 
@@ -21,24 +28,35 @@ class CasterUdpServer : public UdpCastServer
 
 	unsigned Id;
 #ifdef USE_DISK_FILE
-	FILE* Data;
+	BlockDataFile Data;
 #else
 	string Data;
-	unsigned Offset;
 #endif 
+	unsigned Offset;
+
+#ifdef USE_DISK_FILE
+	//! Bloki wczytywane przed wyslaniem
+	typedef deque<CasterBlockReadJob*> ReadAheadList;
+	ReadAheadList m_readAhead;
+#endif
 
 public:
 	CasterUdpServer(CasterServer& server);
 	~CasterUdpServer();
-	bool onGetData(string& data, unsigned maxSize);
+	bool onGetData(void* data, unsigned& size, unsigned maxSize);
 	bool onJoin(const SockDesc& desc);
 	void onLeave(const SockDesc& desc);
 	void onTimeout(const SockDesc& desc);
 	void onReset();
+	void onTick();
+	bool hasData() const;
+
+	//! Zleca wczytanie kolejnych blokow do wyslania
+	void readAhead();
 
 	bool empty() const { 
 #ifdef USE_DISK_FILE
-		return !Data || feof(Data);
+		return !Data || Offset >= Data.Size;
 #else // USE_DISK_FILE
 		return Offset >= Data.size(); 
 #endif // USE_DISK_FILE
@@ -47,10 +65,100 @@ public:
 	unsigned id() const { return Id; }
 };
 
+//! Karuzela blokow zadanych przez klientow, blok wypada gdy wszyscy zglosza jego odbior
+class CasterCarouselServer : public UdpCastCarouselServer
+{
+	CasterServer& Server;
+
+#ifdef USE_DISK_FILE
+	typedef deque<CasterBlockReadJob*> ReadAheadList;
+	ReadAheadList m_readAhead;
+#endif
+
+public:
+	CasterCarouselServer(CasterServer& server);
+	~CasterCarouselServer();
+	bool onGetObject(unsigned& id, string& data);
+	void onTick();
+	bool hasData() const;
+
+	//! Zleca wczytanie kolejnych blokow do karuzeli
+	void readAhead();
+
+private:
+	void excludeList(vector<unsigned>& exclude) const;
+};
+
 typedef vector<CasterSession*> CasterSessionList;
 typedef vector<CasterSessionClient*> CasterSessionClientList;
 typedef vector<CasterSessionSender*> CasterSessionSenderList;
-typedef map<unsigned, unsigned> CasterServerBlockUsage;
+
+//! Licznik uzycia blokow pogrupowany w kubelki wedlug ilosci klientow
+class CasterServerBlockUsage
+{
+	struct Usage {
+		unsigned Count;
+		unsigned Index;
+	};
+
+	typedef map<unsigned, Usage> UsageList;
+	typedef vector<unsigned> UsageBucket;
+
+	// Fields
+private:
+	UsageList m_usage;
+	vector<UsageBucket> m_buckets;
+	unsigned m_maxCount;
+
+	// Constructor
+public:
+	CasterServerBlockUsage() : m_buckets(1), m_maxCount(0) {}
+
+	// Helpers
+private:
+	void unlink(unsigned id, Usage& usage);
+	void link(unsigned id, Usage& usage);
+
+	// Methods
+public:
+	unsigned add(unsigned id);
+	unsigned remove(unsigned id);
+	void erase(unsigned id);
+	unsigned count(unsigned id) const;
+
+	//! Wybiera losowy blok o najwiekszej ilosci klientow
+	unsigned next(unsigned& count, const vector<unsigned>& exclude) const;
+
+	unsigned size() const { return m_usage.size(); }
+	bool empty() const { return m_usage.empty(); }
+	unsigned maxCount() const { return m_maxCount; }
+};
+
+typedef vector<string> CasterManifestPacketList;
+
+//! Gotowe pakiety z opisem urzadzenia (w czesciach)
+struct CasterServerManifest {
+	CasterManifestPacketList Packets;
+
+	//! Stan pliku z opisem, z ktorego pochodzi pakiet
+	long long FileSize;
+	long long FileTime;
+	unsigned long long FileInode;
+
+	//! Wersja urzadzenia w bazie
+	unsigned Revision;
+
+	CasterServerManifest() {
+		FileSize = FileTime = 0;
+		FileInode = 0;
+		Revision = 0;
+	}
+};
+
+typedef map<unsigned, CasterServerManifest> CasterServerManifestList;
+
+//! Sesje multicast czekajace na blok
+typedef map<unsigned, set<CasterSessionClient*> > CasterServerBlockOwners;
 
 class CasterServer : public TcpSock, public CasterServerArgs
 {
@@ -61,9 +169,13 @@ private:
 	CasterSessionSenderList m_senderList;
 
 	auto_ptr<ImageDesc> m_imageDesc;
+	auto_ptr<CasterDiskQueue> m_diskQueue;
 	auto_ptr<CasterUdpServer> m_castServer;
+	auto_ptr<CasterCarouselServer> m_carouselServer;
 
 	CasterServerBlockUsage m_blockList;
+	CasterServerBlockOwners m_blockOwners;
+	CasterServerManifestList m_manifestList;
 
 	// Constructor
 public:
@@ -80,23 +192,40 @@ protected:
 private:
 	double showServerStats(unsigned);
 
+	static void buildManifest(const DeviceManifest& manifest, CasterManifestPacketList& packets);
+	bool loadManifest(const string& fileName, unsigned revision, CasterManifestPacketList& packets);
+	void saveManifest(const string& fileName, unsigned revision, const CasterManifestPacketList& packets);
+
 	// Methods
 public:
 	void sendBlockInfo(unsigned id, Hash hash);
-#ifdef USE_DISK_FILE
-	bool getNextBlock(unsigned& id, FILE*& data, unsigned& dataSize, Hash& hash);
-#else
-	bool getNextBlock(unsigned& id, string& data, unsigned& dataSize, Hash& hash);
+
+	//! Pobiera opis urzadzenia (z pamieci, pliku lub bazy danych)
+	const CasterManifestPacketList& deviceManifest(const DeviceDesc& device);
+	//! Wybiera blok do wyslania, nie zmienia stanu sesji
+	unsigned nextBlock(unsigned& count, const vector<unsigned>& exclude);
+
+	//! Ustawia sesjom wysylanie lokalne dla wybranego bloku
+	void scheduleBlock(unsigned id, unsigned count);
+#ifndef USE_DISK_FILE
+	bool getNextBlock(unsigned& id, string& data, unsigned& dataSize, Hash& hash, const vector<unsigned>& exclude);
 #endif
 	void finishedBlock(unsigned id);
 
 	void addBlockToSend(CasterSessionClient* owner, unsigned id);
 	void removeBlockFromSend(CasterSessionClient* owner, unsigned id);
 
+	//! Usuwa blok z multicastu (blad odczytu lub brak bloka), sesje wysylaja go przez TCP
+	void dropBlock(unsigned id, bool invalid = false);
+
+	//! Przekazuje nowy licznik uzycia bloka do indeksow klientow czekajacych na blok
+	void updateBlockUsage(unsigned id, unsigned count);
+
 	CasterSessionClient* findClient(const SockDesc& desc);
 
 	friend class CasterSession;
 	friend class CasterSessionClient;
 	friend class CasterSessionSender;
 	friend class CasterUdpServer;
+	friend class CasterCarouselServer;
 };
@@ -27,7 +27,7 @@ void CasterSession::onPacket(const void* data, unsigned size) {
 		case CLIENTPT_GetImage:
 			{
 				CasterSessionClient* session = new CasterSessionClient(Server, *this);
-				session->onGetImage(*(const CasterPacketGetImage*)data);
+				session->onGetImage(*(const CasterPacketGetImage*)data, size);
 				close();
 			}
 			break;
@@ -7,6 +7,14 @@ const double PING_TIME = 10.0;
 const int PING_TIMEOUTS = 3;
 
 CasterSessionClient::CasterSessionClient(CasterServer& server, CasterSession& session) : PacketSock(session), Server(server) {
+	m_version = 0;
+	m_partialRequest = false;
+	m_joinBlock = 0;
+#ifdef USE_DISK_FILE
+	m_sendId = 0;
+	m_sendOffset = 0;
+	m_sendJob = NULL;
+#endif
 	Server.m_clientList.push_back(this);
 
 	infof("Client %s connected.", sockName().c_str());
@@ -16,10 +24,16 @@ CasterSessionClient::~CasterSessionClient() {
 	// cleanup all sector usage
 	if(m_multiCast) {
 		FurEach(SessionBlockList, itor, m_blockList)
-			Server.removeBlockFromSend(this, *itor);
+			Server.removeBlockFromSend(this, itor->first);
 		m_blockList.clear();
+		m_usageIndex.clear();
 	}
 
+#ifdef USE_DISK_FILE
+	CasterDiskJob::release(m_sendJob);
+	m_sendData.close();
+#endif
+
 	// force multicast disconnect
 	Server.m_castServer->disconnect(desc());
 
@@ -48,9 +62,12 @@ double CasterSessionClient::sendPeriodicPing(unsigned) {
 	return PING_TIME;
 }
 
-void CasterSessionClient::onGetImage(const CasterPacketGetImage& image) {
+void CasterSessionClient::onGetImage(const CasterPacketGetImage& image, unsigned size) {
 	string name(image.DeviceName, strnlen(image.DeviceName, COUNT_OF(image.DeviceName)));
 
+	// starsi klienci nie wysylaja wersji
+	m_version = size >= sizeof(image) ? image.Version : 1;
+
 	infof("Session %s requested %s.", sockName().c_str(), name.c_str());
 
 	// Znajdz opis urzadzenia
@@ -66,35 +83,51 @@ void CasterSessionClient::onGetImage(const CasterPacketGetImage& image) {
 	imageInfo.Version = VERSION;
 	strncpy(imageInfo.ImageName, imageDesc().name().c_str(), COUNT_OF(imageInfo.ImageName));
 	imageInfo.Multicast = inet_addr(Server.Maddress.c_str());
+	imageInfo.Carousel = Server.m_carouselServer.get() ? Server.m_carouselServer->layerCount() : 0;
 	sendPacket(&imageInfo, sizeof(imageInfo));
 
-	// Utworz liste blokow
-	vector<BlockInfo> blockList;
-	vector<long long> blockOffsetList;
-	device.blockList(blockList);
-	
-	// Wyslij opisy blokw
-	FurEach(vector<BlockInfo>, block, blockList) {
-		// Znajdz blok
-		device.blockOffsetList(block->Id, blockOffsetList);
-
-		// wygeneruj pakiet
-		auto_ptr<CasterPacketBlock> blockPacket(CasterPacketBlock::alloc(blockOffsetList.size()));
-		blockPacket->Type = SERVERPT_Block;
-		blockPacket->DataSize = block->DataSize;
-		blockPacket->RealSize = block->RealSize;
-		blockPacket->Hash = block->Hash;
-		blockPacket->Id = block->Id;
-		blockPacket->DataCrc32 = 0;
-		std::copy(blockOffsetList.begin(), blockOffsetList.end(), &blockPacket->List[0]);
-		sendPacket(blockPacket.get(), blockPacket->size());
+	if(m_version >= VERSION_MANIFEST) {
+		// Wyslij gotowy opis urzadzenia
+		const CasterManifestPacketList& manifest = Server.deviceManifest(device);
+		cFurEach(CasterManifestPacketList, packet, manifest)
+			sendPacket(packet->c_str(), packet->size());
+	}
+	else {
+		// Utworz liste blokow (jedno zapytanie)
+		DeviceManifest manifest;
+		device.manifest(manifest);
+
+		// Wyslij opisy blokow
+		vector<long long> blockOffsetList;
+
+		cFurEach(DeviceManifest, block, manifest) {
+			// rozwin zakresy przesuniec
+			blockOffsetList.resize(0);
+			cFurEach(BlockExtentList, extent, block->Extents) {
+				for(unsigned i = 0; i < extent->Count; ++i)
+					blockOffsetList.push_back(extent->Start + extent->Stride * i);
+			}
+
+			// wygeneruj pakiet
+			auto_ptr<CasterPacketBlock> blockPacket(CasterPacketBlock::alloc(blockOffsetList.size()));
+			blockPacket->Type = SERVERPT_Block;
+			blockPacket->DataSize = block->DataSize;
+			blockPacket->RealSize = block->RealSize;
+			blockPacket->Hash = block->Hash;
+			blockPacket->Id = block->Id;
+			blockPacket->DataCrc32 = 0;
+			std::copy(blockOffsetList.begin(), blockOffsetList.end(), &blockPacket->List[0]);
+			sendPacket(blockPacket.get(), blockPacket->size());
+		}
+
+		debugp("session", "sending Blocks [blocks=%i]", manifest.size());
 	}
 
 	CasterPacket ready;
 	ready.Type = SERVERPT_Ready;
 	sendPacket(&ready, sizeof(ready));
 
-	debugp("session", "sending Image [blocks=%i]", blockList.size());
+	debugp("session", "sending Image [device=%i]", device.id());
 }
 
 void CasterSessionClient::onGetPong(const CasterPacketGetPong& pong) {
@@ -102,15 +135,22 @@ void CasterSessionClient::onGetPong(const CasterPacketGetPong& pong) {
 	debugp("session", "received pong");
 }
 
-void CasterSessionClient::onGetData(const CasterPacketGetData& data) {
-	++m_gotGetData;
+void CasterSessionClient::onGetData(const CasterPacketGetData& data, bool part) {
+	// kolejne czesci tego samego zadania nie sa ponowieniem
+	if(!part || !m_partialRequest) {
+		++m_gotGetData;
 
-	// send periodic pings
-	Timer::after(TimerDelegate(this, &CasterSessionClient::sendPeriodicPing), PING_TIME);
+		// send periodic pings
+		Timer::after(TimerDelegate(this, &CasterSessionClient::sendPeriodicPing), PING_TIME);
+	}
+	m_partialRequest = part;
 
-	// force multicast disconnect
-	if(m_gotGetData > 1) {
-		Server.m_castServer->disconnect(desc());
+	// klient karuzeli odbiera multicast bez dolaczania
+	if(Server.m_carouselServer.get() && m_version >= VERSION_CAROUSEL && !m_multiCast) {
+		m_multiCast = true;
+		m_sendLocally = false;
+		FurEach(SessionBlockList, itor, m_blockList)
+			Server.addBlockToSend(this, itor->first);
 	}
 
 	// add data to receive
@@ -120,11 +160,36 @@ void CasterSessionClient::onGetData(const CasterPacketGetData& data) {
 			continue;
 		if(m_blockList.find(data.List[i]) != m_blockList.end())
 			continue;
-		m_blockList.insert(data.List[i]);
+		unsigned count = Server.m_blockList.count(data.List[i]);
+		m_blockList[data.List[i]] = count;
+		m_usageIndex.insert(make_pair(count, data.List[i]));
 		Server.addBlockToSend(this, data.List[i]);
 	}
 
-	debugp("session", "got GetData [blocks=%i]", m_blockList.size());
+	// start reading blocks for multicast
+	Server.m_castServer->readAhead();
+	if(Server.m_carouselServer.get())
+		Server.m_carouselServer->readAhead();
+
+	debugp("session", "got GetData [blocks=%i, part=%i]", m_blockList.size(), part);
+}
+
+void CasterSessionClient::onGetDataDone() {
+	m_partialRequest = false;
+
+	debugp("session", "got GetDataDone [blocks=%i]", m_blockList.size());
+
+	// wszystkie zadane bloki mogly juz zostac wyslane
+	if(m_blockList.empty() && !sendingBlockData())
+		sendFinished(Finished);
+}
+
+void CasterSessionClient::onGotData(const CasterPacketGetData& data) {
+	debugp("session", "got GotData [blocks=%i]", data.Count);
+
+	// blok odebrany z karuzeli przestaje byc liczony dla klienta
+	for(unsigned i = 0; i < data.Count; ++i)
+		removeBlockFromList(data.List[i]);
 }
 
 void CasterSessionClient::onPacket(const void* data, unsigned size) {
@@ -136,13 +201,25 @@ void CasterSessionClient::onPacket(const void* data, unsigned size) {
 
 	switch(packet->Type) {
 		case CLIENTPT_GetImage:
-			onGetImage(*(const CasterPacketGetImage*)data);
+			onGetImage(*(const CasterPacketGetImage*)data, size);
 			break;
 
 		case CLIENTPT_GetData:
 			onGetData(*(const CasterPacketGetData*)data);
 			break;
 
+		case CLIENTPT_GetDataPart:
+			onGetData(*(const CasterPacketGetData*)data, true);
+			break;
+
+		case CLIENTPT_GetDataDone:
+			onGetDataDone();
+			break;
+
+		case CLIENTPT_GotData:
+			onGotData(*(const CasterPacketGetData*)data);
+			break;
+
 		case CLIENTPT_GetPong:
 			onGetPong(*(const CasterPacketGetPong*)data);
 			break;
@@ -156,36 +233,34 @@ void CasterSessionClient::onPacket(const void* data, unsigned size) {
 void CasterSessionClient::onSockWrite() {
 	PacketSock::onSockWrite();
 
-	if(isWriteQueueFull())
+	// dokoncz wysylanie rozpoczetego bloka
+	SessionSendPartResult result = SendPartWait;
+	while(!isWriteQueueFull() && (result = sendBlockDataPart()) == SendPartSent);
+
+	if(result == SendPartFailed) {
+		close();
+		return;
+	}
+
+	if(isWriteQueueFull() || sendingBlockData())
 		return;
 
 	if(m_blockList.empty())
 		return;
 
+	// blocks which could not be sent by multicast
+	if(m_unicastList.size()) {
+		unsigned id = *m_unicastList.begin();
+		m_unicastList.erase(m_unicastList.begin());
+		sendBlockData(id);
+	}
 	// no multicast send first one
-	if(!m_multiCast) {
-		sendBlockData(*m_blockList.begin());
+	else if(!m_multiCast) {
+		sendBlockData(m_blockList.begin()->first);
 	}
 	// choose sector with lowest usage count
 	else if(m_sendLocally) {
-		unsigned maxCount = UINT_MAX;
-		unsigned id = 0;
-
-		FurEach(SessionBlockList, blockId, m_blockList) {
-			// get sector usage count
-			unsigned count = Server.m_blockList[*blockId];
-			if(count >= maxCount)
-				continue;
-
-			// save current selection
-			maxCount = count;
-			id = *blockId;
-
-			// if only by this send it!
-			if(maxCount <= 1)
-				break;
-		}
-
+		unsigned id = leastUsedBlock();
 		if(id) {
 			sendBlockData(id);
 		}
@@ -201,6 +276,22 @@ bool CasterSessionClient::wantsBlock(unsigned id) {
 	return m_blockList.find(id) != m_blockList.end();
 }
 
+void CasterSessionClient::sendBlockLocally(unsigned id) {
+	if(wantsBlock(id))
+		m_unicastList.insert(id);
+}
+
+void CasterSessionClient::updateBlockUsage(unsigned id, unsigned count) {
+	SessionBlockList::iterator itor = m_blockList.find(id);
+	if(itor == m_blockList.end() || itor->second == count)
+		return;
+
+	// przenies blok w indeksie
+	m_usageIndex.erase(make_pair(itor->second, id));
+	m_usageIndex.insert(make_pair(count, id));
+	itor->second = count;
+}
+
 bool CasterSessionClient::removeBlockFromList(unsigned id) {
 	// Blok jest na liscie?
 	if(m_blockList.find(id) == m_blockList.end())
@@ -210,10 +301,13 @@ bool CasterSessionClient::removeBlockFromList(unsigned id) {
 	Server.removeBlockFromSend(this, id);
 
 	// Usun z listy
-	m_blockList.erase(id);
+	m_unicastList.erase(id);
+	SessionBlockList::iterator itor = m_blockList.find(id);
+	m_usageIndex.erase(make_pair(itor->second, id));
+	m_blockList.erase(itor);
 
-	// Jesli lista jest pusta wysylamy Finished
-	if(m_blockList.empty())
+	// Jesli lista jest pusta (i zadanie jest kompletne) wysylamy Finished
+	if(m_blockList.empty() && !sendingBlockData() && !m_partialRequest)
 		sendFinished(Finished);
 	return true;
 }
@@ -231,6 +325,31 @@ void CasterSessionClient::sendBlockData(unsigned id) {
 	BlockDesc desc(imageDesc(), id);
 	assert(desc.valid());
 
+#ifdef USE_DISK_FILE
+	// nowsi klienci odbieraja blok w czesciach, wysylanych gdy gniazdo jest gotowe do zapisu
+	if(m_version >= VERSION_BLOCK_DATA_PART && wantsBlock(id)) {
+		BlockDataFile data = desc.dataOpen();
+		if(data) {
+			m_sendId = id;
+			m_sendOffset = 0;
+
+			// read block data in disk worker
+			m_sendJob = new CasterBlockReadJob(id, data);
+			Server.m_diskQueue->push(m_sendJob);
+			removeBlockFromList(id);
+
+			// send block header
+			CasterPacketBlockData block;
+			block.Type = SERVERPT_BlockDataStream;
+			block.Id = id;
+			block.Hash = desc.hash();
+			block.DataSize = data.Size;
+			sendPacket(&block, sizeof(block));
+			return;
+		}
+	}
+#endif // USE_DISK_FILE
+
 	if(!removeBlockFromList(id))
 		return;
 
@@ -249,3 +368,59 @@ void CasterSessionClient::sendBlockData(unsigned id) {
 	unsigned sizes[] = {sizeof(block), data.size()};
 	sendPacket(COUNT_OF(parts), parts, sizes);
 }
+
+SessionSendPartResult CasterSessionClient::sendBlockDataPart() {
+#ifdef USE_DISK_FILE
+	if(!m_sendId)
+		return SendPartWait;
+
+	// wait for disk worker
+	if(m_sendJob) {
+		if(!m_sendJob->finished())
+			return SendPartWait;
+		m_sendData = m_sendJob->take();
+		delete m_sendJob;
+		m_sendJob = NULL;
+	}
+
+	if(m_sendOffset < m_sendData.Size) {
+		if(m_sendBuffer.empty())
+			m_sendBuffer.resize(sizeof(CasterPacketBlockDataPart) + BLOCK_DATA_PART_SIZE);
+
+		// copy next part directly into packet
+		CasterPacketBlockDataPart* part = (CasterPacketBlockDataPart*)&m_sendBuffer[0];
+		unsigned size = min(BLOCK_DATA_PART_SIZE, m_sendData.Size - m_sendOffset);
+		if(const byte* mapped = m_sendData.mapped())
+			memcpy(part->data(), mapped + m_sendOffset, size);
+		else
+			size = m_sendData.read(part->data(), m_sendOffset, size);
+
+		if(size) {
+			part->Type = SERVERPT_BlockDataPart;
+			part->Id = m_sendId;
+			part->Offset = m_sendOffset;
+			sendPacket(part, sizeof(*part) + size);
+			m_sendOffset += size;
+			if(m_sendOffset < m_sendData.Size)
+				return SendPartSent;
+		}
+		else {
+			infof("Session %s failed to read block %i!", sockName().c_str(), m_sendId);
+			m_sendData.close();
+			m_sendId = 0;
+			return SendPartFailed;
+		}
+	}
+
+	// end transmission
+	m_sendData.close();
+	m_sendId = 0;
+	m_sendOffset = 0;
+
+	if(m_blockList.empty() && !m_partialRequest)
+		sendFinished(Finished);
+	return SendPartSent;
+#else
+	return SendPartWait;
+#endif
+}
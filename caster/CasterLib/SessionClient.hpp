@@ -3,15 +3,46 @@
 class CasterServer;
 class CasterSession;
 
-typedef set<unsigned> SessionBlockList;
+//! Bloki do wyslania (id -> globalna ilosc klientow multicast czekajacych na blok)
+typedef map<unsigned, unsigned> SessionBlockList;
+
+//! Bloki klienta uporzadkowane wedlug globalnej ilosci klientow (ilosc, id)
+typedef set<pair<unsigned, unsigned> > SessionBlockUsageIndex;
+
+//! Wynik wysylania czesci bloka
+enum SessionSendPartResult {
+	SendPartWait, // brak danych do wyslania (lub czeka na watek dyskowy)
+	SendPartSent, // wyslano czesc lub zakonczono blok
+	SendPartFailed // blad odczytu, sesje trzeba zamknac
+};
 
 class CasterSessionClient : public PacketSock
 {
 	CasterServer& Server;
 	SessionBlockList m_blockList;
+	SessionBlockUsageIndex m_usageIndex;
 	bool m_multiCast, m_sendLocally;
 	unsigned m_gotGetData;
 	unsigned m_timedOut;
+	unsigned m_version;
+
+	//! Klient wysyla zadanie w czesciach (opis urzadzenia jest jeszcze odbierany)
+	bool m_partialRequest;
+
+	//! Blok wysylany multicastem w chwili dolaczenia (klient nie odebral jego poczatku)
+	unsigned m_joinBlock;
+
+	//! Bloki, ktorych nie udalo sie wyslac multicastem (wysylane przez TCP)
+	set<unsigned> m_unicastList;
+
+#ifdef USE_DISK_FILE
+	//! Blok wysylany w czesciach (unicast)
+	unsigned m_sendId;
+	unsigned m_sendOffset;
+	BlockDataFile m_sendData;
+	CasterBlockReadJob* m_sendJob;
+	vector<byte> m_sendBuffer;
+#endif
 
 	// Constructor
 public:
@@ -23,15 +54,21 @@ public:
 
 	// Handlers
 public:
-	void onGetImage(const CasterPacketGetImage& image);
-	void onGetData(const CasterPacketGetData& data);
+	void onGetImage(const CasterPacketGetImage& image, unsigned size);
+	void onGetData(const CasterPacketGetData& data, bool part = false);
+	void onGetDataDone();
+	void onGotData(const CasterPacketGetData& data);
 	void onGetPong(const CasterPacketGetPong& pong);
 	void onPacket(const void* data, unsigned size);
 
 	void onSockWrite();
 
 	bool waitForWrite() const {
-		return PacketSock::waitForWrite() || (!m_multiCast || m_sendLocally) && m_blockList.size();
+		if(PacketSock::waitForWrite())
+			return true;
+		if(sendingBlockData())
+			return blockDataReady();
+		return ((!m_multiCast || m_sendLocally) && m_blockList.size()) || m_unicastList.size();
 	}
 
 private:
@@ -44,13 +81,42 @@ public:
 
 	void sendImage();
 	void sendBlockData(unsigned id);
+	SessionSendPartResult sendBlockDataPart();
 	void sendFinished(CasterFinishedErrorCode errorCode = Finished);
 
 	bool removeBlockFromList(unsigned id);
 	bool wantsBlock(unsigned id);
+
+	//! Wysyla blok przez TCP, nawet gdy klient odbiera multicast
+	void sendBlockLocally(unsigned id);
+
+	//! Uaktualnia pozycje bloka w indeksie po zmianie globalnego licznika
+	void updateBlockUsage(unsigned id, unsigned count);
+
+	//! Blok o najmniejszej ilosci klientow
+	unsigned leastUsedBlock() const {
+		return m_usageIndex.empty() ? 0 : m_usageIndex.begin()->second;
+	}
 	
 	unsigned blockCount() const { return m_blockList.size(); }
 
+	bool sendingBlockData() const {
+#ifdef USE_DISK_FILE
+		return m_sendId != 0;
+#else
+		return false;
+#endif
+	}
+
+	//! Czy dane wysylanego bloka zostaly wczytane
+	bool blockDataReady() const {
+#ifdef USE_DISK_FILE
+		return !m_sendJob || m_sendJob->finished();
+#else
+		return true;
+#endif
+	}
+
 	friend class CasterServer;
 	friend class CasterUdpServer;
 };
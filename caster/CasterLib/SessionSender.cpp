@@ -1,7 +1,41 @@
 #define DEBUG_LEVEL SERVER_DEBUG_LEVEL
 #include "CasterLib.hpp"
 
+CasterSenderBlockJob::CasterSenderBlockJob(CasterSessionSender& sender, const CasterPacketSenderBlockData& data) : Sender(sender) {
+	Offset = data.Offset;
+	Hash = data.Hash;
+	RealSize = data.RealSize;
+	Data.assign((const char*)(&data+1), data.DataSize);
+	Valid = false;
+}
+
+void CasterSenderBlockJob::run() {
+	// validate date
+	try {
+		string dein = Compressor::decompress(Data.c_str(), Data.size(), RealSize);
+		if(::Hash::calculateHash(dein.c_str(), dein.size()) != Hash)	{
+			debugp("session", "invalid block hash");
+			return;
+		}
+
+		const CompressMethod method = CmZlib; // default server compression method
+		
+		if(Compressor::method(Data.c_str(), Data.size()) != method)
+			Data = Compressor::compress(dein.c_str(), dein.size(), method);
+		Valid = true;
+	}
+	catch(exception& e)	{
+		debugp("session", "invalid block data : %s", e.what());
+	}
+}
+
+void CasterSenderBlockJob::done() {
+	Sender.onBlockChecked(this);
+}
+
 CasterSessionSender::CasterSessionSender(CasterServer& server, CasterSession& session) : PacketSock(session), Server(server) {
+	m_commit = false;
+	m_failed = false;
 	Server.m_senderList.push_back(this);
 
 	infof("Sender %s connected.", sockName().c_str());
@@ -12,6 +46,9 @@ CasterSessionSender::~CasterSessionSender() {
 	if(itor != Server.m_senderList.end())
 		Server.m_senderList.erase(itor);
 
+	FurEach(CasterSenderBlockJobList, job, m_jobList)
+		CasterDiskJob::release(*job);
+
 	infof("Sender %s disconnected.", sockName().c_str());
 }
 
@@ -84,43 +121,69 @@ void CasterSessionSender::onSendData(const CasterPacketSenderBlockData& data) {
 	unsigned crc32 = Hash::crc32(&data+1, data.DataSize);
 	assert(crc32 == data.DataCrc32);
 
+	if(m_failed)
+		return;
+
 	// znajdz blok
 	BlockDesc desc = imageDesc().findBlock(data.Hash);
 	if(!desc) {
-		string in((char*)(&data+1), data.DataSize);
-
-		// validate date
-		try {
-			string dein = Compressor::decompress(in.c_str(), in.size(), data.RealSize);
-			Hash hash = Hash::calculateHash(dein.c_str(), dein.size());
-			if(hash != data.Hash)	{
-				debugp("session", "invalid block hash");
-				sendFinished(InvalidBlockData);
-				return;
-			}
-
-			const CompressMethod method = CmZlib; // default server compression method
-			
-			if(Compressor::method(in.c_str(), in.size()) != method)
-				in = Compressor::compress(dein.c_str(), dein.size(), method);
-		}
-		catch(exception& e)	{
-			debugp("session", "invalid block data : %s", e.what());
-			sendFinished(InvalidBlockData);
-			return;
-		}
-
-		desc = imageDesc().addBlock(in.c_str(), in.size(), data.RealSize, data.Hash);
-		Server.sendBlockInfo(desc.id(), data.Hash);
+		// sprawdz dane w watku dyskowym
+		CasterSenderBlockJob* job = new CasterSenderBlockJob(*this, data);
+		m_jobList.push_back(job);
+		Server.m_diskQueue->push(job);
+		return;
 	}
 
 	// Wygeneruj opis bloka
 	m_offsetList[desc.id()].push_back(data.Offset);
 }
 
+void CasterSessionSender::onBlockChecked(CasterSenderBlockJob* job) {
+	auto_ptr<CasterSenderBlockJob> jobPtr(job);
+
+	CasterSenderBlockJobList::iterator itor = std::find(m_jobList.begin(), m_jobList.end(), job);
+	if(itor != m_jobList.end())
+		m_jobList.erase(itor);
+
+	if(m_failed)
+		return;
+
+	if(!job->Valid) {
+		m_failed = true;
+		sendFinished(InvalidBlockData);
+		return;
+	}
+
+	// blok mogl zostac dodany w miedzyczasie
+	BlockDesc desc = imageDesc().findBlock(job->Hash);
+	if(!desc) {
+		desc = imageDesc().addBlock(job->Data.c_str(), job->Data.size(), job->RealSize, job->Hash);
+		Server.sendBlockInfo(desc.id(), job->Hash);
+	}
+
+	// Wygeneruj opis bloka
+	m_offsetList[desc.id()].push_back(job->Offset);
+
+	// Dokoncz zatwierdzanie
+	if(m_commit && m_jobList.empty())
+		commitDevice();
+}
+
 void CasterSessionSender::onSendCommit() {
 	debugp("session", "got SendCommit");
 
+	if(m_failed)
+		return;
+
+	// Czekaj na sprawdzenie wszystkich blokow
+	m_commit = true;
+	if(m_jobList.empty())
+		commitDevice();
+}
+
+void CasterSessionSender::commitDevice() {
+	m_commit = false;
+
 	// Zapisz nowe urzadzenie
 	if(imageDesc().addDevice(m_deviceName, m_offsetList))
 		infof("Session %s replaced device %s.", sockName().c_str(), m_deviceName.c_str());
@@ -2,12 +2,40 @@
 
 class CasterServer;
 class CasterSession;
+class CasterSessionSender;
+
+//! Sprawdza i przepakowuje odebrany blok poza petla zdarzen
+class CasterSenderBlockJob : public CasterDiskJob
+{
+	// Fields
+public:
+	CasterSessionSender& Sender;
+	long long Offset;
+	::Hash Hash;
+	unsigned RealSize;
+	string Data;
+	bool Valid;
+
+	// Constructor
+public:
+	CasterSenderBlockJob(CasterSessionSender& sender, const CasterPacketSenderBlockData& data);
+
+	// Handlers
+protected:
+	void run();
+	void done();
+};
+
+typedef vector<CasterSenderBlockJob*> CasterSenderBlockJobList;
 
 class CasterSessionSender : public PacketSock
 {
 	CasterServer& Server;
 	string m_deviceName;
 	DeviceBlockOffsetList m_offsetList;
+	CasterSenderBlockJobList m_jobList;
+	bool m_commit;
+	bool m_failed;
 
 	// Constructor
 public:
@@ -23,9 +51,14 @@ public:
 	void onSendData(const CasterPacketSenderBlockData& block);
 	void onSendBlock(const CasterPacketSenderBlock& block);
 	void onSendCommit();
+	void onBlockChecked(CasterSenderBlockJob* job);
 
 	void onPacket(const void* data, unsigned size);
 
+	bool waitForRead() const {
+		return m_jobList.size() < MAX_PENDING_SEND_BLOCKS;
+	}
+
 	// Methods
 public:
 	//! Pobiera aktywny obraz
@@ -35,6 +68,7 @@ public:
 	void sendBlockList();
 	void sendBlock(unsigned id, Hash hash);
 	void sendFinished(CasterFinishedErrorCode errorCode = Finished);
+	void commitDevice();
 
 	friend class CasterServer;
 	friend class CasterUdpServer;
@@ -6,24 +6,41 @@
 #include "../HashLib/Hash.hpp"
 #include "../CompressLib/Compress.hpp"
 #include "Image.hpp"
+#include <fcntl.h>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
 
 BlockDesc::BlockDesc(ImageDesc& desc, unsigned id) : m_image(desc), m_id(id) {
 }
 
+const BlockCacheEntry& BlockDesc::cached() const {
+	const BlockCacheEntry* entry = m_image.cachedBlock(m_id);
+	if(!entry)
+		throw runtime_error(va("invalid block : %i", m_id));
+	return *entry;
+}
+
 bool BlockDesc::valid() const {
-	return sqlite3_command(m_image.m_database, "SELECT COUNT(*) FROM Block WHERE Id='%i'", m_id).executeint() == 1;
+	return m_image.cachedBlock(m_id) != NULL;
 }
 
 void BlockDesc::remove(bool noCheck) {
 	sqlite3_command(m_image.m_database, "DELETE FROM Block WHERE Id='%i'", m_id).executenonquery();
+	m_image.uncacheBlock(m_id);
 	m_id = 0;
 }
 
 string BlockDesc::data() const {
 	string data;
 #ifdef USE_DISK_FILE
-	if(readFile(m_image.blockFileName(m_id), data)) {
-		if(data.size() != dataSize())
+	BlockDataFile file = dataOpen();
+	if(file) {
+		data.resize(file.Size);
+		unsigned readed = file.read(&data[0], 0, file.Size);
+		file.close();
+		if(readed != dataSize())
 			throw runtime_error(va("read block is corrupt : %i", m_id));
 		return data;
 	}
@@ -34,20 +51,35 @@ string BlockDesc::data() const {
 }
 
 #ifdef USE_DISK_FILE
-FILE* BlockDesc::dataOpen() const {
-	return fopen(m_image.blockFileName(m_id).c_str(), "rb");
+BlockDataFile BlockDesc::dataOpen() const {
+	BlockDataFile file = dataLocate();
+	if(!file.open())
+		return BlockDataFile();
+	return file;
+}
+
+BlockDataFile BlockDesc::dataLocate() const {
+	const BlockCacheEntry& entry = cached();
+
+	// Blok w paczce: wspoldzielony deskryptor pliku
+	if(entry.Pack)
+		return BlockDataFile(m_image.packFile(entry.Pack), entry.PackOffset, entry.DataSize, false);
+
+	// Blok w osobnym pliku
+	BlockDataFile file(-1, 0, entry.DataSize, false);
+	file.Path = m_image.blockFileName(m_id);
+	return file;
 }
 #endif
 
 unsigned BlockDesc::dataSize() const {
-	return sqlite3_command(m_image.m_database, "SELECT DataSize FROM Block WHERE Id='%i'", m_id).executeint();
+	return cached().DataSize;
 }
 
 unsigned BlockDesc::realSize() const {
-	return sqlite3_command(m_image.m_database, "SELECT RealSize FROM Block WHERE Id='%i'", m_id).executeint();
+	return cached().RealSize;
 }
 
 Hash BlockDesc::hash() const {
-	string hash = sqlite3_command(m_image.m_database, "SELECT Hash FROM Block WHERE Id='%i'", m_id).executeblob();
-	return *(Hash*)&hash[0];
+	return cached().Hash;
 }
@@ -17,6 +17,10 @@ unsigned DeviceDesc::modifiedTime() const {
 	return sqlite3_command(m_image.m_database, "SELECT ModifiedTime FROM Device WHERE Id='%i'", m_id).executeint();
 }
 
+unsigned DeviceDesc::revision() const {
+	return sqlite3_command(m_image.m_database, "SELECT Revision FROM Device WHERE Id='%i'", m_id).executeint();
+}
+
 unsigned DeviceDesc::blockCount() const {
 	return sqlite3_command(m_image.m_database, "SELECT COUNT(*) FROM DeviceBlock WHERE DeviceId='%i'", m_id).executeint();
 }
@@ -77,11 +81,43 @@ unsigned DeviceDesc::blockOffsetList(DeviceBlockOffsetList& offsetList) const {
 	return offsetList.size();
 }
 
+unsigned DeviceDesc::manifest(DeviceManifest& manifest) const {
+	// LEFT JOIN: blok urzadzenia bez opisu w Block to uszkodzony obraz, nie pomijany blok
+	sqlite3x::sqlite3_command cmd(m_image.m_database, "SELECT DeviceBlock.BlockId,Offset,Block.Id,DataSize,RealSize,Hash FROM DeviceBlock JOIN BlockOffset ON DeviceBlockId=DeviceBlock.Id LEFT JOIN Block ON Block.Id=DeviceBlock.BlockId WHERE DeviceId='%i' ORDER BY DeviceBlock.BlockId,Offset", m_id);
+	sqlite3x::sqlite3_reader reader = cmd.executereader();
+
+	manifest.clear();
+
+	while(reader.read()) {
+		unsigned id = reader.getint(0);
+
+		if(manifest.empty() || manifest.back().Id != id) {
+			string hash = reader.getblob(5);
+			if(reader.getint(2) != (int)id)
+				throw runtime_error(va("device %i references missing block %i", m_id, id));
+			if(hash.size() != sizeof(Hash))
+				throw runtime_error(va("device %i references block %i with invalid hash", m_id, id));
+
+			manifest.push_back(BlockManifestInfo());
+			BlockManifestInfo& info = manifest.back();
+			info.Id = id;
+			info.DataSize = reader.getint(3);
+			info.RealSize = reader.getint(4);
+			info.Hash = *(const Hash*)hash.c_str();
+		}
+
+		addBlockExtent(manifest.back().Extents, reader.getint64(1));
+	}
+	return manifest.size();
+}
+
 void DeviceDesc::remove() {
 	sqlite3x::sqlite3_transaction trans(m_image.m_database);
-	sqlite3_command(m_image.m_database, "DELETE FROM BlockOffset WHERE DeviceBlockId IN (SELECT Id FROM DeviceBlock WHERE DeviceId='%i')", m_id);
-	sqlite3_command(m_image.m_database, "DELETE FROM DeviceBlock WHERE db.DeviceId='%i'", m_id);
-	sqlite3_command(m_image.m_database, "DELETE FROM Device WHERE Id='%i'", m_id);
-	m_id = 0;
+	sqlite3_command(m_image.m_database, "DELETE FROM BlockOffset WHERE DeviceBlockId IN (SELECT Id FROM DeviceBlock WHERE DeviceId='%i')", m_id).executenonquery();
+	sqlite3_command(m_image.m_database, "DELETE FROM DeviceBlock WHERE DeviceId='%i'", m_id).executenonquery();
+	sqlite3_command(m_image.m_database, "DELETE FROM Device WHERE Id='%i'", m_id).executenonquery();
 	trans.commit();
+
+	m_image.invalidateManifest(m_id);
+	m_id = 0;
 }
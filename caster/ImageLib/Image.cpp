@@ -6,20 +6,275 @@
 #include "../HashLib/Hash.hpp"
 #include "../CompressLib/Compress.hpp"
 #include "Image.hpp"
+#include <fcntl.h>
+#include <errno.h>
 #ifdef _WIN32
 #include <direct.h>
+#include <io.h>
 #else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
 int mkdir(const char* fmt) {
 	return mkdir(fmt, 0711);
 }
 #endif
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 #define IMAGEDB_CHUNK_SIZE (32*1024*1024)		//32MB
+#define IMAGEPACK_MAX_SIZE (1024LL*1024*1024)		//1GB
+#define IMAGEPACK_BATCH_SIZE 1000
+
+static int readAt(int fd, void* data, unsigned size, long long offset) {
+#ifdef _WIN32
+	if(_lseeki64(fd, offset, SEEK_SET) != offset)
+		return -1;
+	return _read(fd, data, size);
+#else
+	return pread64(fd, data, size, offset);
+#endif
+}
+
+static int writeAt(int fd, const void* data, unsigned size, long long offset) {
+#ifdef _WIN32
+	if(_lseeki64(fd, offset, SEEK_SET) != offset)
+		return -1;
+	return _write(fd, data, size);
+#else
+	return pwrite64(fd, data, size, offset);
+#endif
+}
+
+#ifdef USE_DISK_FILE
+unsigned BlockDataFile::read(void* data, unsigned offset, unsigned size) const {
+	if(Fd < 0 || offset >= Size)
+		return 0;
+	size = min(size, Size - offset);
+
+	unsigned done = 0;
+	while(done < size) {
+		int readed = readAt(Fd, (char*)data + done, size - done, Offset + offset + done);
+		if(readed <= 0)
+			break;
+		done += readed;
+	}
+	return done;
+}
+
+const byte* BlockDataFile::map() {
+	if(Map || Fd < 0 || Size == 0)
+		return mapped();
+
+#ifndef _WIN32
+	// mmap wymaga przesuniecia wyrownanego do strony
+	long long pageSize = sysconf(_SC_PAGESIZE);
+	long long mapOffset = Offset - Offset % pageSize;
+
+	void* data = mmap64(NULL, Size + (Offset - mapOffset), PROT_READ, MAP_SHARED, Fd, mapOffset);
+	if(data == MAP_FAILED)
+		return NULL;
+
+	Map = data;
+	MapDelta = Offset - mapOffset;
+#ifdef MADV_SEQUENTIAL
+	madvise(Map, Size + MapDelta, MADV_SEQUENTIAL);
+#endif
+#endif // _WIN32
+	return mapped();
+}
+
+void BlockDataFile::prefetch() const {
+	const byte* data = mapped();
+	if(!data)
+		return;
+
+#ifndef _WIN32
+#ifdef MADV_WILLNEED
+	madvise(Map, Size + MapDelta, MADV_WILLNEED);
+#endif
+	// dotknij kazdej strony, zeby wymusic odczyt z dysku
+	unsigned pageSize = sysconf(_SC_PAGESIZE);
+	volatile byte sum = 0;
+	for(unsigned offset = 0; offset < Size; offset += pageSize)
+		sum ^= data[offset];
+	sum ^= data[Size - 1];
+#endif // _WIN32
+}
+
+bool BlockDataFile::open() {
+	if(Fd < 0 && !Path.empty()) {
+		Fd = ::open(Path.c_str(), O_RDONLY | O_BINARY);
+		Owned = Fd >= 0;
+	}
+	return Fd >= 0;
+}
+
+void BlockDataFile::close() {
+#ifndef _WIN32
+	if(Map)
+		munmap(Map, Size + MapDelta);
+#endif // _WIN32
+	Map = NULL;
+	MapDelta = 0;
+
+	if(Owned && Fd >= 0)
+		::close(Fd);
+	Fd = -1;
+	Owned = false;
+}
+
+//! Blokada paczek na czas dopisywania i zapisu w bazie
+class ImagePackLock {
+	ImageDesc& m_image;
+
+public:
+	ImagePackLock(ImageDesc& image) : m_image(image) {
+		m_image.lockPacks();
+	}
+
+	~ImagePackLock() {
+		m_image.unlockPacks();
+	}
+};
+#endif // USE_DISK_FILE
 
 ImageDesc::ImageDesc() {
+	m_blockCount = 0;
+	m_databaseTime = m_databaseSize = 0;
+#ifdef USE_DISK_FILE
+	m_packId = 0;
+	m_packLock = -1;
+	m_packLockDepth = 0;
+#endif // USE_DISK_FILE
 }
 
 ImageDesc::~ImageDesc() {
+#ifdef USE_DISK_FILE
+	FurEach(vector<int>, fd, m_packFiles) {
+		if(*fd >= 0)
+			close(*fd);
+	}
+	if(m_packLock >= 0)
+		close(m_packLock);
+#endif // USE_DISK_FILE
+}
+
+void ImageDesc::upgradeDatabase() {
+	try {
+		m_database.executenonquery("SELECT Pack, PackOffset FROM Block LIMIT 0");
+	}
+	catch(sqlite3x::database_error&) {
+		debugo("image", this, "upgrading Block table with pack columns");
+		sqlite3x::sqlite3_transaction trans(m_database);
+		m_database.executenonquery("ALTER TABLE [Block] ADD COLUMN [Pack] INTEGER DEFAULT '0' NOT NULL");
+		m_database.executenonquery("ALTER TABLE [Block] ADD COLUMN [PackOffset] BIGINT DEFAULT '0' NOT NULL");
+		trans.commit();
+	}
+
+	try {
+		m_database.executenonquery("SELECT Revision FROM Device LIMIT 0");
+	}
+	catch(sqlite3x::database_error&) {
+		debugo("image", this, "upgrading Device table with revision column");
+		m_database.executenonquery("ALTER TABLE [Device] ADD COLUMN [Revision] INTEGER DEFAULT '0' NOT NULL");
+	}
+}
+
+void ImageDesc::loadBlockCache() {
+	m_blockCache.clear();
+	m_blockCount = 0;
+	databaseChanged(m_databaseTime, m_databaseSize);
+
+	unsigned maxId = m_database.executeint("SELECT IFNULL(MAX(Id), 0) FROM Block");
+	m_blockCache.reserve(maxId + 1);
+
+	sqlite3_command cmd(m_database, "SELECT Id, DataSize, RealSize, Hash, Pack, PackOffset FROM Block");
+	sqlite3_reader reader = cmd.executereader();
+
+	while(reader.read())
+		cacheBlockRow(reader);
+
+	debugo("image", this, "cached %i blocks", m_blockCount);
+}
+
+BlockCacheEntry* ImageDesc::cacheBlockRow(sqlite3_reader& reader) {
+	unsigned id = reader.getint(0);
+
+	// uszkodzony opis: blok nie bedzie dostepny, ale nie moze zniknac bez sladu
+	string hash = reader.getblob(3);
+	if(hash.size() != sizeof(Hash)) {
+		infof("Block %i has invalid hash (%i bytes), ignoring it", id, (unsigned)hash.size());
+		return NULL;
+	}
+
+	BlockCacheEntry& entry = cacheBlock(id, reader.getint(1), reader.getint(2), *(const Hash*)hash.c_str());
+#ifdef USE_DISK_FILE
+	entry.Pack = reader.getint(4);
+	entry.PackOffset = reader.getint64(5);
+#endif // USE_DISK_FILE
+	return &entry;
+}
+
+bool ImageDesc::databaseChanged(long long& time, long long& size) const {
+#ifndef _WIN32
+	struct stat64 info;
+	if(stat64((name() + ".db").c_str(), &info))
+		return true;
+	time = (long long)info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+	size = info.st_size;
+	return time != m_databaseTime || size != m_databaseSize;
+#else
+	return false;
+#endif // _WIN32
+}
+
+void ImageDesc::refreshBlockCache() {
+	long long time, size;
+	if(!databaseChanged(time, size))
+		return;
+
+	debugo("image", this, "database changed, reloading blocks");
+	loadBlockCache();
+}
+
+BlockCacheEntry& ImageDesc::cacheBlock(unsigned id, unsigned dataSize, unsigned realSize, const Hash& hash) {
+	if(id >= m_blockCache.size())
+		m_blockCache.resize(id + 1);
+
+	BlockCacheEntry& entry = m_blockCache[id];
+	if(entry.DataSize == 0)
+		++m_blockCount;
+	entry.DataSize = dataSize;
+	entry.RealSize = realSize;
+	entry.Hash = hash;
+	return entry;
+}
+
+void ImageDesc::uncacheBlock(unsigned id) {
+	if(id >= m_blockCache.size() || m_blockCache[id].DataSize == 0)
+		return;
+	m_blockCache[id] = BlockCacheEntry();
+	--m_blockCount;
+}
+
+const BlockCacheEntry* ImageDesc::cachedBlock(unsigned id) {
+	if(id < m_blockCache.size() && m_blockCache[id].DataSize)
+		return &m_blockCache[id];
+	if(id == 0)
+		return NULL;
+
+	// blok mogl dodac inny proces (add, clone, optimize)
+	sqlite3_command cmd(m_database, "SELECT Id, DataSize, RealSize, Hash, Pack, PackOffset FROM Block WHERE Id=?");
+	cmd.bind(1, (int)id);
+	sqlite3_reader reader = cmd.executereader();
+	if(!reader.read())
+		return NULL;
+
+	debugo("image", this, "block added by other process [block=%i]", id);
+	return cacheBlockRow(reader);
 }
 
 DeviceDesc ImageDesc::findDevice(const string& name) {
@@ -45,18 +300,18 @@ BlockDesc ImageDesc::findBlock(Hash hash) {
 }
 	
 unsigned ImageDesc::blockCount() {
-	return sqlite3_command(m_database, "SELECT COUNT(*) FROM Block").executeint();
+	refreshBlockCache();
+	return m_blockCount;
 }
 	
 unsigned ImageDesc::blockList(vector<BlockDesc>& blockList) {
-	sqlite3_command cmd(m_database, "SELECT Id FROM Block");
-	sqlite3_reader reader = cmd.executereader();
-
 	blockList.resize(0, BlockDesc(*this, 0));
 	blockList.reserve(blockCount());
 
-	while(reader.read())
-		blockList.push_back(BlockDesc(*this, reader.getint(0)));
+	for(unsigned id = 0; id < m_blockCache.size(); ++id) {
+		if(m_blockCache[id].DataSize)
+			blockList.push_back(BlockDesc(*this, id));
+	}
 
 	return blockList.size();
 }
@@ -66,40 +321,270 @@ BlockDesc ImageDesc::addBlock(const void* data, unsigned dataSize, unsigned real
 	BlockDesc desc = findBlock(dataHash);
 	if(desc) return desc;
 
+#ifdef USE_DISK_FILE
+	// Paczke i baze zmienia naraz tylko jeden proces
+	ImagePackLock lock(*this);
+#endif
+
 	sqlite3x::sqlite3_transaction trans(m_database);
 
-	sqlite3x::sqlite3_command cmd(m_database, "INSERT INTO Block (RealSize, DataSize, Hash, Data) VALUES(?,?,?,?)");
+#ifdef USE_DISK_FILE
+	// blok mogl dodac inny proces przed uzyskaniem blokady
+	desc = findBlock(dataHash);
+	if(desc) return desc;
+
+	// Dopisz dane na koniec paczki
+	unsigned pack = 0;
+	long long packOffset = 0;
+	appendPackFile(data, dataSize, pack, packOffset);
+
+	try {
+#endif
+
+	sqlite3x::sqlite3_command cmd(m_database, "INSERT INTO Block (RealSize, DataSize, Hash, Data, Pack, PackOffset) VALUES(?,?,?,?,?,?)");
 	cmd.bind(1, (int)realSize);
 	cmd.bind(2, (int)dataSize);
 	cmd.bind(3, &dataHash, sizeof(dataHash));
 #ifdef USE_DISK_FILE
 	cmd.bind(4);
+	cmd.bind(5, (int)pack);
+	cmd.bind(6, packOffset);
 #else
 	cmd.bind(4, data, dataSize);
+	cmd.bind(5, 0);
+	cmd.bind(6, 0LL);
 #endif
 	cmd.executenonquery();
 	desc = BlockDesc(*this, m_database.insertid());
-
+	trans.commit();
 #ifdef USE_DISK_FILE
-	string fileName = blockFileName(desc.id());
-	string::size_type offset = fileName.find_last_of('/');
-
-	if(offset != string::npos)
-		mkdir(fileName.substr(0, offset).c_str());
-
-	if(!writeFile(fileName.c_str(), data, dataSize)) {
-		throw runtime_error(va("failed to write block : %s", fileName.c_str()));
+	}
+	catch(...) {
+		// dane bez wpisu w bazie: oddaj miejsce w paczce
+		truncatePackFile(pack, packOffset);
+		throw;
 	}
 #endif
-	trans.commit();
 
+	BlockCacheEntry& entry = cacheBlock(desc.id(), dataSize, realSize, dataHash);
+#ifdef USE_DISK_FILE
+	entry.Pack = pack;
+	entry.PackOffset = packOffset;
+#endif
 	return desc;
 }
 
+string ImageDesc::manifestFileName(unsigned deviceId) const {
+	return va("%s.%i.manifest", name().c_str(), deviceId);
+}
+
+void ImageDesc::invalidateManifest(unsigned deviceId) {
+	if(unlink(manifestFileName(deviceId).c_str()) == 0)
+		debugp("image", "invalidated manifest [device=%i]", deviceId);
+}
+
 #ifdef USE_DISK_FILE
 string ImageDesc::blockFileName(unsigned id) const {
 	return va("%s/%08x/%08x.bin", name().c_str(), id&0xFF00FF, id);
 }
+
+string ImageDesc::packFileName(unsigned pack) const {
+	return va("%s/%08x.pack", name().c_str(), pack);
+}
+
+int ImageDesc::packFile(unsigned pack) {
+	if(pack >= m_packFiles.size())
+		m_packFiles.resize(pack + 1, -1);
+
+	int& fd = m_packFiles[pack];
+	if(fd < 0) {
+		string fileName = packFileName(pack);
+		fd = open(fileName.c_str(), O_RDWR | O_CREAT | O_BINARY, 0644);
+		if(fd < 0)
+			throw runtime_error(va("failed to open pack : %s", fileName.c_str()));
+	}
+	return fd;
+}
+
+void ImageDesc::openPackFile() {
+	m_packId = max(1, m_database.executeint("SELECT IFNULL(MAX(Pack), 0) FROM Block"));
+
+	string fileName = name() + "/pack.lock";
+	m_packLock = open(fileName.c_str(), O_RDWR | O_CREAT | O_BINARY, 0644);
+	if(m_packLock < 0)
+		throw runtime_error(va("failed to open pack lock : %s", fileName.c_str()));
+
+	debugo("image", this, "appending to pack [pack=%i]", m_packId);
+}
+
+void ImageDesc::lockPacks() {
+	if(m_packLockDepth++)
+		return;
+
+#ifndef _WIN32
+	while(flock(m_packLock, LOCK_EX)) {
+		if(errno != EINTR)
+			throw runtime_error(va("failed to lock packs : %s", strerror(errno)));
+	}
+#endif // _WIN32
+
+	// inny proces mogl rozpoczac nowa paczke
+	m_packId = max<unsigned>(m_packId, m_database.executeint("SELECT IFNULL(MAX(Pack), 0) FROM Block"));
+}
+
+void ImageDesc::unlockPacks() {
+	if(--m_packLockDepth)
+		return;
+
+#ifndef _WIN32
+	flock(m_packLock, LOCK_UN);
+#endif // _WIN32
+}
+
+void ImageDesc::appendPackFile(const void* data, unsigned dataSize, unsigned& pack, long long& offset) {
+	assert(m_packLockDepth);
+
+	// Koniec paczki czytany pod blokada, inne procesy tez dopisuja
+	int fd;
+	long long packSize;
+
+	while(true) {
+		fd = packFile(m_packId);
+#ifdef _WIN32
+		packSize = _filelengthi64(fd);
+#else
+		struct stat64 info;
+		packSize = fstat64(fd, &info) ? -1 : info.st_size;
+#endif
+		if(packSize < 0)
+			throw runtime_error(va("failed to stat pack : %s", packFileName(m_packId).c_str()));
+
+		// Rozpocznij nowa paczke
+		if(packSize && packSize + dataSize > IMAGEPACK_MAX_SIZE) {
+			++m_packId;
+			continue;
+		}
+		break;
+	}
+
+	for(unsigned written = 0; written < dataSize; ) {
+		int size = writeAt(fd, (const char*)data + written, dataSize - written, packSize + written);
+		if(size <= 0) {
+			truncatePackFile(m_packId, packSize);
+			throw runtime_error(va("failed to write block : %s", packFileName(m_packId).c_str()));
+		}
+		written += size;
+	}
+
+	pack = m_packId;
+	offset = packSize;
+}
+
+void ImageDesc::truncatePackFile(unsigned pack, long long offset) {
+	assert(m_packLockDepth);
+
+#ifdef _WIN32
+	_chsize_s(packFile(pack), offset);
+#else
+	if(ftruncate64(packFile(pack), offset))
+		infof("Failed to truncate pack %s to %lli", packFileName(pack).c_str(), offset);
+#endif
+}
+
+void ImageDesc::releasePackData(unsigned pack, long long offset, unsigned size) {
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+	// Zwolnij miejsce na dysku zajmowane przez usuniety blok
+	fallocate64(packFile(pack), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size);
+#endif
+}
+
+unsigned ImageDesc::packBlocks() {
+	// Inne procesy nie dopisuja do paczek az do konca
+	ImagePackLock lock(*this);
+
+	sqlite3_command update(m_database, "UPDATE Block SET Pack=?, PackOffset=?, Data=NULL WHERE Id=?");
+
+	unsigned packed = 0;
+	unsigned total = 0;
+
+	for(unsigned id = 0; id < m_blockCache.size(); ++id) {
+		if(m_blockCache[id].DataSize && m_blockCache[id].Pack == 0)
+			++total;
+	}
+
+	sqlite3x::sqlite3_transaction trans(m_database, false);
+	vector<unsigned> moved;
+	moved.reserve(IMAGEPACK_BATCH_SIZE);
+
+	// Poczatek danych biezacej transakcji w paczkach
+	unsigned batchPack = 0;
+	long long batchOffset = 0;
+
+	for(unsigned id = 0; id < m_blockCache.size(); ++id) {
+		BlockCacheEntry& entry = m_blockCache[id];
+		if(entry.DataSize == 0 || entry.Pack)
+			continue;
+
+		// Wczytaj dane ze starego miejsca
+		string data = BlockDesc(*this, id).data();
+
+		unsigned pack = 0;
+		long long offset = 0;
+
+		if(moved.empty())
+			trans.begin();
+
+		try {
+			appendPackFile(data.c_str(), data.size(), pack, offset);
+			if(moved.empty()) {
+				batchPack = pack;
+				batchOffset = offset;
+			}
+
+			update.bind(1, (int)pack);
+			update.bind(2, offset);
+			update.bind(3, (int)id);
+			update.executenonquery();
+		}
+		catch(...) {
+			// dane bez wpisu w bazie: oddaj miejsce w paczkach
+			if(moved.size()) {
+				truncatePackFile(batchPack, batchOffset);
+				for(unsigned next = batchPack + 1; next <= m_packId; ++next)
+					truncatePackFile(next, 0);
+			}
+			else if(pack) {
+				truncatePackFile(pack, offset);
+			}
+			throw;
+		}
+		moved.push_back(id);
+
+		entry.Pack = pack;
+		entry.PackOffset = offset;
+
+		++packed;
+		updatef("-- %3i%% -- %i of %i blocks packed --", packed * 100 / total, packed, total);
+
+		if(moved.size() < IMAGEPACK_BATCH_SIZE && packed < total)
+			continue;
+
+		// Usun stare pliki blokow dopiero po zapisaniu zmian
+		trans.commit();
+		FurEach(vector<unsigned>, movedId, moved) {
+			string fileName = blockFileName(*movedId);
+			unlink(fileName.c_str());
+
+			// usun pusty katalog (blad gdy nie jest pusty)
+			rmdir(fileName.substr(0, fileName.find_last_of('/')).c_str());
+		}
+		moved.clear();
+	}
+
+	if(packed)
+		infof("");
+	return packed;
+}
 #endif
 
 BlockDesc ImageDesc::addBlock(const void* realData, unsigned realSize) {
@@ -155,9 +640,11 @@ DeviceDesc ImageDesc::addDevice(const string& name, const DeviceBlockOffsetList&
 	// remove empty device blocks
 	sqlite3_command(m_database, "DELETE FROM DeviceBlock WHERE DeviceId='%i' AND Id NOT IN (SELECT DISTINCT DeviceBlockId FROM BlockOffset)", desc.id()).executenonquery();
 
-	sqlite3_command(m_database, "UPDATE Device SET ModifiedTime=CURRENT_TIMESTAMP WHERE Id='%i'", desc.id());
+	// kazda zmiana blokow urzadzenia zmienia numer wersji (klucz zapisanego opisu)
+	sqlite3_command(m_database, "UPDATE Device SET ModifiedTime=CURRENT_TIMESTAMP, Revision=Revision+1 WHERE Id='%i'", desc.id()).executenonquery();
 	trans.commit();
 
+	invalidateManifest(desc.id());
 	return desc;
 }
 
@@ -221,7 +708,9 @@ auto_ptr<ImageDesc> ImageDesc::newImage(const string& name) {
 		[DataSize] INTEGER DEFAULT '0' NOT NULL, \
 		[RealSize] INTEGER DEFAULT '0' NOT NULL, \
 		[Hash] BLOB(16) UNIQUE NOT NULL, \
-		[Data] BLOB NULL \
+		[Data] BLOB NULL, \
+		[Pack] INTEGER DEFAULT '0' NOT NULL, \
+		[PackOffset] BIGINT DEFAULT '0' NOT NULL \
 		)");
 
 	self->m_database.executenonquery("DROP TABLE IF EXISTS [BlockOffset]");
@@ -235,7 +724,8 @@ auto_ptr<ImageDesc> ImageDesc::newImage(const string& name) {
 		[Id] INTEGER  NOT NULL PRIMARY KEY AUTOINCREMENT, \
 		[Name] VARCHAR(255)  UNIQUE NOT NULL, \
 		[CreateTime] TIMESTAMP DEFAULT CURRENT_TIMESTAMP NOT NULL, \
-		[ModifiedTime] TIMESTAMP DEFAULT CURRENT_TIMESTAMP NOT NULL \
+		[ModifiedTime] TIMESTAMP DEFAULT CURRENT_TIMESTAMP NOT NULL, \
+		[Revision] INTEGER DEFAULT '0' NOT NULL \
 		)");
 
 	self->m_database.executenonquery("DROP TABLE IF EXISTS [DeviceBlock]");
@@ -262,9 +752,11 @@ auto_ptr<ImageDesc> ImageDesc::newImage(const string& name) {
 		)");
 	tran.commit();
 	self->m_name = name;
+	self->loadBlockCache();
 
 #ifdef USE_DISK_FILE
 	mkdir(name.c_str());
+	self->openPackFile();
 #endif // USE_DISK_FILE
 	return self;
 }
@@ -275,9 +767,12 @@ auto_ptr<ImageDesc> ImageDesc::loadImageFromFile(const string& name) {
 	self->m_database.open((name + ".db").c_str());
 	self->m_database.setChunkSize(IMAGEDB_CHUNK_SIZE);
 	self->m_name = name;
+	self->upgradeDatabase();
+	self->loadBlockCache();
 
 #ifdef USE_DISK_FILE
 	mkdir(name.c_str());
+	self->openPackFile();
 #endif // USE_DISK_FILE
 	return self;
 }
@@ -304,10 +799,20 @@ void ImageDesc::removeUnusedBlocks() {
 		sqlite3x::sqlite3_transaction trans(m_database);
 		deleteBlock.bind(1, (long long)blockList[i]);
 		deleteBlock.executenonquery();
-		string blockName = blockFileName(blockList[i]);
-		fprintf(stderr, "* Deleting '%s'...\n", blockName.c_str());
-		unlink(blockName.c_str());
+#ifdef USE_DISK_FILE
+		const BlockCacheEntry* entry = cachedBlock(blockList[i]);
+		if(entry && entry->Pack) {
+			fprintf(stderr, "* Deleting block %i from '%s'...\n", blockList[i], packFileName(entry->Pack).c_str());
+			releasePackData(entry->Pack, entry->PackOffset, entry->DataSize);
+		}
+		else {
+			string blockName = blockFileName(blockList[i]);
+			fprintf(stderr, "* Deleting '%s'...\n", blockName.c_str());
+			unlink(blockName.c_str());
+		}
+#endif // USE_DISK_FILE
 		trans.commit();
+		uncacheBlock(blockList[i]);
 	}
 }
 
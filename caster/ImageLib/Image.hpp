@@ -21,6 +21,119 @@ struct BlockInfo {
 	::Hash Hash;
 };
 
+//! Ciag przesuniec: Start, Start + Stride, ... (Count elementow)
+struct BlockExtent {
+	long long Start;
+	long long Stride;
+	unsigned Count;
+};
+
+typedef vector<BlockExtent> BlockExtentList;
+
+//! Dopisuje kolejne (rosnace) przesuniecie do listy zakresow
+inline void addBlockExtent(BlockExtentList& extentList, long long offset) {
+	if(extentList.size()) {
+		BlockExtent& extent = extentList.back();
+		if(extent.Count == 1) {
+			extent.Stride = offset - extent.Start;
+			++extent.Count;
+			return;
+		}
+		if(extent.Start + extent.Stride * extent.Count == offset) {
+			++extent.Count;
+			return;
+		}
+	}
+
+	BlockExtent extent;
+	extent.Start = offset;
+	extent.Stride = 0;
+	extent.Count = 1;
+	extentList.push_back(extent);
+}
+
+//! Blok urzadzenia razem z zakresami przesuniec
+struct BlockManifestInfo : BlockInfo {
+	BlockExtentList Extents;
+};
+
+typedef vector<BlockManifestInfo> DeviceManifest;
+
+//! Opis bloka trzymany w pamieci (DataSize == 0 oznacza brak bloka)
+struct BlockCacheEntry {
+	unsigned DataSize, RealSize;
+	::Hash Hash;
+#ifdef USE_DISK_FILE
+	//! Numer pliku paczki (0 - osobny plik bloka lub baza danych)
+	unsigned Pack;
+	long long PackOffset;
+#endif // USE_DISK_FILE
+
+	BlockCacheEntry() {
+		DataSize = RealSize = 0;
+#ifdef USE_DISK_FILE
+		Pack = 0;
+		PackOffset = 0;
+#endif // USE_DISK_FILE
+	}
+};
+
+typedef vector<BlockCacheEntry> BlockCache;
+
+#ifdef USE_DISK_FILE
+//! Obszar pliku zawierajacy dane bloka
+struct BlockDataFile {
+	int Fd;
+	long long Offset;
+	unsigned Size;
+	bool Owned;
+
+	//! Zmapowany obszar pliku (NULL - brak mapowania)
+	void* Map;
+	unsigned MapDelta;
+
+	//! Plik bloka otwierany dopiero przez open() (poza petla zdarzen)
+	string Path;
+
+	BlockDataFile() {
+		Fd = -1;
+		Offset = 0;
+		Size = 0;
+		Owned = false;
+		Map = NULL;
+		MapDelta = 0;
+	}
+
+	BlockDataFile(int fd, long long offset, unsigned size, bool owned) {
+		Fd = fd;
+		Offset = offset;
+		Size = size;
+		Owned = owned;
+		Map = NULL;
+		MapDelta = 0;
+	}
+
+	//! Czyta dane bloka zaczynajac od podanego miejsca
+	unsigned read(void* data, unsigned offset, unsigned size) const;
+
+	//! Mapuje dane bloka do pamieci, zwraca NULL gdy sie nie uda
+	const byte* map();
+	const byte* mapped() const { return Map ? (const byte*)Map + MapDelta : NULL; }
+
+	//! Wczytuje zmapowane dane do pamieci (blokuje, poza petla zdarzen)
+	void prefetch() const;
+
+	//! Otwiera plik z Path, jesli nie jest jeszcze otwarty
+	bool open();
+	void close();
+
+	//! Plik otwarty lub czeka na otwarcie
+	bool located() const { return Fd >= 0 || !Path.empty(); }
+
+	operator bool () const { return Fd >= 0; }
+};
+#endif // USE_DISK_FILE
+
 class DeviceDesc {
 	ImageDesc& m_image;
 	unsigned m_id;
@@ -31,12 +144,18 @@ public:
 	unsigned id() const { return m_id; }
 	unsigned createdTime() const;
 	unsigned modifiedTime() const;
+
+	//! Numer wersji zwiekszany przy kazdej zmianie blokow urzadzenia
+	unsigned revision() const;
 	unsigned blockCount() const;
 	unsigned blockOffsetCount(unsigned blockId) const;
 	unsigned blockList(vector<unsigned>& list) const;
 	unsigned blockList(vector<BlockInfo>& list) const;
 	unsigned blockOffsetList(unsigned blockId, vector<long long>& offsetList) const;
 	unsigned blockOffsetList(DeviceBlockOffsetList& offsetList) const;
+
+	//! Pobiera wszystkie bloki urzadzenia z zakresami przesuniec (jedno zapytanie)
+	unsigned manifest(DeviceManifest& manifest) const;
 	DeviceDesc& operator = (const DeviceDesc& desc) { m_id = desc.m_id; return *this; }
 	void remove();
 	operator bool () const { return m_id != 0; }
@@ -53,7 +172,10 @@ public:
 	unsigned id() const { return m_id; }
 	string data() const;
 #ifdef USE_DISK_FILE
-	FILE* dataOpen() const;
+	BlockDataFile dataOpen() const;
+
+	//! Jak dataOpen(), ale osobny plik bloka otwiera dopiero BlockDataFile::open()
+	BlockDataFile dataLocate() const;
 #endif // USE_DISK_FILE
 	unsigned dataSize() const;
 	unsigned realSize() const;
@@ -63,6 +185,11 @@ public:
 	bool valid() const;
 	BlockDesc& operator = (const BlockDesc& desc) { m_id = desc.m_id; return *this; }
 
+private:
+	const BlockCacheEntry& cached() const;
+
+public:
+
 	friend class ImageDesc;
 };
 
@@ -103,10 +230,54 @@ public:
 	//! Poczenie do bazy danych
 	sqlite3x::sqlite3_connection m_database;
 
+private:
+	//! Opisy blokow indeksowane numerem bloka
+	BlockCache m_blockCache;
+	unsigned m_blockCount;
+
+	//! Stan pliku bazy danych przy wczytaniu opisow (zmiany z innych procesow)
+	long long m_databaseTime, m_databaseSize;
+
+#ifdef USE_DISK_FILE
+	//! Otwarte pliki paczek (indeksowane numerem paczki)
+	vector<int> m_packFiles;
+	unsigned m_packId;
+
+	//! Plik blokady dopisywania do paczek (wspolny dla procesow) i glebokosc blokady
+	int m_packLock;
+	unsigned m_packLockDepth;
+#endif // USE_DISK_FILE
+
 	// Constructor
 private:
 	ImageDesc();
 
+	// Helpers
+private:
+	void loadBlockCache();
+	BlockCacheEntry* cacheBlockRow(sqlite3_reader& reader);
+	BlockCacheEntry& cacheBlock(unsigned id, unsigned dataSize, unsigned realSize, const Hash& hash);
+	void uncacheBlock(unsigned id);
+
+	//! Opis bloka, brakujacy jest szukany w bazie (mogl go dodac inny proces)
+	const BlockCacheEntry* cachedBlock(unsigned id);
+
+	//! Wczytuje opisy ponownie, gdy baza zostala zmieniona przez inny proces
+	void refreshBlockCache();
+	bool databaseChanged(long long& time, long long& size) const;
+	void upgradeDatabase();
+
+#ifdef USE_DISK_FILE
+	int packFile(unsigned pack);
+	void openPackFile();
+	//! Dopisuje dane na koniec paczki (tylko pod lockPacks, w transakcji z zapisem w bazie)
+	void appendPackFile(const void* data, unsigned dataSize, unsigned& pack, long long& offset);
+	void truncatePackFile(unsigned pack, long long offset);
+	void lockPacks();
+	void unlockPacks();
+	void releasePackData(unsigned pack, long long offset, unsigned size);
+#endif // USE_DISK_FILE
+
 	// Destructor
 public:
 	~ImageDesc();
@@ -119,8 +290,15 @@ public:
 
 #ifdef USE_DISK_FILE
 	string blockFileName(unsigned id) const;
+	string packFileName(unsigned pack) const;
 #endif // USE_DISK_FILE
 
+	//! Plik z gotowym opisem urzadzenia (obok pliku bazy danych)
+	string manifestFileName(unsigned deviceId) const;
+
+	//! Usuwa zapisany opis urzadzenia po jego zmianie
+	void invalidateManifest(unsigned deviceId);
+
 	//! Znajdz urzadzenie o podanej nazwie
 	DeviceDesc findDevice(const string& name);
 
@@ -143,6 +321,11 @@ public:
 	//! Usuwa stare bloky
 	void removeUnusedBlocks();
 
+#ifdef USE_DISK_FILE
+	//! Przenosi bloki z osobnych plikow do plikow paczek
+	unsigned packBlocks();
+#endif // USE_DISK_FILE
+
 	//! Pobiera informacje statystyczne o obrazie
 	void stats(ImageStats& stats);
 
@@ -156,4 +339,5 @@ public:
 
 	friend class BlockDesc;
 	friend class DeviceDesc;
+	friend class ImagePackLock;
 };
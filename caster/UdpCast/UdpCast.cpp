@@ -21,7 +21,7 @@ struct Client : public UdpCastClient {
 	char index;
 	unsigned TransmissionCount;
 
-	bool onConsumeData(const string& data) {
+	bool onConsumeData(const void* data, unsigned size) {
 		//static bool consume = true;
 		#ifdef _WIN32
 		bool consume = (~GetKeyState(VK_SHIFT)&0x80) != 0;
@@ -31,15 +31,15 @@ struct Client : public UdpCastClient {
 
 		bool invalid = false;
 
-		if(data.empty()) {
+		if(size == 0) {
 			index = 0;
 			++TransmissionCount;
 		}
 
 		char savedIndex = index;
 
-		for(unsigned i = 0; i < data.size(); ++i) {
-			if(data[i] != index++) {
+		for(unsigned i = 0; i < size; ++i) {
+			if(((const char*)data)[i] != index++) {
 				invalid = true;
 			}
 		}
@@ -58,17 +58,17 @@ struct Server : public UdpCastServer {
 	char index;
 	unsigned TransmissionCount;
 
-	virtual bool onGetData(string& data, unsigned maxSize) {
+	virtual bool onGetData(void* data, unsigned& size, unsigned maxSize) {
 		if((rand() % 2000) == 0) {
 			++TransmissionCount;
-			data.clear();
+			size = 0;
 			index = 0;
 			return true;
 		}
 
-		data.resize(maxSize);
-		for(unsigned i = 0; i < data.size(); ++i) {
-			data[i] = index++;
+		size = maxSize;
+		for(unsigned i = 0; i < size; ++i) {
+			((char*)data)[i] = index++;
 		}
 		return true;
 	}
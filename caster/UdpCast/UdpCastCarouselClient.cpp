@@ -0,0 +1,223 @@
+#include "../AsyncLib/AsyncLib.hpp"
+#include "../AsyncLib/Log.hpp"
+#include "../AsyncLib/ForEach.hpp"
+#include "UdpCastPacket.hpp"
+#include "UdpCastCarouselClient.hpp"
+
+bool UdpCastCarouselLayer::waitForRead() const {
+	return Owner.waitForRead();
+}
+
+void UdpCastCarouselLayer::onSockRead(const SockData& data) {
+	Owner.onSockRead(data);
+}
+
+UdpCastCarouselClient::UdpCastCarouselClient() {
+	MaxDecoders = UDPCAST_CAROUSEL_DECODERS;
+	SymbolCount = InvalidCount = ObjectCount = 0;
+	SymbolsUsed = SymbolsNeeded = 0;
+	Loss = 0;
+	m_layers.resize(1);
+	m_layerPort = 0;
+	m_group = 0;
+	m_measureTime = timef();
+}
+
+UdpCastCarouselClient::~UdpCastCarouselClient() {
+	FurEach(DecoderList, decoder, m_decoders)
+		delete decoder->second;
+	m_decoders.clear();
+	delete_all(m_layerSocks.begin(), m_layerSocks.end());
+	m_layerSocks.clear();
+}
+
+void UdpCastCarouselClient::setLayers(unsigned layers, unsigned port, const string& bindAddress, unsigned group) {
+	m_layers.resize(max(1U, min(layers, UDPCAST_MAX_LAYERS)));
+	m_layerPort = port;
+	m_bindAddress = bindAddress;
+	m_group = group;
+}
+
+long long UdpCastCarouselClient::layerRecvRate() const {
+	long long rate = recvRate();
+	cFurEach(LayerSockList, sock, m_layerSocks)
+		rate += (*sock)->recvRate();
+	return rate;
+}
+
+void UdpCastCarouselClient::addLayer() {
+	unsigned layer = layers();
+
+	auto_ptr<UdpCastCarouselLayer> sock(new UdpCastCarouselLayer(*this));
+	sock->createServer(m_layerPort + 1 + layer, m_bindAddress, false);
+	sock->setBlocking(true);
+	if(m_group)
+		sock->addGroupAddress(htonl(ntohl(m_group) + layer));
+	sock->setRecvBufferSize(262144);
+	m_layerSocks.push_back(sock.release());
+
+	m_layers[layer].Valid = false;
+	m_layers[layer].Received = m_layers[layer].Lost = 0;
+
+	vdebugp(4, "carousel", "joined layer [layer=%i, loss=%.3f]", layer, Loss);
+}
+
+void UdpCastCarouselClient::dropLayer() {
+	unsigned layer = layers() - 1;
+
+	delete m_layerSocks.back();
+	m_layerSocks.pop_back();
+
+	// kolejna proba dolaczenia coraz pozniej
+	Layer& state = m_layers[layer];
+	state.Valid = false;
+	state.JoinTime = timef() + state.Backoff;
+	state.Backoff = min<double>(state.Backoff * 2, UDPCAST_LAYER_MAX_BACKOFF);
+
+	vdebugp(4, "carousel", "dropped layer [layer=%i, loss=%.3f, backoff=%.0f]", layer, Loss, state.Backoff);
+}
+
+void UdpCastCarouselClient::measureLayers() {
+	double currentTime = timef();
+	if(m_measureTime + UDPCAST_LAYER_PERIOD > currentTime)
+		return;
+
+	unsigned received = 0, lost = 0;
+	for(unsigned layer = 0; layer < m_layers.size(); ++layer) {
+		received += m_layers[layer].Received;
+		lost += m_layers[layer].Lost;
+		m_layers[layer].Received = m_layers[layer].Lost = 0;
+	}
+
+	// 0 - warstwy wlasnie zmienione, pierwszy okres nie jest oceniany
+	bool settled = m_measureTime > 0;
+	m_measureTime = currentTime;
+	Loss = received + lost ? float(lost) / (received + lost) : 0;
+
+	// bez ruchu nie ma czego mierzyc, po zmianie warstw pomiar jest niepewny
+	if(!received || !settled) 
+		return;
+
+	if(Loss > UDPCAST_LAYER_DROP_LOSS && layers() > 1) {
+		dropLayer();
+		m_measureTime = 0;
+	}
+	else if(Loss < UDPCAST_LAYER_ADD_LOSS) {
+		// najwyzsza warstwa jest juz bezpieczna
+		m_layers[layers() - 1].Backoff = UDPCAST_LAYER_BACKOFF;
+
+		if(layers() < m_layers.size() && m_layers[layers()].JoinTime <= currentTime) {
+			addLayer();
+			m_measureTime = 0;
+		}
+	}
+}
+
+void UdpCastCarouselClient::gotLayerPacket(const MclSymbolPacket& symbol) {
+	if(symbol.Layer >= m_layers.size())
+		return;
+
+	Layer& layer = m_layers[symbol.Layer];
+	int gap = int(symbol.Seq - layer.Seq);
+
+	// opoznione pakiety nie sa liczone, duzy skok to nowy strumien nadawcy
+	if(layer.Valid && gap >= 0 && gap < (int)UDPCAST_MAX_WINDOW)
+		layer.Lost += gap;
+	if(!layer.Valid || gap >= 0) {
+		layer.Seq = symbol.Seq + 1;
+		layer.Valid = true;
+	}
+	++layer.Received;
+}
+
+void UdpCastCarouselClient::forgetObject(unsigned id) {
+	DecoderList::iterator itor = m_decoders.find(id);
+	if(itor == m_decoders.end())
+		return;
+
+	delete itor->second;
+	m_decoders.erase(itor);
+}
+
+void UdpCastCarouselClient::gotSymbol(const MclSymbolPacket& symbol, int size) {
+	unsigned header = sizeof(MclSymbolPacket) - sizeof(symbol.Data);
+	if(size < (int)header || symbol.SymbolSize == 0 || symbol.SymbolSize > size - header || symbol.Degree == 0) {
+		++InvalidCount;
+		return;
+	}
+
+	++SymbolCount;
+	gotLayerPacket(symbol);
+
+	if(!onWantObject(symbol.Object, symbol.Size)) {
+		forgetObject(symbol.Object);
+		return;
+	}
+
+	DecoderList::iterator itor = m_decoders.find(symbol.Object);
+
+	// obiekt zostal zmieniony przez nadawce
+	if(itor != m_decoders.end()) {
+		const UdpCastFountainDecoder& code = itor->second->Code;
+		if(code.size() != symbol.Size || code.symbolSize() != symbol.SymbolSize || itor->second->Crc32 != symbol.Crc32) {
+			forgetObject(symbol.Object);
+			itor = m_decoders.end();
+		}
+	}
+
+	if(itor == m_decoders.end()) {
+		// zwolnij miejsce, porzucajac obiekt z najmniejsza iloscia symboli
+		if(m_decoders.size() >= MaxDecoders) {
+			DecoderList::iterator least = m_decoders.begin();
+			FurEach(DecoderList, decoder, m_decoders) {
+				if(decoder->second->Code.received() < least->second->Code.received())
+					least = decoder;
+			}
+			delete least->second;
+			m_decoders.erase(least);
+		}
+
+		Decoder* decoder = new Decoder(symbol.Size, symbol.SymbolSize, symbol.Crc32);
+		itor = m_decoders.insert(make_pair(symbol.Object, decoder)).first;
+	}
+
+	Decoder& decoder = *itor->second;
+	if(!decoder.Code.addSymbol(symbol.Symbol, symbol.Degree, symbol.Data))
+		return;
+
+	// obiekt kompletny
+	auto_ptr<Decoder> done(itor->second);
+	m_decoders.erase(itor);
+
+	if(UdpCastFountain::checksum(done->Code.data(), symbol.Size) != done->Crc32) {
+		vdebugp(5, "carousel", "invalid object checksum [id=%i]", symbol.Object);
+		++InvalidCount;
+		return;
+	}
+
+	++ObjectCount;
+	SymbolsUsed += done->Code.received();
+	SymbolsNeeded += done->Code.count();
+
+	vdebugp(6, "carousel", "decoded object [id=%i, symbols=%i/%i]", symbol.Object, done->Code.received(), done->Code.count());
+
+	onObject(symbol.Object, done->Code.data(), symbol.Size);
+}
+
+void UdpCastCarouselClient::onSockRead(const SockData& data) {
+	if(data.Size < (int)sizeof(MclPacket))
+		return;
+
+	const MclPacket* packet = (const MclPacket*)data.Data;
+
+	switch(packet->Type) {
+		case MclSymbol:
+			gotSymbol(*(const MclSymbolPacket*)data.Data, data.Size);
+			break;
+	}
+}
+
+void UdpCastCarouselClient::onFdTick() {
+	if(m_layers.size() > 1)
+		measureLayers();
+}
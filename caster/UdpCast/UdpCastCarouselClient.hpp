@@ -0,0 +1,125 @@
+#pragma once
+
+#include "../AsyncLib/AsyncLib.hpp"
+#include "UdpCastPacket.hpp"
+#include "UdpCastFountain.hpp"
+
+const unsigned UDPCAST_CAROUSEL_DECODERS = 32;
+
+//! Okres pomiaru strat, progi odlaczenia i dolaczenia warstwy
+const float UDPCAST_LAYER_PERIOD = 1;
+const float UDPCAST_LAYER_DROP_LOSS = 0.05f;
+const float UDPCAST_LAYER_ADD_LOSS = 0.01f;
+
+//! Poczatkowe i maksymalne opoznienie ponownej proby dolaczenia odrzuconej warstwy
+const float UDPCAST_LAYER_BACKOFF = 2;
+const float UDPCAST_LAYER_MAX_BACKOFF = 64;
+
+class UdpCastCarouselClient;
+
+//! Gniazdo dodatkowej warstwy, pakiety trafiaja do wspolnych dekoderow
+class UdpCastCarouselLayer : public UdpSock {
+	UdpCastCarouselClient& Owner;
+
+public:
+	UdpCastCarouselLayer(UdpCastCarouselClient& owner) : Owner(owner) {
+	}
+
+	bool waitForRead() const;
+
+private:
+	void onSockRead(const SockData& data);
+};
+
+//! Odbiorca karuzeli: nie dolacza do nadawcy, dekoduje obiekty z dowolnych odebranych symboli
+class UdpCastCarouselClient : public UdpSock {
+public:
+	struct Decoder {
+		unsigned Crc32;
+		UdpCastFountainDecoder Code;
+
+		Decoder(unsigned size, unsigned symbolSize, unsigned crc32) : Crc32(crc32), Code(size, symbolSize) {
+		}
+	};
+
+	typedef map<unsigned, Decoder*> DecoderList;
+
+	//! Pomiar strat i historia dolaczania warstwy
+	struct Layer {
+		bool Valid;
+		unsigned Seq;
+		unsigned Received, Lost;
+		double Backoff, JoinTime;
+
+		Layer() : Valid(false), Seq(0), Received(0), Lost(0), Backoff(UDPCAST_LAYER_BACKOFF), JoinTime(0) {
+		}
+	};
+
+	typedef vector<UdpCastCarouselLayer*> LayerSockList;
+
+private:
+	DecoderList m_decoders;
+
+	//! Subskrybowane warstwy powyzej zerowej (warstwa 0 to to gniazdo)
+	LayerSockList m_layerSocks;
+	vector<Layer> m_layers;
+	unsigned m_layerPort;
+	string m_bindAddress;
+	unsigned m_group;
+	double m_measureTime;
+
+public: // configuration
+	//! Ilosc obiektow dekodowanych jednoczesnie
+	unsigned MaxDecoders;
+
+public: // statistics
+	unsigned SymbolCount;
+	unsigned InvalidCount;
+	unsigned ObjectCount;
+
+	//! Symbole odebrane dla zdekodowanych obiektow i ilosc ich symboli zrodlowych
+	long long SymbolsUsed, SymbolsNeeded;
+
+	//! Strata pakietow w ostatnim okresie pomiaru (subskrybowane warstwy)
+	float Loss;
+
+public:
+	UdpCastCarouselClient();
+	~UdpCastCarouselClient();
+
+public:
+	//! Przerywa dekodowanie obiektu (np. odebranego inna droga)
+	void forgetObject(unsigned id);
+
+	unsigned decoderCount() const { return m_decoders.size(); }
+
+	//! Srednia ilosc symboli potrzebna do zdekodowania obiektu (1 - bez narzutu)
+	float overhead() const { return SymbolsNeeded ? float(SymbolsUsed) / SymbolsNeeded : 0; }
+
+	//! Warstwy nadawane przez serwer (port i grupa jak w UdpCastCarouselServer::setLayers, 0 - bez dolaczania do grup)
+	void setLayers(unsigned layers, unsigned port, const string& bindAddress, unsigned group);
+	unsigned layers() const { return m_layerSocks.size() + 1; }
+	long long layerRecvRate() const;
+
+private:
+	void gotSymbol(const MclSymbolPacket& symbol, int size);
+	void gotLayerPacket(const MclSymbolPacket& symbol);
+
+	//! Dolacza lub odlacza najwyzsza warstwe zaleznie od strat
+	void measureLayers();
+	void addLayer();
+	void dropLayer();
+
+private:
+	void onSockRead(const SockData& data);
+	void onFdTick();
+
+	friend class UdpCastCarouselLayer;
+
+protected:
+	//! Czy obiekt jest jeszcze potrzebny
+	virtual bool onWantObject(unsigned id, unsigned size) = 0;
+
+	//! Zdekodowany obiekt (dane wazne tylko w trakcie wywolania)
+	virtual void onObject(unsigned id, const void* data, unsigned size) = 0;
+};
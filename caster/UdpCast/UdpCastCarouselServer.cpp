@@ -0,0 +1,163 @@
+#include "../AsyncLib/AsyncLib.hpp"
+#include "../AsyncLib/Log.hpp"
+#include "../AsyncLib/ForEach.hpp"
+#include "UdpCastPacket.hpp"
+#include "UdpCastCarouselServer.hpp"
+
+UdpCastCarouselServer::UdpCastCarouselServer() {
+	m_next = 0;
+	MaxSize = 1400;
+	MaxObjects = UDPCAST_CAROUSEL_OBJECTS;
+	ObjectRound = 0;
+	m_slot = 0;
+	m_layerSeq.resize(1);
+	SendLength = 0;
+	SendCount = 0;
+	ObjectCount = 0;
+}
+
+UdpCastCarouselServer::~UdpCastCarouselServer() {
+	delete_all(m_objects.begin(), m_objects.end());
+	m_objects.clear();
+}
+
+bool UdpCastCarouselServer::hasObject(unsigned id) const {
+	cFurEach(ObjectList, object, m_objects) {
+		if((*object)->Id == id)
+			return true;
+	}
+	return false;
+}
+
+void UdpCastCarouselServer::removeObject(unsigned id) {
+	FurEach(ObjectList, object, m_objects) {
+		if((*object)->Id != id)
+			continue;
+
+		vdebugp(6, "carousel", "removing object [id=%i, symbols=%i]", id, (*object)->Symbol);
+
+		delete *object;
+		m_objects.erase(object);
+		break;
+	}
+
+	m_symbols.erase(id);
+}
+
+void UdpCastCarouselServer::setLayers(unsigned layers, unsigned port, const string& address) {
+	layers = max(1U, min(layers, UDPCAST_MAX_LAYERS));
+	m_layers.clear();
+	m_layerSeq.assign(layers, 0);
+
+	unsigned group = ntohl(inet_addr(address.c_str()));
+
+	for(unsigned layer = 1; layer < layers; ++layer) {
+		SockDesc desc;
+		memset(&desc, 0, sizeof(desc));
+		desc.sin_family = AF_INET;
+		desc.sin_port = htons(port + 1 + layer);
+		desc.sin_addr.s_addr = htonl(group + layer);
+		m_layers.push_back(desc);
+	}
+}
+
+unsigned UdpCastCarouselServer::nextLayer() {
+	if(m_layers.empty())
+		return 0;
+
+	// warstwa 0 raz na cykl, najwyzsza co drugi symbol
+	unsigned top = m_layers.size();
+	unsigned slot = m_slot++ % (1U << top);
+	if(slot == 0)
+		return 0;
+
+	unsigned layer = top;
+	while(!(slot & 1)) {
+		slot >>= 1;
+		--layer;
+	}
+	return layer;
+}
+
+void UdpCastCarouselServer::addObject(unsigned id, string& data) {
+	Object* object = new Object(id, data.size(), min<unsigned>(MaxSize, max<unsigned>(data.size(), 1)));
+	object->Data.swap(data);
+	object->Crc32 = UdpCastFountain::checksum(object->Data.c_str(), object->Data.size());
+
+	// odbiorcy moga juz miec symbole z poprzedniej tury
+	map<unsigned, unsigned>::iterator symbol = m_symbols.find(id);
+	if(symbol != m_symbols.end()) {
+		object->Symbol = symbol->second;
+		m_symbols.erase(symbol);
+	}
+
+	m_objects.push_back(object);
+	++ObjectCount;
+
+	vdebugp(6, "carousel", "adding object [id=%i, size=%i, symbols=%i]", id, object->Data.size(), object->Code.count());
+}
+
+void UdpCastCarouselServer::sendSymbol(Object& object, unsigned layer) {
+	unsigned symbolSize = object.Code.symbolSize();
+	unsigned size = sizeof(MclSymbolPacket) - 1 + symbolSize;
+	if(m_packet.size() < size)
+		m_packet.resize(size);
+
+	MclSymbolPacket& packet = *(MclSymbolPacket*)&m_packet[0];
+	packet.Type = MclSymbol;
+	packet.Object = object.Id;
+	packet.Size = object.Data.size();
+	packet.Crc32 = object.Crc32;
+	packet.Symbol = object.Symbol++;
+	packet.Degree = object.Code.degree(packet.Symbol);
+	packet.SymbolSize = symbolSize;
+	packet.Layer = layer;
+	packet.Seq = m_layerSeq[layer]++;
+
+	object.Code.encode((const byte*)object.Data.c_str(), packet.Symbol, packet.Degree, packet.Data);
+	sendAllData(&packet, size, layer ? &m_layers[layer - 1] : NULL);
+
+	++object.Sent;
+	SendLength += symbolSize;
+	++SendCount;
+}
+
+void UdpCastCarouselServer::onSockWrite() {
+	// uzupelnij liste aktywnych obiektow
+	while(m_objects.size() < MaxObjects) {
+		unsigned id;
+		string data;
+		if(!onGetObject(id, data))
+			break;
+		if(hasObject(id))
+			continue;
+		addObject(id, data);
+	}
+
+	// po jednym symbolu kazdego obiektu, predkosc ogranicza gniazdo
+	for(unsigned i = m_objects.size(); i-- > 0 && m_objects.size(); ) {
+		m_next %= m_objects.size();
+		Object* object = m_objects[m_next];
+		sendSymbol(*object, nextLayer());
+
+		if(ObjectRound <= 0 || object->Sent < ObjectRound * object->Code.count()) {
+			++m_next;
+			continue;
+		}
+
+		// koniec tury: obiekt wroci pozniej, jesli ktos go jeszcze potrzebuje
+		vdebugp(6, "carousel", "object round finished [id=%i, symbols=%i]", object->Id, object->Symbol);
+
+		m_symbols[object->Id] = object->Symbol;
+		m_objects.erase(m_objects.begin() + m_next);
+		delete object;
+	}
+}
+
+void UdpCastCarouselServer::onFdTick() {
+	onTick();
+}
+
+bool UdpCastCarouselServer::waitForWrite() const {
+	return m_objects.size() || hasData();
+}
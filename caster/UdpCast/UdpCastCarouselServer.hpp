@@ -0,0 +1,92 @@
+#pragma once
+
+#include "../AsyncLib/AsyncLib.hpp"
+#include "UdpCastPacket.hpp"
+#include "UdpCastFountain.hpp"
+
+const unsigned UDPCAST_CAROUSEL_OBJECTS = 8;
+
+//! Nadawca karuzeli: wysyla bez konca symbole kodu fontannowego aktywnych obiektow.
+//! Nie przyjmuje zadnych pakietow od odbiorcow, koszt nie zalezy od ich ilosci.
+class UdpCastCarouselServer : public UdpSock {
+public:
+	struct Object {
+		unsigned Id;
+		string Data;
+		unsigned Crc32;
+		unsigned Symbol;
+		UdpCastFountain Code;
+
+		//! Symbole wyslane w biezacej turze
+		unsigned Sent;
+
+		Object(unsigned id, unsigned size, unsigned symbolSize) : Id(id), Crc32(0), Symbol(0), Code(size, symbolSize), Sent(0) {
+		}
+	};
+
+	typedef vector<Object*> ObjectList;
+
+private:
+	ObjectList m_objects;
+	unsigned m_next;
+	vector<byte> m_packet;
+
+	//! Adresy warstw powyzej zerowej (warstwa 0 - adres wysylania gniazda)
+	vector<SockDesc> m_layers;
+	vector<unsigned> m_layerSeq;
+	unsigned m_slot;
+
+	//! Kolejny numer symbolu obiektow wycofanych przed odebraniem przez wszystkich
+	map<unsigned, unsigned> m_symbols;
+
+public: // configuration
+	//! Rozmiar symbolu w pakiecie
+	unsigned MaxSize;
+
+	//! Ilosc obiektow wysylanych na przemian
+	unsigned MaxObjects;
+
+	//! Ilosc symboli obiektu w jednej turze jako wielokrotnosc symboli zrodlowych (0 - bez limitu).
+	//! Odbiorcy na nizszych warstwach dokoncza obiekt w kolejnej turze, szybsi nie czekaja.
+	float ObjectRound;
+
+public: // statistics
+	long long SendLength;
+	unsigned SendCount;
+	unsigned ObjectCount;
+
+public:
+	UdpCastCarouselServer();
+	~UdpCastCarouselServer();
+
+public:
+	bool hasObject(unsigned id) const;
+	void removeObject(unsigned id);
+	unsigned objectCount() const { return m_objects.size(); }
+	const ObjectList& objects() const { return m_objects; }
+
+	//! Warstwa i > 0 jest wysylana na adres + i i port + 1 + i, kazda kolejna podwaja laczna predkosc
+	void setLayers(unsigned layers, unsigned port, const string& address);
+	unsigned layerCount() const { return m_layers.size() + 1; }
+
+private:
+	void addObject(unsigned id, string& data);
+	void sendSymbol(Object& object, unsigned layer);
+
+	//! Warstwa kolejnego symbolu (udzial warstwy i > 0 to 2^(i-1) / 2^(n-1))
+	unsigned nextLayer();
+
+private:
+	void onSockRead(const SockData& data) { }
+	void onSockWrite();
+	void onFdTick();
+	bool waitForWrite() const;
+
+protected:
+	//! Kolejny obiekt do wysylania (dane sa przejmowane)
+	virtual bool onGetObject(unsigned& id, string& data) = 0;
+	virtual void onTick() { }
+
+	//! Czy onGetObject ma gotowe dane (bez czekania na dysk)
+	virtual bool hasData() const { return true; }
+};
@@ -4,8 +4,28 @@
 #include "UdpCastPacket.hpp"
 #include "UdpCastClient.hpp"
 
+#ifdef UDPCAST_RECVMMSG
+#include <sys/socket.h>
+#endif
+
 UdpCastClient::UdpCastClient() {
 	m_clientId = ticks();
+	m_recvOffset = 0;
+	m_recvStride = 0;
+	m_serverSeq = 0;
+	m_fecGroup = 0;
+	m_readySeq = 0;
+	m_highSeq = 0;
+	m_highSeqValid = false;
+	m_lossSeen = m_lossCount = 0;
+	m_loss = 0;
+	RecvWindow = UDPCAST_DEFAULT_RECV_WINDOW;
+	RecvBatchCount = RecvBatchPacketCount = 0;
+	ParityCount = FecRecovered = 0;
+	NakCount = SkipCount = 0;
+	m_acker = m_lagging = m_nakPending = false;
+	m_livenessTime = 0;
+	m_releasedSeq = 0;
 }
 
 UdpCastClient::~UdpCastClient() {
@@ -25,6 +45,8 @@ double UdpCastClient::sendJoin(unsigned retries) {
 	MclJoinPacket packet;
 	packet.Type = MclJoin;
 	packet.ID = m_clientId;
+	packet.Version = UDPCAST_VERSION;
+	packet.Window = m_recvQueue.size() ? m_recvQueue.size() : min(RecvWindow, UDPCAST_MAX_WINDOW);
 	sendAllData(&packet, sizeof(packet));
 	m_state = Join;
 	
@@ -33,11 +55,12 @@ double UdpCastClient::sendJoin(unsigned retries) {
 	return DESTROY_TIMER;
 }
 
-void UdpCastClient::sendUpdate(unsigned tick, unsigned short maxSeq) {
+void UdpCastClient::sendUpdate(unsigned tick, MclSeq maxSeq) {
 	if(m_state != Data)
 		throw runtime_error("invalid state, expected Data");
 		
-	unsigned short offset = pendingSize();
+	unsigned offset = pendingSize();
+	unsigned window = m_recvQueue.size();
 
 	MclUpdatePacket2 packet;
 	memset(packet.Data, 0, sizeof(packet.Data));
@@ -47,11 +70,25 @@ void UdpCastClient::sendUpdate(unsigned tick, unsigned short maxSeq) {
 	packet.MaxSeq = m_seq + offset;
 	packet.Rate = recvLastRate();
 
-	for(unsigned i = offset; i < UDPCAST_MAX_RECV_WINDOW; ++i) {
-		if(short(m_seq + i - maxSeq) >= 0)
+	// usrednij strate z wystarczajacej ilosci pakietow
+	if(m_lossSeen >= 64) {
+		m_loss = m_loss * 0.75f + 0.25f * m_lossCount / m_lossSeen;
+		m_lossSeen = m_lossCount = 0;
+	}
+	packet.Loss = m_loss;
+
+	// braki przed ostatnim wyslanym pakietem lub konsument nie nadaza
+	m_lagging = int(m_serverSeq - (m_seq + offset)) > 0 || offset * 2 > window;
+	packet.Lagging = m_lagging;
+
+	// pozostali odbiorcy odzywaja sie w rozlozonych odstepach
+	m_livenessTime = timef() + UDPCAST_LIVENESS_TIME * (0.5 + double(rand()) / RAND_MAX);
+
+	for(unsigned i = offset; i < window; ++i) {
+		if(int(m_seq + i - maxSeq) >= 0)
 			break;
 
-		if(m_recvQueue[(i + m_recvOffset) % UDPCAST_MAX_RECV_WINDOW].get()) {
+		if(m_recvQueue[(i + m_recvOffset) % window]) {
 			packet.MaxSeq = m_seq + i + 1;
 			packet.Data[(i - offset) >> 3] |= 1<<((i - offset)&7);
 		}
@@ -62,10 +99,10 @@ void UdpCastClient::sendUpdate(unsigned tick, unsigned short maxSeq) {
 
 	vdebugf(5, "sending update [ps=%i,pms=%i]", packet.Seq, packet.MaxSeq);
 	
-	if(packet.Seq == packet.MaxSeq && short(packet.MaxSeq - maxSeq) < 0 && offset < UDPCAST_MAX_RECV_WINDOW) // advance seq by one
+	if(packet.Seq == packet.MaxSeq && int(packet.MaxSeq - maxSeq) < 0 && offset < window) // advance seq by one
 		++packet.MaxSeq;
 	
-	unsigned dataSize = (short(packet.MaxSeq - packet.Seq) + 7) >> 3;
+	unsigned dataSize = (int(packet.MaxSeq - packet.Seq) + 7) >> 3;
 	sendAllData(&packet, sizeof(MclUpdatePacket) + dataSize);
 	
 	++UpdateCount;
@@ -73,8 +110,8 @@ void UdpCastClient::sendUpdate(unsigned tick, unsigned short maxSeq) {
 
 unsigned UdpCastClient::windowSize() const {
 	unsigned count = 0;
-	for(unsigned i = 0; i < UDPCAST_MAX_RECV_WINDOW; ++i) {
-		if(m_recvQueue[i].get())
+	for(unsigned i = 0; i < m_recvQueue.size(); ++i) {
+		if(m_recvQueue[i])
 			++count;
 	}
 	return count;
@@ -82,8 +119,8 @@ unsigned UdpCastClient::windowSize() const {
 
 unsigned UdpCastClient::pendingSize() const {
 	unsigned count = 0;
-	for(unsigned i = 0; i < UDPCAST_MAX_RECV_WINDOW; ++i) {
-		if(m_recvQueue[(i + m_recvOffset) % UDPCAST_MAX_RECV_WINDOW].get())
+	for(unsigned i = 0; i < m_recvQueue.size(); ++i) {
+		if(m_recvQueue[(i + m_recvOffset) % m_recvQueue.size()])
 			++count;
 		else
 			return count;
@@ -107,18 +144,52 @@ double UdpCastClient::sendLeave(unsigned retries) {
 
 void UdpCastClient::flushRecvWindow(bool update) {
 	bool update2 = false;
+	bool skipped = false;
+
+	if(m_recvQueue.empty())
+		return;
 	
-	while(m_recvQueue[m_recvOffset].get()) {
-		if(!onConsumeData(*m_recvQueue[m_recvOffset]))
+	while(true) {
+		byte* packet = m_recvQueue[m_recvOffset];
+
+		if(!packet) {
+			if(int(m_releasedSeq - m_seq) <= 0)
+				break;
+
+			// serwer zwolnil pakiet, ktorego nie odebralismy
+			if(!skipped)
+				onSkip();
+			skipped = true;
+			m_recvOffset = (m_recvOffset + 1) % m_recvQueue.size();
+			++m_seq;
+			++SkipCount;
+			update2 = true;
+			continue;
+		}
+
+		if(!groupReady())
+			break;
+
+		unsigned size = m_recvSize[m_recvOffset] - sizeof(MclDataPacket);
+		if(!onConsumeData(packet + sizeof(MclDataPacket), size)) {
+			// zapelnione okno trzeba zglosic serwerowi
+			scheduleNak();
 			return;
+		}
 
-		ContentLength += m_recvQueue[m_recvOffset]->size();
-		m_recvQueue[m_recvOffset].reset();
-		m_recvOffset = (m_recvOffset + 1) % UDPCAST_MAX_RECV_WINDOW;
+		ContentLength += size;
+		m_recvFree.push_back(packet);
+		m_recvQueue[m_recvOffset] = NULL;
+		m_recvOffset = (m_recvOffset + 1) % m_recvQueue.size();
 		++m_seq;
 		update2 = true;
 	}
-	if(update && update2)
+
+	// grupy, ktore zaczely byc oddawane, nie wymagaja juz naprawy
+	while(m_parityList.size() && int(m_parityList.begin()->first - m_seq) < 0)
+		m_parityList.erase(m_parityList.begin());
+
+	if(update && update2 && (m_acker || m_lagging))
 		sendUpdate(0, m_seq);
 }
 
@@ -126,7 +197,8 @@ void UdpCastClient::gotJoinResponse(MclJoinResponsePacket& join, int size, const
 	if(m_state != Join && m_state != Data)
 		return;
 
-	if(join.ID != m_clientId)
+	// starsze serwery wysylaja krotsza odpowiedz bez uzgodnionego okna
+	if(size < (int)sizeof(MclJoinResponsePacket) || join.ID != m_clientId)
 		return;
 
 	vdebugf(5, "got joinResponse [seq=%i]", join.Seq);
@@ -134,37 +206,107 @@ void UdpCastClient::gotJoinResponse(MclJoinResponsePacket& join, int size, const
 	Timer::cancel(TimerDelegate(this, &UdpCastClient::sendJoin));
 	
 	sendAllData(&join, sizeof(join));
+
+	// powtorzona odpowiedz nie przesuwa okna w trakcie odbioru
+	if(m_state == Data)
+		return;
+
+	// bufory sa przydzielane raz, przy pierwszym dolaczeniu
+	if(m_recvSlab.empty()) {
+		allocRecvSlab(join.Window, join.MaxSize);
+	}
+	// ponowne dolaczenie: pakiety sprzed odlaczenia nie naleza do nowego okna
+	else {
+		for(unsigned i = 0; i < m_recvQueue.size(); ++i) {
+			if(m_recvQueue[i]) {
+				m_recvFree.push_back(m_recvQueue[i]);
+				m_recvQueue[i] = NULL;
+			}
+		}
+		m_recvOffset = 0;
+		m_parityList.clear();
+		m_highSeqValid = false;
+	}
+
+	// grupa musi sie zmiescic w oknie razem z nastepna
+	m_fecGroup = join.FecGroup <= m_recvQueue.size() / 2 ? join.FecGroup : 0;
+
 	m_state = Data;
 	m_seq = join.Seq;
+	m_readySeq = join.Seq;
+	m_serverSeq = join.Seq;
+	m_releasedSeq = join.Seq;
+	m_acker = m_lagging = false;
 	m_keepAliveTime = timef();
+	m_livenessTime = timef() + UDPCAST_LIVENESS_TIME;
 	
 	onJoin();
 }
 
-void UdpCastClient::gotData(MclDataPacket2& data, int size, const SockDesc& desc) {
-	if(m_state != Data)
-		return;
+bool UdpCastClient::gotData(MclDataPacket2& data, int size, const SockDesc& desc, byte* buffer) {
+	if(m_state != Data || size < (int)sizeof(MclDataPacket) || size > (int)m_recvStride)
+		return false;
 	
-	short index = data.Seq - m_seq;
+	int window = m_recvQueue.size();
+	int index = int(data.Seq - m_seq);
+	bool adopted = false;
 
-	if(index >= 0 && index < UDPCAST_MAX_RECV_WINDOW) {
+	if(int(data.MaxSeq - m_serverSeq) > 0)
+		m_serverSeq = data.MaxSeq;
+
+	// pakiety pominiete przy pierwszym wyslaniu
+	if(!m_highSeqValid) {
+		m_highSeq = data.Seq;
+		m_highSeqValid = true;
+	}
+	else if(int(data.Seq - m_highSeq) > 0) {
+		if(int(data.Seq - m_highSeq) > 1)
+			scheduleNak();
+		m_lossSeen += data.Seq - m_highSeq;
+		m_lossCount += data.Seq - m_highSeq - 1;
+		m_highSeq = data.Seq;
+	}
+
+	if(index >= 0 && index < window) {
 		++DataCount;
 
-		unsigned dataSize = size - sizeof(MclDataPacket);
-		if(m_recvQueue[(index + m_recvOffset) % UDPCAST_MAX_RECV_WINDOW].get())
+		byte*& slot = m_recvQueue[(index + m_recvOffset) % window];
+		if(slot) {
 			DataDuplicate++;
+		}
+		else {
+			// pakiet odebrany przez recvmmsg zostaje w swoim buforze
+			if(buffer) {
+				slot = buffer;
+				adopted = true;
+			}
+			else {
+				slot = m_recvFree.back();
+				m_recvFree.pop_back();
+				memcpy(slot, &data, size);
+			}
+			m_recvSize[(index + m_recvOffset) % window] = size;
+
+			if(m_fecGroup)
+				recoverGroup(data.Seq - data.Seq % m_fecGroup);
+		}
 
-		m_recvQueue[(index + m_recvOffset) % UDPCAST_MAX_RECV_WINDOW].reset(new string(data.Data, data.Data + dataSize));
 		flushRecvWindow();
 	}
 	
-	if(index >= UDPCAST_MAX_RECV_WINDOW)
+	if(index >= window) {
 		++InvalidDataCount;
+		scheduleNak();
+	}
 
 	if(data.KeepAlive) {
 		m_keepAliveTime = timef();
-		sendUpdate(data.Tick, data.MaxSeq);
+		if(wantUpdate())
+			sendUpdate(data.Tick, data.MaxSeq);
+		else
+			scheduleNak();
 	}
+	return adopted;
 }
 
 void UdpCastClient::gotKeepAlive(MclKeepAlivePacket& keepAlive, int size, const SockDesc& desc) {
@@ -173,12 +315,76 @@ void UdpCastClient::gotKeepAlive(MclKeepAlivePacket& keepAlive, int size, const
 
 	m_keepAliveTime = timef();
 	++KeepAliveCount;
+	if(int(keepAlive.MaxSeq - m_serverSeq) > 0)
+		m_serverSeq = keepAlive.MaxSeq;
+	if(int(keepAlive.Seq - m_releasedSeq) > 0)
+		m_releasedSeq = keepAlive.Seq;
 	flushRecvWindow();
-	sendUpdate(keepAlive.Tick, keepAlive.MaxSeq);
+
+	if(wantUpdate())
+		sendUpdate(keepAlive.Tick, keepAlive.MaxSeq);
+	else
+		scheduleNak();
+}
+
+void UdpCastClient::gotAckers(MclAckersPacket& ackers, int size, const SockDesc& desc) {
+	if(m_state != Data)
+		return;
+
+	unsigned header = sizeof(MclAckersPacket) - sizeof(ackers.ID);
+	if(size < (int)header || ackers.Count > UDPCAST_MAX_ACKERS || size < int(header + ackers.Count * sizeof(ackers.ID[0])))
+		return;
+
+	bool acker = false;
+	for(unsigned i = 0; i < ackers.Count; ++i) {
+		if(ackers.ID[i] == m_clientId)
+			acker = true;
+	}
+
+	vdebugf(5, "got ackers [count=%i, acker=%i]", ackers.Count, acker);
+
+	// nowy potwierdzajacy od razu podaje swoj stan
+	bool report = acker && !m_acker;
+	m_acker = acker;
+	if(report)
+		sendUpdate(0, m_serverSeq);
+}
+
+bool UdpCastClient::wantUpdate() const {
+	return m_acker || m_lagging || m_livenessTime < timef();
+}
+
+void UdpCastClient::scheduleNak() {
+	if(m_nakPending || m_state != Data)
+		return;
+
+	// retransmisja zamowiona przez innego odbiorce moze dotrzec wczesniej
+	m_nakPending = true;
+	Timer::after(TimerDelegate(this, &UdpCastClient::sendNak), UDPCAST_NAK_DELAY * rand() / RAND_MAX, 1);
+}
+
+double UdpCastClient::sendNak(unsigned count) {
+	m_nakPending = false;
+
+	if(m_state != Data)
+		return DESTROY_TIMER;
+
+	unsigned offset = pendingSize();
+	bool missing = int(m_serverSeq - (m_seq + offset)) > 0;
+	bool full = offset * 2 > m_recvQueue.size();
+
+	// braki uzupelnione w czasie oczekiwania, pelne okno zglaszane raz
+	if(missing || (full && !m_lagging)) {
+		sendUpdate(0, m_serverSeq);
+		++NakCount;
+	}
+
+	return DESTROY_TIMER;
 }
 
 void UdpCastClient::gotLeaveResponse(MclLeaveResponsePacket& leave, int size, const SockDesc& desc) {
-	if(m_state != Leave && m_state != Idle) {
+	// w trakcie odbioru: serwer usunal klienta (timeout, zbyt wolny)
+	if(m_state != Leave && m_state != Idle && m_state != Data) {
 		return;
 	}
 
@@ -188,7 +394,7 @@ void UdpCastClient::gotLeaveResponse(MclLeaveResponsePacket& leave, int size, co
 	onLeave();
 }
 
-void UdpCastClient::onSockRead(const SockData& data) {
+bool UdpCastClient::dispatchPacket(const SockData& data, byte* buffer) {
 	MclPacket* packet = (MclPacket*)data.Data;
 
 	switch(packet->Type) {
@@ -197,8 +403,7 @@ void UdpCastClient::onSockRead(const SockData& data) {
 			break;
 			
 		case MclData:
-			gotData(*(MclDataPacket2*)data.Data, data.Size, data.Desc);
-			break;
+			return gotData(*(MclDataPacket2*)data.Data, data.Size, data.Desc, buffer);
 
 		case MclKeepAlive:
 			gotKeepAlive(*(MclKeepAlivePacket*)data.Data, data.Size, data.Desc);
@@ -207,7 +412,226 @@ void UdpCastClient::onSockRead(const SockData& data) {
 		case MclLeaveResponse:
 			gotLeaveResponse(*(MclLeaveResponsePacket*)data.Data, data.Size, data.Desc);
 			break;
+
+		case MclParity:
+			gotParity(*(MclParityPacket*)data.Data, data.Size, data.Desc);
+			break;
+
+		case MclAckers:
+			gotAckers(*(MclAckersPacket*)data.Data, data.Size, data.Desc);
+			break;
 	}
+	return false;
+}
+
+void UdpCastClient::gotParity(MclParityPacket& parity, int size, const SockDesc& desc) {
+	if(m_state != Data || !m_fecGroup)
+		return;
+
+	unsigned header = sizeof(MclParityPacket) - sizeof(parity.Data);
+	if(size < (int)header || parity.Size > size - header || parity.Count > m_fecGroup || parity.Seq % m_fecGroup)
+		return;
+	if(parity.Index >= UDPCAST_FEC_MAX_PARITY || parity.Size < UdpCastFec::HeaderSize)
+		return;
+
+	// grupa juz oddana lub poza oknem
+	int index = int(parity.Seq - m_seq);
+	if(index < 0 || unsigned(index) + parity.Count > m_recvQueue.size())
+		return;
+
+	++ParityCount;
+
+	ParityGroup& group = m_parityList[parity.Seq];
+	if(std::find(group.Rows.begin(), group.Rows.end(), parity.Index) != group.Rows.end())
+		return;
+	if(group.Data.size() && group.Data[0].size() != parity.Size)
+		return;
+
+	group.Count = parity.Count;
+	group.Rows.push_back(parity.Index);
+	group.Data.push_back(string((const char*)parity.Data, parity.Size));
+
+	recoverGroup(parity.Seq);
+	flushRecvWindow();
+}
+
+void UdpCastClient::recoverGroup(MclSeq seq) {
+	ParityGroupList::iterator itor = m_parityList.find(seq);
+	if(itor == m_parityList.end())
+		return;
+
+	ParityGroup& group = itor->second;
+	unsigned window = m_recvQueue.size();
+	int index = int(seq - m_seq);
+	if(index < 0 || unsigned(index) + group.Count > window) {
+		m_parityList.erase(itor);
+		return;
+	}
+
+	// znajdz brakujace pakiety
+	unsigned lost[UDPCAST_FEC_MAX_PARITY];
+	unsigned lostCount = 0;
+
+	for(unsigned i = 0; i < group.Count; ++i) {
+		if(m_recvQueue[(index + i + m_recvOffset) % window])
+			continue;
+		if(lostCount == group.Rows.size())
+			return;
+		lost[lostCount++] = i;
+	}
+
+	if(lostCount == 0) {
+		m_parityList.erase(itor);
+		return;
+	}
+
+	// odejmij odebrane pakiety od pakietow naprawczych
+	unsigned size = group.Data[0].size();
+	byte* data[UDPCAST_FEC_MAX_PARITY];
+
+	for(unsigned row = 0; row < lostCount; ++row) {
+		data[row] = (byte*)&group.Data[row][0];
+
+		for(unsigned i = 0; i < group.Count; ++i) {
+			unsigned offset = (index + i + m_recvOffset) % window;
+			if(!m_recvQueue[offset])
+				continue;
+
+			unsigned dataSize = m_recvSize[offset] - sizeof(MclDataPacket);
+			if(UdpCastFec::HeaderSize + dataSize > size) {
+				m_parityList.erase(itor);
+				return;
+			}
+			UdpCastFec::addPacket(data[row], group.Rows[row], i, m_recvQueue[offset] + sizeof(MclDataPacket), dataSize);
+		}
+	}
+
+	if(!UdpCastFec::solve(lostCount, &group.Rows[0], lost, data, size)) {
+		m_parityList.erase(itor);
+		return;
+	}
+
+	// wstaw odtworzone pakiety do okna
+	for(unsigned i = 0; i < lostCount; ++i) {
+		unsigned dataSize = data[i][0] | (data[i][1] << 8);
+		if(UdpCastFec::HeaderSize + dataSize > size || sizeof(MclDataPacket) + dataSize > m_recvStride)
+			continue;
+
+		unsigned offset = (index + lost[i] + m_recvOffset) % window;
+		byte* packet = m_recvFree.back();
+		m_recvFree.pop_back();
+
+		MclDataPacket& header = *(MclDataPacket*)packet;
+		memset(&header, 0, sizeof(header));
+		header.Type = MclData;
+		header.Seq = seq + lost[i];
+		memcpy(packet + sizeof(MclDataPacket), data[i] + UdpCastFec::HeaderSize, dataSize);
+
+		m_recvQueue[offset] = packet;
+		m_recvSize[offset] = sizeof(MclDataPacket) + dataSize;
+		++FecRecovered;
+	}
+
+	m_parityList.erase(itor);
+}
+
+bool UdpCastClient::groupReady() {
+	if(!m_fecGroup || int(m_seq - m_readySeq) < 0)
+		return true;
+
+	// pozostale pakiety grupy, ktore serwer juz wyslal
+	MclSeq end = m_seq - m_seq % m_fecGroup + m_fecGroup;
+	if(int(end - m_serverSeq) > 0)
+		end = m_serverSeq;
+
+	unsigned window = m_recvQueue.size();
+	// pakiety zwolnione przez serwer nie przyjda, zostana pominiete
+	for(MclSeq seq = m_seq; int(seq - end) < 0; ++seq) {
+		if(!m_recvQueue[(seq - m_seq + m_recvOffset) % window] && int(seq - m_releasedSeq) >= 0)
+			return false;
+	}
+
+	m_readySeq = end;
+	return true;
+}
+
+void UdpCastClient::onSockRead(const SockData& data) {
+	dispatchPacket(data, NULL);
+
+	// odbierz reszte oczekujacych pakietow
+	recvBatch();
+}
+
+void UdpCastClient::recvBatch() {
+#ifdef UDPCAST_RECVMMSG
+	mmsghdr msgs[UDPCAST_MAX_RECV_BATCH];
+	iovec iovs[UDPCAST_MAX_RECV_BATCH];
+	SockDesc descs[UDPCAST_MAX_RECV_BATCH];
+	byte* buffers[UDPCAST_MAX_RECV_BATCH];
+
+	while(true) {
+		// wolnych buforow jest zawsze co najmniej UDPCAST_MAX_RECV_BATCH
+		unsigned count = min<unsigned>(UDPCAST_MAX_RECV_BATCH, m_recvFree.size());
+		if(count == 0)
+			return;
+
+		for(unsigned i = 0; i < count; ++i) {
+			buffers[i] = m_recvFree.back();
+			m_recvFree.pop_back();
+
+			iovs[i].iov_base = buffers[i];
+			iovs[i].iov_len = m_recvStride;
+			memset(&msgs[i], 0, sizeof(msgs[i]));
+			msgs[i].msg_hdr.msg_name = &descs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(SockDesc);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int result = recvmmsg(fd(), msgs, count, MSG_DONTWAIT, NULL);
+
+		if(result > 0) {
+			++RecvBatchCount;
+			RecvBatchPacketCount += result;
+		}
+
+		for(unsigned i = 0; i < count; ++i) {
+			if(int(i) < result && msgs[i].msg_len > 0 && !(msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+				SockData data;
+				data.Data = (const char*)buffers[i];
+				data.Size = msgs[i].msg_len;
+				data.Desc = descs[i];
+
+				if(dispatchPacket(data, buffers[i]))
+					continue;
+			}
+
+			// bufor nie zostal w oknie
+			m_recvFree.push_back(buffers[i]);
+		}
+
+		if(result < int(count))
+			return;
+	}
+#endif
+}
+
+void UdpCastClient::allocRecvSlab(unsigned window, unsigned maxSize) {
+	window = max(2U, min(window, UDPCAST_MAX_WINDOW));
+	m_recvStride = sizeof(MclDataPacket) + min<unsigned>(maxSize, MaxPacketSize);
+
+	m_recvQueue.assign(window, (byte*)NULL);
+	m_recvSize.assign(window, 0);
+	m_recvOffset = 0;
+
+	unsigned count = window + UDPCAST_MAX_RECV_BATCH;
+
+	m_recvSlab.resize(count * m_recvStride);
+	m_recvFree.resize(count);
+	for(unsigned i = 0; i < count; ++i)
+		m_recvFree[i] = &m_recvSlab[i * m_recvStride];
+
+	vdebugf(4, "receive window [window=%i, stride=%i]", window, m_recvStride);
 }
 
 void UdpCastClient::onFdTick() {
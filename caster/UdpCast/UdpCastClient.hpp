@@ -2,11 +2,18 @@
 
 #include "../AsyncLib/AsyncLib.hpp"
 #include "UdpCastPacket.hpp"
+#include "UdpCastFec.hpp"
 
-const int UDPCAST_MAX_RECV_WINDOW = 64;
+const unsigned UDPCAST_DEFAULT_RECV_WINDOW = 1024;
 const float UDPCAST_JOIN_TIMEOUT = 1;
 const int UDPCAST_JOIN_RETRIES = 3;
 const float UDPCAST_SENDER_TIMEOUT = 20;
+const int UDPCAST_MAX_RECV_BATCH = 32;
+const float UDPCAST_LIVENESS_TIME = 3;
+
+#ifdef __linux__
+#define UDPCAST_RECVMMSG
+#endif
 
 class UdpCastClient : public UdpSock {
 public:
@@ -16,21 +23,73 @@ public:
 		Data,
 		Leave
 	};
+
+	//! Odebrane pakiety naprawcze jednej grupy
+	struct ParityGroup {
+		unsigned Count;
+		vector<unsigned> Rows;
+		vector<string> Data;
+
+		ParityGroup() {
+			Count = 0;
+		}
+	};
+
+	typedef map<MclSeq, ParityGroup> ParityGroupList;
 	
 private:
-	auto_ptr<string> m_recvQueue[UDPCAST_MAX_RECV_WINDOW];
+	//! Odebrane pakiety w oknie (wskazniki do bufora m_recvSlab)
+	vector<byte*> m_recvQueue;
+	vector<unsigned> m_recvSize;
 	unsigned m_recvOffset;
-	unsigned short m_seq;
+
+	//! Jeden bufor na wszystkie pakiety (okno + paczka recvmmsg)
+	vector<byte> m_recvSlab;
+	vector<byte*> m_recvFree;
+	unsigned m_recvStride;
+	MclSeq m_seq;
 	EnumState m_state; 
 	double m_keepAliveTime;
 	long long m_clientId;
 
+	//! Nastepny numer sekwencyjny do wyslania przez serwer
+	MclSeq m_serverSeq;
+
+	//! FEC: grupy oczekujace na naprawe, pakiety sa oddawane dopiero po skompletowaniu grupy
+	unsigned m_fecGroup;
+	ParityGroupList m_parityList;
+	MclSeq m_readySeq;
+
+	//! Strata pakietow przy pierwszym wyslaniu (zglaszana serwerowi)
+	MclSeq m_highSeq;
+	bool m_highSeqValid;
+	unsigned m_lossSeen, m_lossCount;
+	float m_loss;
+
+	//! Serwer wybral klienta do potwierdzania keepAlive (pozostali wysylaja tylko NAK)
+	bool m_acker;
+
+	//! Zgloszone braki lub zapelnione okno: potwierdza keepAlive az do nadrobienia
+	bool m_lagging;
+	bool m_nakPending;
+	double m_livenessTime;
+
+	//! Najstarszy pakiet przechowywany przez serwer, wczesniejsze braki sa pomijane
+	MclSeq m_releasedSeq;
+
+public: // configuration
+	//! Ilosc pakietow, ktora klient moze przechowac (uzgadniana przy dolaczeniu)
+	unsigned RecvWindow;
+
 public:
 	unsigned ContentLength;
 	unsigned KeepAliveCount;
 	unsigned UpdateCount;
 	unsigned DataCount, DataDuplicate;
 	unsigned InvalidDataCount;
+	unsigned RecvBatchCount, RecvBatchPacketCount;
+	unsigned ParityCount, FecRecovered;
+	unsigned NakCount, SkipCount;
 
 public:
 	UdpCastClient();
@@ -41,16 +100,39 @@ public:
 	unsigned pendingSize() const;
 
 	double sendJoin(unsigned retries = UDPCAST_JOIN_RETRIES);
-	void sendUpdate(unsigned tick, unsigned short maxSeq);
+	void sendUpdate(unsigned tick, MclSeq maxSeq);
 	double sendLeave(unsigned retries = UDPCAST_JOIN_RETRIES);
 	void flushRecvWindow(bool update = false);
 	bool receiving() const { return m_state == Data; }
 
+	//! Odlaczony (przez serwer lub po braku keepAlive), mozna dolaczyc ponownie
+	bool idle() const { return m_state == Idle; }
+	bool acker() const { return m_acker; }
+
 private:
 	void gotJoinResponse(MclJoinResponsePacket& join, int size, const SockDesc& desc);
-	void gotData(MclDataPacket2& data, int size, const SockDesc& desc);
+	bool gotData(MclDataPacket2& data, int size, const SockDesc& desc, byte* buffer);
 	void gotKeepAlive(MclKeepAlivePacket& keepAlive, int size, const SockDesc& desc);
 	void gotLeaveResponse(MclLeaveResponsePacket& leave, int size, const SockDesc& desc);
+	void gotParity(MclParityPacket& parity, int size, const SockDesc& desc);
+	void gotAckers(MclAckersPacket& ackers, int size, const SockDesc& desc);
+
+	//! Czy odpowiadac na keepAlive
+	bool wantUpdate() const;
+
+	//! NAK po losowym opoznieniu, o ile braki nie zostana w tym czasie uzupelnione
+	void scheduleNak();
+	double sendNak(unsigned count);
+
+	//! Odtwarza brakujace pakiety grupy z pakietow naprawczych
+	void recoverGroup(MclSeq seq);
+
+	//! Czy pakiet m_seq moze byc oddany (reszta jego grupy FEC jest odebrana)
+	bool groupReady();
+
+	bool dispatchPacket(const SockData& data, byte* buffer);
+	void recvBatch();
+	void allocRecvSlab(unsigned window, unsigned maxSize);
 
 private:
 	void onSockRead(const SockData& data);
@@ -59,7 +141,10 @@ private:
 protected:
 	virtual void onJoinTimeout() { throw std::runtime_error("join timeout"); }
 	virtual void onJoin() { }
-	virtual bool onConsumeData(const string& data) = 0;
+	//! Dane wskazuja do bufora okna i sa wazne tylko w trakcie wywolania
+	virtual bool onConsumeData(const void* data, unsigned size) = 0;
 	virtual void onLeave() { }
 	virtual void onAliveTimeout() { }
+	//! Pominiete pakiety, ktorych serwer juz nie przechowuje
+	virtual void onSkip() { }
 };
@@ -0,0 +1,108 @@
+#include "../AsyncLib/AsyncLib.hpp"
+#include "UdpCastFec.hpp"
+
+// GF(256), wielomian x^8 + x^4 + x^3 + x^2 + 1
+struct UdpCastGf {
+	byte Exp[512];
+	byte Log[256];
+	byte Mul[256][256];
+
+	UdpCastGf() {
+		unsigned value = 1;
+		for(unsigned i = 0; i < 255; ++i) {
+			Exp[i] = Exp[i + 255] = value;
+			Log[value] = i;
+			value <<= 1;
+			if(value & 0x100)
+				value ^= 0x11d;
+		}
+		Exp[510] = Exp[511] = Exp[0];
+		Log[0] = 0;
+
+		for(unsigned a = 0; a < 256; ++a) {
+			for(unsigned b = 0; b < 256; ++b)
+				Mul[a][b] = a && b ? Exp[Log[a] + Log[b]] : 0;
+		}
+	}
+
+	byte inv(byte a) const {
+		return Exp[255 - Log[a]];
+	}
+};
+
+static const UdpCastGf Gf;
+
+byte UdpCastFec::coef(unsigned row, unsigned col) {
+	// wiersze i kolumny pochodza z rozlacznych zbiorow, wiec kazda podmacierz jest odwracalna
+	return Gf.inv(byte(row ^ (UDPCAST_FEC_MAX_PARITY + col)));
+}
+
+void UdpCastFec::mulAdd(byte* dst, const byte* src, byte c, unsigned size) {
+	if(c == 0)
+		return;
+
+	if(c == 1) {
+		for(unsigned i = 0; i < size; ++i)
+			dst[i] ^= src[i];
+		return;
+	}
+
+	const byte* mul = Gf.Mul[c];
+	for(unsigned i = 0; i < size; ++i)
+		dst[i] ^= mul[src[i]];
+}
+
+void UdpCastFec::addPacket(byte* parity, unsigned row, unsigned col, const void* data, unsigned size) {
+	byte c = coef(row, col);
+	byte header[HeaderSize] = { byte(size), byte(size >> 8) };
+
+	mulAdd(parity, header, c, HeaderSize);
+	mulAdd(parity + HeaderSize, (const byte*)data, c, size);
+}
+
+bool UdpCastFec::solve(unsigned count, const unsigned* rows, const unsigned* cols, byte** data, unsigned size) {
+	if(count > UDPCAST_FEC_MAX_PARITY)
+		return false;
+
+	byte matrix[UDPCAST_FEC_MAX_PARITY][UDPCAST_FEC_MAX_PARITY];
+	for(unsigned i = 0; i < count; ++i) {
+		for(unsigned j = 0; j < count; ++j)
+			matrix[i][j] = coef(rows[i], cols[j]);
+	}
+
+	// eliminacja Gaussa, te same operacje na wierszach danych
+	for(unsigned col = 0; col < count; ++col) {
+		unsigned pivot = col;
+		while(pivot < count && !matrix[pivot][col])
+			++pivot;
+		if(pivot == count)
+			return false;
+
+		if(pivot != col) {
+			for(unsigned j = 0; j < count; ++j)
+				std::swap(matrix[pivot][j], matrix[col][j]);
+			std::swap(data[pivot], data[col]);
+		}
+
+		// znormalizuj wiersz
+		byte scale = Gf.inv(matrix[col][col]);
+		if(scale != 1) {
+			for(unsigned j = 0; j < count; ++j)
+				matrix[col][j] = Gf.Mul[scale][matrix[col][j]];
+			const byte* mul = Gf.Mul[scale];
+			for(unsigned i = 0; i < size; ++i)
+				data[col][i] = mul[data[col][i]];
+		}
+
+		// wyzeruj kolumne w pozostalych wierszach
+		for(unsigned row = 0; row < count; ++row) {
+			byte factor = matrix[row][col];
+			if(row == col || !factor)
+				continue;
+			for(unsigned j = 0; j < count; ++j)
+				matrix[row][j] ^= Gf.Mul[factor][matrix[col][j]];
+			mulAdd(data[row], data[col], factor, size);
+		}
+	}
+	return true;
+}
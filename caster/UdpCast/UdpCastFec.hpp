@@ -0,0 +1,27 @@
+#pragma once
+
+//! Maksymalna ilosc pakietow naprawczych w grupie
+const unsigned UDPCAST_FEC_MAX_PARITY = 8;
+
+//! Maksymalna ilosc pakietow danych w grupie
+const unsigned UDPCAST_FEC_MAX_GROUP = 128;
+
+//! Kod Reeda-Solomona (macierz Cauchy'ego nad GF(256)) dla pakietow naprawczych.
+//! Pakiet danych jest kodowany razem ze swoja dlugoscia: <size:unsigned short> <data>
+class UdpCastFec {
+public:
+	static const unsigned HeaderSize = 2;
+
+public:
+	//! Wspolczynnik pakietu danych (col) w pakiecie naprawczym (row)
+	static byte coef(unsigned row, unsigned col);
+
+	//! dst += c * src
+	static void mulAdd(byte* dst, const byte* src, byte c, unsigned size);
+
+	//! Dodaje pakiet danych do pakietu naprawczego
+	static void addPacket(byte* parity, unsigned row, unsigned col, const void* data, unsigned size);
+
+	//! Rozwiazuje uklad dla syndromow wierszy rows; po powrocie data[i] wskazuje zakodowany pakiet cols[i]
+	static bool solve(unsigned count, const unsigned* rows, const unsigned* cols, byte** data, unsigned size);
+};
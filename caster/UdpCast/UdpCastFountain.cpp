@@ -0,0 +1,309 @@
+#include "../AsyncLib/AsyncLib.hpp"
+#include "../AsyncLib/ForEach.hpp"
+#include "UdpCastFountain.hpp"
+
+#include <math.h>
+
+// parametry odpornego rozkladu solitonowego
+static const double FOUNTAIN_C = 0.05;
+static const double FOUNTAIN_DELTA = 0.5;
+
+//! Miesza bity numeru symbolu (ten sam wynik u nadawcy i odbiorcy)
+static unsigned fountainHash(unsigned x) {
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+static unsigned fountainNext(unsigned& state) {
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+UdpCastFountain::UdpCastFountain(unsigned size, unsigned symbolSize) {
+	m_size = size;
+	m_symbolSize = max(symbolSize, 1U);
+	m_count = max((size + m_symbolSize - 1) / m_symbolSize, 1U);
+}
+
+void UdpCastFountain::buildDegrees() {
+	unsigned count = m_count;
+	double r = FOUNTAIN_C * log(count / FOUNTAIN_DELTA) * sqrt((double)count);
+	unsigned spike = r > 0 ? unsigned(count / r) : count;
+	spike = max(1U, min(spike, count));
+
+	m_degrees.resize(count + 1);
+	m_degrees[0] = 0;
+
+	double sum = 0;
+	for(unsigned d = 1; d <= count; ++d) {
+		// idealny rozklad solitonowy
+		double p = d == 1 ? 1.0 / count : 1.0 / (double(d) * (d - 1));
+
+		// dodatkowe symbole niskiego stopnia i szczyt przy count/r
+		if(d < spike)
+			p += r / (double(d) * count);
+		else if(d == spike)
+			p += r * log(r / FOUNTAIN_DELTA) / count;
+
+		sum += max(p, 0.0);
+		m_degrees[d] = sum;
+	}
+
+	for(unsigned d = 1; d <= count; ++d)
+		m_degrees[d] /= sum;
+}
+
+unsigned UdpCastFountain::degree(unsigned symbol) {
+	if(symbol < m_count || m_count == 1)
+		return 1;
+
+	// symbole o rozkladzie LT rzadko trafiaja w kilka brakujacych symboli
+	if((symbol - m_count) % UDPCAST_FOUNTAIN_DENSE_STEP == 0)
+		return min(m_count, UDPCAST_FOUNTAIN_DENSE_DEGREE);
+
+	if(m_degrees.empty())
+		buildDegrees();
+
+	double r = fountainHash(symbol ^ 0x5bd1e995) / 4294967296.0;
+	unsigned d = std::upper_bound(m_degrees.begin(), m_degrees.end(), r) - m_degrees.begin();
+	return max(1U, min(min(d, m_count), UDPCAST_FOUNTAIN_MAX_DEGREE));
+}
+
+void UdpCastFountain::neighbors(unsigned symbol, unsigned degree, vector<unsigned>& list) const {
+	list.resize(0);
+
+	if(symbol < m_count) {
+		list.push_back(symbol);
+		return;
+	}
+
+	degree = max(1U, min(degree, m_count));
+
+	// losuj do skutku, powtorzenia sa usuwane
+	unsigned state = fountainHash(symbol) | 1;
+	while(list.size() < degree) {
+		while(list.size() < degree)
+			list.push_back(fountainNext(state) % m_count);
+		std::sort(list.begin(), list.end());
+		list.erase(std::unique(list.begin(), list.end()), list.end());
+	}
+}
+
+void UdpCastFountain::encode(const byte* data, unsigned symbol, unsigned degree, byte* out) const {
+	vector<unsigned> list;
+	neighbors(symbol, degree, list);
+
+	memset(out, 0, m_symbolSize);
+
+	cFurEach(vector<unsigned>, index, list) {
+		unsigned offset = *index * m_symbolSize;
+		unsigned size = min(m_symbolSize, m_size - offset);
+		const byte* src = data + offset;
+		for(unsigned i = 0; i < size; ++i)
+			out[i] ^= src[i];
+	}
+}
+
+unsigned UdpCastFountain::checksum(const void* data, unsigned size) {
+	static unsigned table[256];
+	if(!table[1]) {
+		for(unsigned i = 0; i < 256; ++i) {
+			unsigned c = i;
+			for(unsigned j = 0; j < 8; ++j)
+				c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	}
+
+	unsigned crc = ~0U;
+	const byte* bytes = (const byte*)data;
+	for(unsigned i = 0; i < size; ++i)
+		crc = table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+UdpCastFountainDecoder::UdpCastFountainDecoder(unsigned size, unsigned symbolSize) : UdpCastFountain(size, symbolSize) {
+	m_data.resize(m_count * m_symbolSize);
+	m_known.resize(m_count);
+	m_refs.resize(m_count);
+	m_knownCount = 0;
+	m_active = 0;
+	m_received = 0;
+	m_solveAt = 0;
+}
+
+bool UdpCastFountainDecoder::addSymbol(unsigned symbol, unsigned degree, const byte* data) {
+	if(complete())
+		return true;
+
+	++m_received;
+
+	neighbors(symbol, degree, m_neighbors);
+
+	// odejmij znane symbole zrodlowe
+	string value((const char*)data, m_symbolSize);
+	unsigned unknown = 0;
+
+	for(unsigned i = 0; i < m_neighbors.size(); ++i) {
+		unsigned index = m_neighbors[i];
+		if(!m_known[index]) {
+			m_neighbors[unknown++] = index;
+			continue;
+		}
+
+		const byte* src = &m_data[index * m_symbolSize];
+		for(unsigned j = 0; j < m_symbolSize; ++j)
+			value[j] ^= src[j];
+	}
+
+	if(unknown == 1) {
+		recover(m_neighbors[0], (const byte*)value.c_str());
+	}
+	else if(unknown > 1) {
+		unsigned id = m_pending.size();
+		m_pending.push_back(Pending());
+		Pending& pending = m_pending.back();
+		pending.List.assign(m_neighbors.begin(), m_neighbors.begin() + unknown);
+		pending.Remaining = unknown;
+		pending.Data.swap(value);
+
+		for(unsigned i = 0; i < unknown; ++i)
+			m_refs[m_neighbors[i]].push_back(id);
+		++m_active;
+	}
+
+	// propagacja utknela na koncu, sprobuj rozwiazac uklad
+	unsigned missing = m_count - m_knownCount;
+	if(missing && missing <= UDPCAST_FOUNTAIN_MAX_SOLVE && m_active >= missing && m_received >= m_solveAt) {
+		if(!solve())
+			m_solveAt = m_received + max(2U, missing / 16);
+	}
+
+	return complete();
+}
+
+bool UdpCastFountainDecoder::solve() {
+	// nieznane symbole zrodlowe sa kolumnami ukladu
+	vector<unsigned> cols;
+	vector<unsigned> colIndex(m_count, ~0U);
+	for(unsigned i = 0; i < m_count; ++i) {
+		if(m_known[i])
+			continue;
+		colIndex[i] = cols.size();
+		cols.push_back(i);
+	}
+
+	unsigned words = (cols.size() + 31) / 32;
+	vector<unsigned> bits;
+	vector<string> rows;
+	rows.reserve(m_active);
+
+	cFurEach(PendingList, pending, m_pending) {
+		if(pending->Remaining == 0)
+			continue;
+
+		rows.push_back(pending->Data);
+		bits.resize(rows.size() * words);
+		unsigned* row = &bits[(rows.size() - 1) * words];
+
+		cFurEach(vector<unsigned>, index, pending->List) {
+			if(m_known[*index])
+				continue;
+			unsigned col = colIndex[*index];
+			row[col / 32] |= 1U << (col % 32);
+		}
+	}
+
+	// eliminacja Gaussa-Jordana, te same operacje na danych
+	for(unsigned col = 0; col < cols.size(); ++col) {
+		unsigned word = col / 32, mask = 1U << (col % 32);
+
+		unsigned pivot = col;
+		while(pivot < rows.size() && !(bits[pivot * words + word] & mask))
+			++pivot;
+		if(pivot == rows.size())
+			return false;
+
+		if(pivot != col) {
+			std::swap_ranges(&bits[pivot * words], &bits[pivot * words] + words, &bits[col * words]);
+			rows[pivot].swap(rows[col]);
+		}
+
+		const unsigned* src = &bits[col * words];
+		const string& data = rows[col];
+
+		for(unsigned row = 0; row < rows.size(); ++row) {
+			if(row == col || !(bits[row * words + word] & mask))
+				continue;
+			unsigned* dst = &bits[row * words];
+			for(unsigned j = 0; j < words; ++j)
+				dst[j] ^= src[j];
+			for(unsigned j = 0; j < m_symbolSize; ++j)
+				rows[row][j] ^= data[j];
+		}
+	}
+
+	// kazdy wiersz zawiera juz tylko swoj symbol zrodlowy
+	for(unsigned i = 0; i < cols.size(); ++i) {
+		memcpy(&m_data[cols[i] * m_symbolSize], rows[i].c_str(), m_symbolSize);
+		m_known[cols[i]] = true;
+	}
+	m_knownCount = m_count;
+
+	m_pending.clear();
+	m_refs.clear();
+	m_active = 0;
+	return true;
+}
+
+void UdpCastFountainDecoder::recover(unsigned index, const byte* data) {
+	vector<unsigned> stack;
+
+	memcpy(&m_data[index * m_symbolSize], data, m_symbolSize);
+	m_known[index] = true;
+	++m_knownCount;
+	stack.push_back(index);
+
+	while(stack.size()) {
+		unsigned known = stack.back();
+		stack.pop_back();
+
+		const byte* src = &m_data[known * m_symbolSize];
+		vector<unsigned> refs;
+		refs.swap(m_refs[known]);
+
+		cFurEach(vector<unsigned>, ref, refs) {
+			Pending& pending = m_pending[*ref];
+			if(pending.Remaining == 0)
+				continue;
+
+			for(unsigned j = 0; j < m_symbolSize; ++j)
+				pending.Data[j] ^= src[j];
+
+			if(--pending.Remaining != 1)
+				continue;
+
+			// symbol zawiera juz tylko jeden nieznany symbol zrodlowy
+			pending.Remaining = 0;
+			--m_active;
+
+			cFurEach(vector<unsigned>, next, pending.List) {
+				if(m_known[*next])
+					continue;
+				memcpy(&m_data[*next * m_symbolSize], pending.Data.c_str(), m_symbolSize);
+				m_known[*next] = true;
+				++m_knownCount;
+				stack.push_back(*next);
+				break;
+			}
+
+			string().swap(pending.Data);
+		}
+	}
+}
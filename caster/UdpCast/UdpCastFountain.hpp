@@ -0,0 +1,102 @@
+#pragma once
+
+//! Maksymalny stopien symbolu (zapisywany w pakiecie)
+const unsigned UDPCAST_FOUNTAIN_MAX_DEGREE = 65535;
+
+//! Maksymalna ilosc nieznanych symboli rozwiazywanych eliminacja Gaussa
+const unsigned UDPCAST_FOUNTAIN_MAX_SOLVE = 256;
+
+//! Co ktory symbol naprawczy ma duzy stopien (dla odbiorcow, ktorym brakuje niewielu symboli)
+const unsigned UDPCAST_FOUNTAIN_DENSE_STEP = 8;
+const unsigned UDPCAST_FOUNTAIN_DENSE_DEGREE = 64;
+
+//! Kod fontannowy LT (odporny rozklad solitonowy) dla obiektu podzielonego na symbole.
+//! Symbole o numerach mniejszych od ilosci symboli zrodlowych sa danymi wprost (kod systematyczny),
+//! kolejne sa sumami XOR losowo wybranych symboli zrodlowych (wybor zalezy tylko od numeru i stopnia).
+class UdpCastFountain {
+	// Fields
+protected:
+	unsigned m_size;
+	unsigned m_symbolSize;
+	unsigned m_count;
+
+	//! Dystrybuanta stopni symboli (liczona tylko u nadawcy)
+	vector<double> m_degrees;
+
+	// Constructor
+public:
+	UdpCastFountain(unsigned size, unsigned symbolSize);
+
+	// Helpers
+private:
+	void buildDegrees();
+
+	// Methods
+public:
+	unsigned size() const { return m_size; }
+	unsigned symbolSize() const { return m_symbolSize; }
+	unsigned count() const { return m_count; }
+
+	//! Losuje stopien symbolu (nadawca)
+	unsigned degree(unsigned symbol);
+
+	//! Symbole zrodlowe wchodzace w sklad symbolu (posortowane, bez powtorzen)
+	void neighbors(unsigned symbol, unsigned degree, vector<unsigned>& list) const;
+
+	//! Koduje symbol z danych obiektu
+	void encode(const byte* data, unsigned symbol, unsigned degree, byte* out) const;
+
+	//! Suma kontrolna danych obiektu
+	static unsigned checksum(const void* data, unsigned size);
+};
+
+//! Dekoder LT (propagacja symboli stopnia 1, koncowka eliminacja Gaussa nad GF(2))
+class UdpCastFountainDecoder : public UdpCastFountain {
+	//! Symbol, ktory zawiera jeszcze wiecej niz jeden nieznany symbol zrodlowy
+	struct Pending {
+		vector<unsigned> List;
+		unsigned Remaining;
+		string Data;
+	};
+
+	typedef deque<Pending> PendingList;
+
+	// Fields
+private:
+	vector<byte> m_data;
+	vector<bool> m_known;
+	unsigned m_knownCount;
+	PendingList m_pending;
+	unsigned m_active;
+
+	//! Symbole oczekujace na dany symbol zrodlowy
+	vector<vector<unsigned> > m_refs;
+
+	unsigned m_received;
+	vector<unsigned> m_neighbors;
+
+	//! Kolejna proba eliminacji Gaussa (ilosc odebranych symboli)
+	unsigned m_solveAt;
+
+	// Constructor
+public:
+	UdpCastFountainDecoder(unsigned size, unsigned symbolSize);
+
+	// Helpers
+private:
+	void recover(unsigned index, const byte* data);
+
+	//! Rozwiazuje pozostale symbole zrodlowe, gdy propagacja utknela
+	bool solve();
+
+	// Methods
+public:
+	//! Dodaje odebrany symbol, zwraca true gdy obiekt jest kompletny
+	bool addSymbol(unsigned symbol, unsigned degree, const byte* data);
+
+	bool complete() const { return m_knownCount == m_count; }
+	const byte* data() const { return m_data.empty() ? NULL : &m_data[0]; }
+
+	//! Ilosc odebranych symboli
+	unsigned received() const { return m_received; }
+};
@@ -12,24 +12,53 @@ enum MclType {
 	MclUpdate, // send by receiver
 	
 	MclLeave, // send by receiver
-	MclLeaveResponse // send by sender and receiver
+	MclLeaveResponse, // send by sender and receiver
+
+	MclParity, // send by sender
+
+	MclSymbol, // send by carousel sender
+
+	MclAckers // send by sender
 };
 
 const int MaxPacketSize = 60000;
 
+//! Wersja protokolu (wysylana w MclJoin)
+const unsigned short UDPCAST_VERSION = 3;
+
+//! Maksymalne okno wysylania i odbierania (pakiety)
+const unsigned UDPCAST_MAX_WINDOW = 8192;
+
+//! Maksymalna ilosc odbiorcow potwierdzajacych (sterujacych oknem)
+const unsigned UDPCAST_MAX_ACKERS = 16;
+
+//! Maksymalne losowe opoznienie NAK (pozostali odbiorcy moga w tym czasie dostac retransmisje)
+const float UDPCAST_NAK_DELAY = 0.005f;
+
+//! Maksymalna ilosc warstw karuzeli (kazda kolejna podwaja laczna predkosc)
+const unsigned UDPCAST_MAX_LAYERS = 8;
+
+//! Numer sekwencyjny (roznice liczone jako int)
+typedef unsigned MclSeq;
+
 struct MclPacket {
 	byte Type;
 };
 
 struct MclJoinPacket : MclPacket {
 	long long ID;
+	unsigned short Version;
+	unsigned Window; // ilosc pakietow, ktora odbiorca moze przechowac
 };
 
 struct MclJoinResponsePacket : MclPacket {
 	long long ID;
-	unsigned short Seq;
+	MclSeq Seq;
 	unsigned Tick; // minimalny oferowany numer sekwencyjny
 	bool Accept : 1;
+	unsigned Window; // uzgodnione okno (pakiety)
+	unsigned MaxSize; // maksymalny rozmiar danych w pakiecie
+	unsigned short FecGroup; // ilosc pakietow danych w grupie FEC (0 - wylaczone)
 };
 
 struct MclLeavePacket : MclPacket {
@@ -39,7 +68,7 @@ struct MclLeaveResponsePacket : MclPacket {
 };
 
 struct MclKeepAlivePacket : MclPacket {
-	unsigned short Seq, MaxSeq; // minimalny oferowany numer sekwencyjny, kolejny numer do wysania
+	MclSeq Seq, MaxSeq; // minimalny oferowany numer sekwencyjny, kolejny numer do wysania
 	unsigned Tick;
 };
 
@@ -52,12 +81,42 @@ struct MclDataPacket2 : MclDataPacket {
 };
 
 struct MclUpdatePacket : MclPacket {
-	unsigned short Seq, MaxSeq; // nastepny oczekiwany numer sekwencyjny, maksymalny widziany numer sekwencyjny
+	MclSeq Seq, MaxSeq; // nastepny oczekiwany numer sekwencyjny, maksymalny widziany numer sekwencyjny
 	unsigned Tick;
 	float Rate;
+	float Loss; // udzial pakietow utraconych przy pierwszym wyslaniu (przed FEC)
+	byte Lagging; // odbiorca czeka na retransmisje lub nie nadaza (serwer nie zwalnia jego pakietow)
+};
+
+//! Odbiorcy, ktorzy potwierdzaja kazdy keepAlive (pozostali wysylaja tylko NAK)
+struct MclAckersPacket : MclPacket {
+	byte Count;
+	long long ID[UDPCAST_MAX_ACKERS];
+};
+
+//! Pakiet naprawczy dla grupy FecGroup pakietow danych (od Seq)
+struct MclParityPacket : MclPacket {
+	MclSeq Seq; // pierwszy numer sekwencyjny w grupie
+	byte Count; // ilosc pakietow danych w grupie
+	byte Index; // wiersz kodu naprawczego
+	unsigned short Size; // dlugosc zakodowanych danych
+	byte Data[1];
+};
+
+//! Symbol kodu fontannowego obiektu (karuzela, odbiorcy nie wysylaja nic przez UDP)
+struct MclSymbolPacket : MclPacket {
+	unsigned Object; // identyfikator obiektu
+	unsigned Size; // rozmiar danych obiektu
+	unsigned Crc32; // suma kontrolna danych obiektu
+	unsigned Symbol; // numer symbolu (wyznacza symbole zrodlowe)
+	unsigned short Degree; // ilosc symboli zrodlowych w symbolu
+	unsigned short SymbolSize; // rozmiar symbolu
+	byte Layer; // warstwa (grupa multicast), w ktorej wyslano symbol
+	unsigned Seq; // kolejny numer pakietu w warstwie (pomiar strat u odbiorcy)
+	byte Data[1];
 };
 
 struct MclUpdatePacket2 : MclUpdatePacket {
-	byte Data[1400];
+	byte Data[UDPCAST_MAX_WINDOW / 8]; // mapa odebranych pakietow od Seq
 };
 #pragma pack()
@@ -4,6 +4,18 @@
 #include "UdpCastPacket.hpp"
 #include "UdpCastServer.hpp"
 
+#ifdef UDPCAST_SENDMMSG
+#include <sys/socket.h>
+#include <errno.h>
+#include <time.h>
+#include <linux/net_tstamp.h>
+
+// jadro wysyla pakiet o zadanym czasie (kolejka fq)
+#ifdef SO_TXTIME
+#define UDPCAST_TXTIME
+#endif
+#endif
+
 template<typename T>
 inline void unique_merge(set<T>& c1, const set<T>& c2) {
 	cFurEach(typename set<T>, c, c2) {
@@ -11,13 +23,49 @@ inline void unique_merge(set<T>& c1, const set<T>& c2) {
 	}
 }
 
-inline bool operator < (const SockDesc& a, const SockDesc& b) {
-	return memcmp(&a, &b, sizeof(SockDesc)) < 0;
+//! Klucz indeksu klientow (adres i port)
+inline unsigned long long clientKey(const SockDesc& desc) {
+	return (unsigned long long)desc.sin_addr.s_addr << 16 | desc.sin_port;
 }
 
 UdpCastServer::UdpCastServer() {
 	m_updateTime = timef();
 	MaxSize = 1400;
+	SendWindow = UDPCAST_MAX_WINDOW;
+	TargetRate = 0;
+	FecGroup = 0;
+	FecMaxParity = 4;
+	FecCount = FecParity = 0;
+	m_fecStride = m_fecRows = m_fecSize = m_fecCount = 0;
+	m_fecSeq = 0;
+	m_queueStride = 0;
+	m_batching = 0;
+	m_groupDescValid = false;
+	memset(&m_groupDesc, 0, sizeof(m_groupDesc));
+	m_batch.reserve(UDPCAST_MAX_SEND_BATCH);
+	BatchSend = false;
+	BatchCount = BatchPacketCount = MaxBatchSize = 0;
+	AckerCount = UDPCAST_DEFAULT_ACKERS;
+	SuppressedNakCount = 0;
+	LateNakCount = 0;
+	m_rttSum = 0;
+	m_rttCount = 0;
+	m_clientWindow = UDPCAST_MAX_WINDOW;
+	m_ackerTime = 0;
+	m_ackerCursor = 0;
+	m_ackedSeq = 0;
+	m_window = 0;
+	m_laggingCount = 0;
+	m_seq = m_maxSeq = 0;
+	m_queueOffset = 0;
+	m_keepAliveSeq = m_maxSeq - 1;
+	PaceRate = 0;
+	m_paceCredit = 0;
+	m_paceTime = timef();
+	m_paceWait = false;
+	m_txTime = 0;
+	m_txTimeState = 0;
+	BurstCount = BurstPacketCount = MaxBurstSize = 0;
 }
 
 UdpCastServer::~UdpCastServer() {
@@ -39,26 +87,31 @@ void UdpCastServer::sendKeepAliveAfter(unsigned time) {
 }
 
 void UdpCastServer::sendKeepAlive(bool resetKeepAliveTimeout, Client* client) {
+	// lista potwierdzajacych przed keepAlive, ktory maja potwierdzic
+	if(!client)
+		sendAckers();
+
+	// klienci pomijaja brakujace pakiety sprzed Seq, wiec zawsze najstarszy przechowywany
 	MclKeepAlivePacket packet;
 	packet.Type = MclKeepAlive;
 	packet.Seq = m_seq;
-	if(client && short(client->Seq - packet.Seq) > 0)
-		packet.Seq = client->Seq;
 	packet.MaxSeq = m_maxSeq;
 	packet.Tick = nanotime();
-	sendAllData(&packet, sizeof(packet), client ? &client->Sock : NULL);
+	queueDatagram(&packet, sizeof(packet), client ? &client->Sock : NULL, true);
 	
 	vdebugp(6, "udpserver", "sending keepAlive [seq=%i, maxSeq=%i, to=%s]", m_seq, m_maxSeq, client ? va(client->Sock).c_str() : NULL);
 	
 	if(!client) {
 		sendKeepAliveAfter(RTT * 3);
 	
-		FurEach(ClientList, client, m_clientList) {
-			client->second.KeepAliveTime = timef();
+		// odpowiadaja tylko potwierdzajacy i klienci z brakami
+		FurEach(AckerList, acker, m_ackers) {
+			Client& other = m_clientList[*acker];
+			other.KeepAliveTime = timef();
 			if(resetKeepAliveTimeout)
-				client->second.KeepAliveTimeout = 0;
+				other.KeepAliveTimeout = 0;
 			else
-				++client->second.KeepAliveTimeout;
+				++other.KeepAliveTimeout;
 		}
 	}
 	else {
@@ -74,43 +127,53 @@ void UdpCastServer::sendKeepAlive(bool resetKeepAliveTimeout, Client* client) {
 	m_updateTime = timef();
 }
 
-void UdpCastServer::sendSeqData(unsigned short seq, bool sendKeepAlive) {
-	short index = seq - m_seq;
-	if(index < 0 || index >= UDPCAST_MAX_SEND_WINDOW)
+void UdpCastServer::sendSeqData(MclSeq seq, bool sendKeepAlive) {
+	int index = int(seq - m_seq);
+	if(index < 0 || index >= (int)m_queue.size())
 		throw runtime_error("seq not within send window");
 
 	vdebugp(7, "udpserver", "sending data [seq=%i]", seq);
 		
-	unsigned offset = (index + m_queueOffset) % UDPCAST_MAX_SEND_WINDOW;
+	unsigned offset = (index + m_queueOffset) % m_queue.size();
 		
-	if(!m_queue[offset].get())
+	if(!m_queue[offset].Valid)
 		throw runtime_error("seq doesn't exist");
 		
-	const string& content = *m_queue[offset];
+	unsigned size = m_queue[offset].Size;
 
 	if(sendKeepAlive) {
 		sendKeepAliveAfter(RTT * 3);
 	
-		FurEach(ClientList, client, m_clientList) {
-			client->second.KeepAliveTime = timef();
-			client->second.KeepAliveTimeout = 0;
+		FurEach(AckerList, acker, m_ackers) {
+			m_clientList[*acker].KeepAliveTime = timef();
+			m_clientList[*acker].KeepAliveTimeout = 0;
 		}
 		//++KeepAliveCount;
 	}
 	
-	if(short(seq - m_maxSeq) >= 0)
-		m_maxSeq = seq+1;
+	// naglowek jest wypelniany w miejscu, dane leza juz za nim
+	MclDataPacket& packet = *queuePacket(offset);
 
-	MclDataPacket2 packet;
+	bool firstSend = int(seq - m_maxSeq) >= 0;
+	if(firstSend) {
+		m_maxSeq = seq+1;
+		m_queue[offset].SendTime = timef();
+	}
+	else {
+		m_queue[offset].RepairTime = timef();
+	}
 	packet.Type = MclData;
 	packet.Seq = seq;
 	packet.MaxSeq = m_maxSeq;
 	packet.KeepAlive = sendKeepAlive;
 	packet.Tick = nanotime();
-	memcpy(packet.Data, &content[0], content.size());
-	sendAllData(&packet, sizeof(MclDataPacket) + content.size());
+	queueDatagram(&packet, sizeof(MclDataPacket) + size);
 	m_nakList.erase(seq);
-	SendLength += content.size();
+
+	// retransmisje nie wchodza do grup FEC
+	if(firstSend)
+		fecAddPacket(seq, &packet + 1, size);
+	SendLength += size;
 	++SendCount;
 
 	m_updateTime = timef();
@@ -119,15 +182,15 @@ void UdpCastServer::sendSeqData(unsigned short seq, bool sendKeepAlive) {
 unsigned UdpCastServer::disconnect(const SockDesc& desc) {
 	unsigned count = 0;
 
-	FurEach(ClientList, client, m_clientList) {
-		if(client->first.sin_addr.s_addr != desc.sin_addr.s_addr)
-			continue;
-
-		SockDesc clientDesc(client->first);
-		m_clientList.erase(client);
-		sendLeave(&clientDesc);
-		onLeave(clientDesc);
-		++count;
+	// usuwany klient jest zastepowany ostatnim, juz sprawdzonym
+	for(unsigned index = m_clientList.size(); index-- > 0; ) {
+		if(m_clientList[index].Sock.sin_addr.s_addr == desc.sin_addr.s_addr) {
+			SockDesc clientDesc(m_clientList[index].Sock);
+			removeClient(index);
+			sendLeave(&clientDesc);
+			onLeave(clientDesc);
+			++count;
+		}
 	}
 
 	return count;
@@ -139,76 +202,218 @@ void UdpCastServer::sendLeave(const SockDesc* desc) {
 	sendAllData(&packet, sizeof(packet), desc);
 }
 
-unsigned UdpCastServer::windowSize() const {
-	float size = 0;
-	cFurEach(ClientList, client, m_clientList) {
-		size = max(client->second.Window, size);
+void UdpCastServer::updateRTT() {
+	// suma jest uaktualniana przy kazdej zmianie RTT klienta
+	if(m_rttCount) {
+		RTT = unsigned(m_rttSum / m_rttCount);
+	}
+	else {
+		RTT = 500*1000;
 	}
-	//size = floorf(size/2 + 0.5f) * 2;
-	return (unsigned)size;
 }
 
-void UdpCastServer::updateRTT() {
-	RTT = 0;
-	unsigned count = 0;
-	
-	cFurEach(ClientList, client, m_clientList) {
-		if(client->second.RTT) {
-			RTT += client->second.RTT;
-			++count;
-		}
+void UdpCastServer::setClientRTT(Client& client, unsigned rtt) {
+	if(client.RTT) {
+		m_rttSum -= client.RTT;
+		--m_rttCount;
 	}
-	
-	if(count) {
-		RTT /= count;
+
+	client.RTT = rtt;
+
+	if(client.RTT) {
+		m_rttSum += client.RTT;
+		++m_rttCount;
 	}
-	else {
-		RTT = 500*1000;
+}
+
+void UdpCastServer::indexClient(Client& client) {
+	bool track = client.Acker || client.Lagging;
+
+	if(client.Indexed) {
+		if(track && client.IndexSeq == client.Seq)
+			return;
+		m_seqIndex.erase(m_seqIndex.find(client.IndexSeq));
+		client.Indexed = false;
+	}
+
+	if(track) {
+		m_seqIndex.insert(client.Seq);
+		client.IndexSeq = client.Seq;
+		client.Indexed = true;
 	}
 }
 
+void UdpCastServer::setLagging(Client& client, bool lagging) {
+	if(client.Lagging == lagging)
+		return;
+
+	client.Lagging = lagging;
+	if(lagging)
+		++m_laggingCount;
+	else
+		--m_laggingCount;
+}
+
+UdpCastServer::Client* UdpCastServer::findClient(const SockDesc& desc) {
+	ClientIndex::iterator itor = m_clientIndex.find(clientKey(desc));
+	if(itor == m_clientIndex.end())
+		return NULL;
+	return &m_clientList[itor->second];
+}
+
+void UdpCastServer::removeClient(unsigned index) {
+	Client& client = m_clientList[index];
+	bool acker = client.Acker;
+
+	setClientRTT(client, 0);
+	setLagging(client, false);
+	client.Acker = false;
+	indexClient(client);
+	m_ackers.erase(std::remove(m_ackers.begin(), m_ackers.end(), index), m_ackers.end());
+	m_clientIndex.erase(clientKey(client.Sock));
+
+	// ostatni klient zajmuje zwolnione miejsce
+	unsigned last = m_clientList.size() - 1;
+	if(index != last) {
+		client = m_clientList[last];
+		m_clientIndex[clientKey(client.Sock)] = index;
+		std::replace(m_ackers.begin(), m_ackers.end(), last, index);
+	}
+	m_clientList.pop_back();
+
+	m_clientWindow = UDPCAST_MAX_WINDOW;
+	cFurEach(ClientList, other, m_clientList) {
+		m_clientWindow = min(m_clientWindow, other->MaxWindow);
+	}
+
+	updateRTT();
+
+	if(acker)
+		rotateAckers();
+}
+
+void UdpCastServer::updateAckers() {
+	m_window = 0;
+
+	for(unsigned i = 0; i < m_ackers.size(); ++i) {
+		const Client& client = m_clientList[m_ackers[i]];
+		if(i == 0 || int(client.Seq - m_ackedSeq) < 0)
+			m_ackedSeq = client.Seq;
+		m_window = max(m_window, client.Window);
+	}
+}
+
+void UdpCastServer::rotateAckers() {
+	float window = m_window;
+
+	FurEach(AckerList, acker, m_ackers) {
+		m_clientList[*acker].Acker = false;
+		indexClient(m_clientList[*acker]);
+	}
+	m_ackers.clear();
+	m_ackerTime = timef();
+
+	if(m_clientList.empty()) {
+		updateAckers();
+		return;
+	}
+
+	unsigned count = max(1U, min(min(AckerCount, UDPCAST_MAX_ACKERS), (unsigned)m_clientList.size()));
+
+	// najwolniejszy odbiorca potwierdza zawsze, pozostali na zmiane
+	unsigned slowest = 0;
+	float loss = 0;
+
+	for(unsigned index = 0; index < m_clientList.size(); ++index) {
+		if(m_clientList[index].RTT > m_clientList[slowest].RTT)
+			slowest = index;
+		loss = max(loss, m_clientList[index].Loss);
+	}
+
+	// nadmiarowosc dobierana do najslabszego odbiorcy (miedzy zmianami tylko rosnie)
+	FecParity = fecParity(loss);
+
+	m_ackers.push_back(slowest);
+
+	while(m_ackers.size() < count) {
+		m_ackerCursor = (m_ackerCursor + 1) % m_clientList.size();
+		if(m_ackerCursor != slowest)
+			m_ackers.push_back(m_ackerCursor);
+	}
+
+	FurEach(AckerList, acker, m_ackers) {
+		Client& client = m_clientList[*acker];
+		client.Acker = true;
+
+		// stan klienta mogl sie zestarzec, gdy nie potwierdzal
+		if(int(client.Seq - m_seq) < 0) {
+			client.Seq = m_seq;
+			client.WinSeq = m_seq;
+		}
+		client.Window = max(client.Window, window);
+		indexClient(client);
+	}
+
+	updateAckers();
+
+	vdebugp(5, "udpserver", "rotating ackers [count=%i, clients=%i]", m_ackers.size(), m_clientList.size());
+
+	sendAckers();
+}
+
+void UdpCastServer::sendAckers() {
+	MclAckersPacket packet;
+	packet.Type = MclAckers;
+	packet.Count = m_ackers.size();
+	for(unsigned i = 0; i < m_ackers.size(); ++i)
+		packet.ID[i] = m_clientList[m_ackers[i]].ID;
+	queueDatagram(&packet, sizeof(MclAckersPacket) - sizeof(packet.ID) + packet.Count * sizeof(packet.ID[0]), NULL, true);
+}
+
 void UdpCastServer::gotUpdate(MclUpdatePacket2& update, int size, const SockDesc& desc) {
 	++UpdateCount;
 	
-	if(m_clientList.find(desc) == m_clientList.end())
+	Client* found = findClient(desc);
+	if(!found) {
+		// klient usuniety po timeout nie wie o tym, moze dolaczyc ponownie
+		sendLeave(&desc);
+		return;
+	}
+
+	if(size < (int)sizeof(MclUpdatePacket))
 		return;
 	
 	m_updateTime = timef();
 
-	Client& client = m_clientList[desc];
+	Client& client = *found;
 	client.KeepAliveTimeout = 0;
 	client.UpdateTime = timef();
 	client.Rate = update.Rate;
+	client.Loss = update.Loss;
 
-	vdebugp(6, "udpserver", "got update from %s [s=%i,ms=%i] [s=%i/%i,ms=%i]", 
-		va(desc).c_str(), update.Seq, update.MaxSeq,
+	vdebugp(6, "udpserver", "got update from %s [s=%i,ms=%i,l=%i] [s=%i/%i,ms=%i]", 
+		va(desc).c_str(), update.Seq, update.MaxSeq, update.Lagging,
 		client.Seq, m_seq, m_maxSeq);
 
-	if(short(update.Seq - m_seq) < 0) {
+	if(int(update.Seq - m_seq) < 0) {
 		return;
 	}
 
-	unsigned confirmCount = 1;
-
-	client.NakList.clear();
+	setLagging(client, update.Lagging != 0);
 
 	if(update.Seq == client.Seq)
 		++client.LostCount;
-	else {
-		while(short(update.Seq - client.Seq) > 0) {
-			client.NakList.erase(client.Seq);
-			++client.Seq;
-			client.LostCount = 0;
-			++confirmCount;
-		}
+	else if(int(update.Seq - client.Seq) > 0) {
+		client.Seq = update.Seq;
+		client.LostCount = 0;
 	}
 	
 	if(update.Tick > 0) {
 		int rtt = int(nanotime() - update.Tick);
 		if(rtt > 0) {
 			rtt = min(max((unsigned)rtt, 100U), 3000000U);
-			client.RTT = unsigned(client.RTT * 0.9 + rtt * 0.1);
-			unsigned maxWindowSize = 1000 * 1000 / client.RTT;
+			setClientRTT(client, unsigned(client.RTT * 0.9 + rtt * 0.1));
+			unsigned maxWindowSize = windowLimit(client);
 			if(client.Window > maxWindowSize) {
 				client.Window /= 2;
 				client.Window = max(client.Window, 1.0f);
@@ -220,25 +425,43 @@ void UdpCastServer::gotUpdate(MclUpdatePacket2& update, int size, const SockDesc
 
 	unsigned lostCount = 0;
 
-	short seqCount = update.MaxSeq - update.Seq;
+	int seqCount = min<int>(int(update.MaxSeq - update.Seq), UDPCAST_MAX_WINDOW);
+
+	// retransmisja wyslana w ostatnim RTT jest jeszcze w drodze do odbiorcy
+	double repairTime = timef() - RTT / 1000000.0;
 
-	for(short index = 0; index < seqCount; ++index) {
-		if(short(update.Seq + index - m_maxSeq) >= 0)
+	for(int index = 0; index < seqCount; ++index) {
+		MclSeq seq = update.Seq + index;
+		if(int(seq - m_maxSeq) >= 0)
 			break;
-		if(index >= dataCount || ~update.Data[index >> 3] & (1<<(index&7))) {
-			client.NakList.insert(update.Seq + index);
-			++lostCount;
+		if(index < dataCount && update.Data[index >> 3] & (1<<(index&7)))
+			continue;
+
+		++lostCount;
+
+		// pakiet juz zwolniony, odbiorca go pominie
+		if(int(seq - m_seq) < 0) {
+			++LateNakCount;
+			continue;
+		}
+
+		const QueueEntry& entry = m_queue[(int(seq - m_seq) + m_queueOffset) % m_queue.size()];
+		if(entry.RepairTime > repairTime) {
+			++SuppressedNakCount;
+			continue;
 		}
+		m_nakList.insert(seq);
 	}
 
-	if(short(client.Seq - client.WinSeq) >= 0) {
+	// okno ustalaja tylko potwierdzajacy
+	if(client.Acker && int(client.Seq - client.WinSeq) >= 0) {
 		if(client.LostCount >= 3) {
 			client.Window /= 2;
 			client.Window = max(client.Window, 2.0f);
 			client.LostCount = 0;
 
-			unsigned short newWinSeq = client.Seq + (unsigned)client.Window;
-			if(short(newWinSeq - client.WinSeq) > 0)
+			MclSeq newWinSeq = client.Seq + (unsigned)client.Window;
+			if(int(newWinSeq - client.WinSeq) > 0)
 				client.WinSeq = newWinSeq;
 		}
 		else if(lostCount > 3) {
@@ -249,7 +472,7 @@ void UdpCastServer::gotUpdate(MclUpdatePacket2& update, int size, const SockDesc
 		}
 		else if(client.Window > 0) {
 			client.Window += 1/client.Window;
-			client.Window = min<float>(client.Window, (float)UDPCAST_MAX_SEND_WINDOW);
+			client.Window = min<float>(client.Window, (float)client.MaxWindow);
 			client.WinSeq = client.Seq;
 		}
 		else {
@@ -260,25 +483,56 @@ void UdpCastServer::gotUpdate(MclUpdatePacket2& update, int size, const SockDesc
 	
 	client.NextKeepAliveTime = timef() + RTT * 10;
 
+	indexClient(client);
 	updateRTT();
-	
-	m_update = true;
+
+	if(client.Acker)
+		updateAckers();
+
+	// nadmiarowosc rosnie od razu, maleje przy zmianie potwierdzajacych
+	FecParity = max(FecParity, fecParity(client.Loss));
+
+	// potwierdzenie moglo otworzyc okno, gdy pacer nie ma jeszcze kredytu
+	if(!paceReady())
+		paceWakeup();
 }
 
 void UdpCastServer::gotJoin(MclJoinPacket& update, int size, const SockDesc& desc) {
-	if(m_clientList.find(desc) == m_clientList.end()) {
+	// starsi klienci nie uzgadniaja okna, odmowa wraca tylko do nadawcy
+	if(size < (int)sizeof(MclJoinPacket) || update.Version < UDPCAST_VERSION) {
+		if(m_refusedList.insert(clientKey(desc)).second)
+			infof("Refused multicast join from %s, protocol version too old", va(desc).c_str());
+
+		MclLeaveResponsePacket response;
+		response.Type = MclLeaveResponse;
+		sendAllData(&response, sizeof(response), &desc);
+		return;
+	}
+
+	Client* found = findClient(desc);
+	if(!found) {
 		if(!onJoin(desc))
 			return;
+
+		m_clientIndex[clientKey(desc)] = m_clientList.size();
+		m_clientList.push_back(Client());
+		found = &m_clientList.back();
 	}
 	
 	vdebugp(4, "udpserver", "got join");
 
-	Client& client = m_clientList[desc];
+	Client& client = *found;
 	client.Seq = m_seq;
 	client.WinSeq = m_seq;
 	client.Sock = desc;
 	client.UpdateTime = timef();
 	client.ID = update.ID;
+	indexClient(client);
+
+	// okno nie moze przekroczyc bufora odbiorcy ani kolejki wysylania
+	allocQueue();
+	client.MaxWindow = max(2U, min<unsigned>(update.Window, m_queue.size()));
+	m_clientWindow = min(m_clientWindow, client.MaxWindow);
 
 	MclJoinResponsePacket response;
 	response.Type = MclJoinResponse;
@@ -286,31 +540,40 @@ void UdpCastServer::gotJoin(MclJoinPacket& update, int size, const SockDesc& des
 	response.Seq = m_seq;
 	response.Accept = 1;
 	response.ID = update.ID;
+	response.Window = client.MaxWindow;
+	response.MaxSize = m_queueStride - sizeof(MclDataPacket);
+	response.FecGroup = FecGroup;
 	sendAllData(&response, sizeof(response)); // send to all using multicast!
 
+	// pierwsi klienci od razu potwierdzaja
+	if(!client.Acker && m_ackers.size() < min(AckerCount, UDPCAST_MAX_ACKERS))
+		rotateAckers();
+
 	m_updateTime = timef();
 }
 
 void UdpCastServer::gotJoinResponse(MclJoinResponsePacket& update, int size, const SockDesc& desc) {
-	if(m_clientList.find(desc) == m_clientList.end())
+	Client* client = findClient(desc);
+	if(!client)
 		return;
 		
 	vdebugp(4, "udpserver", "got joinResponse");
 		
-	Client& client = m_clientList[desc];
-	client.RTT = nanotime() - update.Tick;
-	client.UpdateTime = timef();
+	setClientRTT(*client, nanotime() - update.Tick);
+	client->UpdateTime = timef();
+	updateRTT();
 }
 
 void UdpCastServer::gotLeave(MclLeavePacket& update, int size, const SockDesc& desc) {
-	if(m_clientList.find(desc) == m_clientList.end())
+	ClientIndex::iterator itor = m_clientIndex.find(clientKey(desc));
+	if(itor == m_clientIndex.end())
 		return;
 		
 	vdebugp(4, "udpserver", "got leave");
 
 	onLeave(desc);
 	
-	m_clientList.erase(desc);
+	removeClient(itor->second);
 	MclLeaveResponsePacket response;
 	response.Type = MclLeaveResponse;
 	sendAllData(&response, sizeof(response), &desc);
@@ -341,53 +604,273 @@ void UdpCastServer::onSockRead(const SockData& data) {
 }
 
 void UdpCastServer::onSockWrite() {
-	bool keepAlive = false;
+	unsigned burst = 0;
+
+	// zbieraj datagramy i wysylaj je paczkami
+	++m_batching;
+
+	paceRefill();
+	allocQueue();
+
+	if(m_clientList.empty())
+		m_nakList.clear();
+
+	// retransmisje nie wymagaja potwierdzen od wszystkich odbiorcow, ale zuzywaja kredyt pacera
+	while(m_nakList.size()) {
+		MclSeq seq = *m_nakList.begin();
+		if(!paceSend(m_queueStride))
+			break;
+		sendSeqData(seq);
+		++NakCount;
+		++burst;
+	}
+
+	// okno przesuwa sie z potwierdzeniami, potwierdzenie co pol okna utrzymuje je otwarte
+	unsigned half = max(windowSize() / 2, 1U);
+	unsigned limit = queueLimit();
+	bool stalled = false;
 
-	if(m_nakList.size()) {
-		if(m_clientList.empty()) {
-			m_nakList.clear();
+	while(m_nakList.empty() && windowOpen()) {
+		unsigned index = m_maxSeq - m_seq;
+		if(index >= limit) {
+			stalled = true;
+			break;
 		}
-		else {
-			cFurEach(set<unsigned short>, seq, m_nakList) {
-				sendSeqData(*seq, true);
-				++NakCount;
+
+		unsigned offset = (index + m_queueOffset) % m_queue.size();
+		QueueEntry& entry = m_queue[offset];
+		
+		if(!entry.Valid) {
+			entry.Size = 0;
+			if(!onGetData(queuePacket(offset) + 1, entry.Size, m_queueStride - sizeof(MclDataPacket))) {
+				stalled = true;
+				break;
 			}
+			entry.Valid = true;
+			ContentLength += entry.Size;
 		}
+
+		// pobrany pakiet czeka w kolejce na kredyt
+		if(!paceSend(m_queueStride))
+			break;
+
+		bool keepAlive = int(m_maxSeq - m_keepAliveSeq) >= (int)half;
+		if(keepAlive)
+			m_keepAliveSeq = m_maxSeq;
+
+		sendSeqData(m_maxSeq, keepAlive);
+		++burst;
 	}
 
-	if(!allDataAccepted())
+	// potwierdzajacy musza potwierdzic niepelne okno
+	if(stalled && int(m_maxSeq - 1 - m_keepAliveSeq) > 0) {
+		m_keepAliveSeq = m_maxSeq - 1;
+		sendKeepAlive(true);
+	}
+
+	if(burst) {
+		++BurstCount;
+		BurstPacketCount += burst;
+		MaxBurstSize = max(MaxBurstSize, burst);
+	}
+
+	--m_batching;
+	flushBatch();
+}
+
+double UdpCastServer::paceRate() const {
+	if(PaceRate > 0)
+		return (double)PaceRate;
+
+	// okno rozlozone na RTT, z zapasem na wzrost okna
+	if(!RTT || !m_queueStride)
+		return 0;
+	return UDPCAST_PACE_GAIN * 1000000.0 * windowSize() * m_queueStride / RTT;
+}
+
+void UdpCastServer::paceRefill() {
+	double currentTime = timef();
+	double rate = paceRate();
+
+	// przerwa w wysylaniu nie daje prawa do dlugiej serii
+	double burst = max(rate * UDPCAST_PACE_QUANTUM, 2.0 * m_queueStride);
+	m_paceCredit = min(m_paceCredit + (currentTime - m_paceTime) * rate, burst);
+	m_paceTime = currentTime;
+}
+
+bool UdpCastServer::paceReady() const {
+	double rate = paceRate();
+	if(rate <= 0)
+		return true;
+	return m_paceCredit + (timef() - m_paceTime) * rate >= m_queueStride;
+}
+
+bool UdpCastServer::paceSend(unsigned size) {
+	if(paceRate() <= 0)
+		return true;
+
+	if(m_paceCredit < size) {
+		paceWakeup();
+		return false;
+	}
+
+	m_paceCredit -= size;
+	return true;
+}
+
+void UdpCastServer::paceWakeup() {
+	double rate = paceRate();
+	if(m_paceWait || rate <= 0)
 		return;
 
-	unsigned window = windowSize();
+	double wait = (m_queueStride - m_paceCredit) / rate - (timef() - m_paceTime);
 
-	for(unsigned i = 0; i < window; ++i) {
-		unsigned offset = (i + m_queueOffset) % UDPCAST_MAX_SEND_WINDOW;
-		
-		if(!m_queue[offset].get()) {
-			string data;
-			if(!onGetData(data, min<unsigned>(MaxSize, MaxPacketSize)))
-				break;
-			m_queue[offset].reset(new string(data));
-			ContentLength += data.size();
-		}
+	m_paceWait = true;
+	Timer::after(TimerDelegate(this, &UdpCastServer::resumeSend), max(wait, 0.0), 1);
+}
 
-		if(short(m_seq + i - m_maxSeq) < 0)
-			continue;
+double UdpCastServer::resumeSend(unsigned count) {
+	m_paceWait = false;
+	if(waitForWrite())
+		onSockWrite();
+	return -1;
+}
+
+void UdpCastServer::queueDatagram(const void* data, unsigned size, const SockDesc* desc, bool copy) {
+	BatchEntry entry;
+	entry.Data = copy ? NULL : data;
+	entry.Offset = m_batchControl.size();
+	entry.Size = size;
+	entry.HasDesc = desc != NULL;
+	if(desc)
+		entry.Desc = *desc;
+
+	// male pakiety kontrolne sa kopiowane, dane leza w oknie wysylania
+	if(copy)
+		m_batchControl.append((const char*)data, size);
+	m_batch.push_back(entry);
+
+	if(!m_batching || m_batch.size() >= UDPCAST_MAX_SEND_BATCH)
+		flushBatch();
+}
+
+void UdpCastServer::flushBatch() {
+	if(m_batch.empty())
+		return;
+
+	unsigned sent = 0;
 
-		if(i == window / 2) {
-			keepAlive = true;
+#ifdef UDPCAST_SENDMMSG
+	if(BatchSend && m_groupDescValid) {
+		mmsghdr msgs[UDPCAST_MAX_SEND_BATCH];
+		iovec iovs[UDPCAST_MAX_SEND_BATCH];
+		unsigned count = min<unsigned>(m_batch.size(), UDPCAST_MAX_SEND_BATCH);
+		long long bytes = 0;
+
+#ifdef UDPCAST_TXTIME
+		char controls[UDPCAST_MAX_SEND_BATCH][CMSG_SPACE(sizeof(__u64))];
+		double rate = paceRate();
+		bool txTime = rate > 0 && enableTxTime();
+#endif
+
+		for(unsigned i = 0; i < count; ++i) {
+			BatchEntry& entry = m_batch[i];
+			iovs[i].iov_base = entry.Data ? (void*)entry.Data : (void*)&m_batchControl[entry.Offset];
+			iovs[i].iov_len = entry.Size;
+			memset(&msgs[i], 0, sizeof(msgs[i]));
+			msgs[i].msg_hdr.msg_name = entry.HasDesc ? &entry.Desc : &m_groupDesc;
+			msgs[i].msg_hdr.msg_namelen = sizeof(SockDesc);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+
+#ifdef UDPCAST_TXTIME
+			// pacer wysyla serie, jadro rozklada je rowno w czasie
+			if(txTime) {
+				msgs[i].msg_hdr.msg_control = controls[i];
+				msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+				cmsghdr* cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+				cmsg->cmsg_level = SOL_SOCKET;
+				cmsg->cmsg_type = SCM_TXTIME;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(__u64));
+				*(__u64*)CMSG_DATA(cmsg) = nextTxTime(entry.Size, rate);
+			}
+#endif
 		}
-		else if(i+1 == window) {
-			keepAlive = true;
+
+		while(sent < count) {
+			int result = sendmmsg(fd(), msgs + sent, count - sent, 0);
+			if(result < 0) {
+				if(errno == EINTR)
+					continue;
+#ifdef UDPCAST_TXTIME
+				// kolejka nie przyjmuje czasu wyslania
+				if(txTime && errno == EINVAL)
+					m_txTimeState = -1;
+#endif
+				// reszta pojdzie zwyklym sendAllData
+				break;
+			}
+
+			for(int i = 0; i < result; ++i)
+				bytes += m_batch[sent + i].Size;
+			sent += result;
 		}
 
-		sendSeqData(m_seq + i, keepAlive);
-		keepAlive = false;
+		BatchRate.addBytes(bytes);
+		BatchRate.manualUpdate();
 	}
+#endif
 
-	if(keepAlive) {
-		sendKeepAlive(true);
+	for(unsigned i = sent; i < m_batch.size(); ++i) {
+		const BatchEntry& entry = m_batch[i];
+		sendAllData(entry.Data ? entry.Data : &m_batchControl[entry.Offset], entry.Size, entry.HasDesc ? &entry.Desc : NULL);
 	}
+
+	++BatchCount;
+	BatchPacketCount += m_batch.size();
+	MaxBatchSize = max<unsigned>(MaxBatchSize, m_batch.size());
+
+	m_batch.resize(0);
+	m_batchControl.resize(0);
+}
+
+#ifdef UDPCAST_TXTIME
+bool UdpCastServer::enableTxTime() {
+	if(m_txTimeState == 0) {
+		sock_txtime config;
+		memset(&config, 0, sizeof(config));
+		config.clockid = CLOCK_MONOTONIC;
+		m_txTimeState = setsockopt(fd(), SOL_SOCKET, SO_TXTIME, &config, sizeof(config)) == 0 ? 1 : -1;
+
+		vdebugp(4, "udpserver", "SO_TXTIME %s", m_txTimeState > 0 ? "enabled" : "not supported");
+	}
+	return m_txTimeState > 0;
+}
+
+long long UdpCastServer::nextTxTime(unsigned size, double rate) {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	long long currentTime = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+	// po przerwie kolejny pakiet idzie od razu
+	if(m_txTime < currentTime)
+		m_txTime = currentTime;
+
+	long long txTime = m_txTime;
+	m_txTime += (long long)(size * 1000000000.0 / rate);
+	return txTime;
+}
+#endif
+
+void UdpCastServer::setGroupAddress(unsigned port, const string& address) {
+	setSendAddress(port, address);
+
+	// adres dla datagramow wysylanych paczkami
+	memset(&m_groupDesc, 0, sizeof(m_groupDesc));
+	m_groupDesc.sin_family = AF_INET;
+	m_groupDesc.sin_port = htons(port);
+	m_groupDesc.sin_addr.s_addr = inet_addr(address.c_str());
+	m_groupDescValid = m_groupDesc.sin_addr.s_addr != INADDR_NONE;
 }
 
 double sqr(double v) {
@@ -395,58 +878,39 @@ double sqr(double v) {
 }
 
 void UdpCastServer::onFdTick() {
-	vdebugp(8, "udpserver", "fdTick [seq=%i, maxSeq=%i, nakList=%i, update=%i]", m_seq, m_maxSeq, m_nakList.size(), m_update);
+	vdebugp(8, "udpserver", "fdTick [seq=%i, maxSeq=%i, nakList=%i, index=%i]", m_seq, m_maxSeq, m_nakList.size(), m_seqIndex.size());
 	
-	if(m_update) {
-		m_nakList.clear();
-
-		if(m_clientList.size()) {
-			unsigned short maxSeq = m_maxSeq;
-			double rate = 0;
-			unsigned count = 0;
-			
-			FurEach(ClientList, client, m_clientList) {
-				if(short(client->second.Seq - maxSeq) < 0)
-					maxSeq = client->second.Seq;
-				FurEach(UdpCastSeqNakList, nak, client->second.NakList) {
-					m_nakList.insert(*nak);
-				}
-
-				if(client->second.Rate > 1000) {
-					rate += client->second.Rate;
-					++count;
-				}
-			}
+	releaseQueue();
 
-			assert(short(m_seq - maxSeq) <= 0);
+	if(!paceReady())
+		paceWakeup();
 
-			while(m_seq != maxSeq) {
-				m_queue[m_queueOffset].reset();
-				m_queueOffset = (m_queueOffset + 1) % UDPCAST_MAX_SEND_WINDOW;
-				++m_seq;
-			}
-		}
+	double currentTime = timef();
 
-		m_update = false;
-	}
+	if(m_ackerTime + UDPCAST_ACKER_ROTATION < currentTime)
+		rotateAckers();
 
-	double currentTime = timef();
+	// usuwany klient jest zastepowany ostatnim, juz sprawdzonym
+	for(unsigned index = m_clientList.size(); index-- > 0; ) {
+		Client& client = m_clientList[index];
 
-	FurEach(ClientList, client, m_clientList) {
 #ifndef _DEBUG
 		// client timeout
-		if(client->second.UpdateTime + UDPCAST_CLIENT_TIMEOUT < currentTime) {
-			SockDesc desc = client->first;
-			m_clientList.erase(client);
+		if(client.UpdateTime + UDPCAST_CLIENT_TIMEOUT < currentTime) {
+			SockDesc desc = client.Sock;
+			removeClient(index);
 			onTimeout(desc);
 			continue;
 		}
 #endif
 
-		if(client->second.KeepAliveTime + UDPCAST_KEEPALIVE_TIME < currentTime) {
+		// pozostali odbiorcy odpowiadaja sami co jakis czas, pytani sa tylko gdy milcza
+		if(client.KeepAliveTime + UDPCAST_KEEPALIVE_TIME < currentTime &&
+			(client.Acker || client.Lagging || client.UpdateTime + UDPCAST_PROBE_TIME < currentTime)) 
+		{
 			vdebugp(5, "udpserver", "sending periodic keepAlive");
 			
-			sendKeepAlive(false, &client->second);
+			sendKeepAlive(false, &client);
 		}
 	}
 
@@ -457,7 +921,7 @@ void UdpCastServer::onFdTick() {
 		unsigned avgCount = 0;
 
 		FurEach(ClientList, client, m_clientList) {
-			avgTraffic += 1.0 / client->second.RTT; 
+			avgTraffic += 1.0 / client->RTT; 
 			++avgCount;
 		}
 
@@ -465,32 +929,170 @@ void UdpCastServer::onFdTick() {
 
 		double maxRTT = SlownessFactor / avgTraffic;
 		
-		FurEach(ClientList, client, m_clientList) {
-			if(client->second.RTT > maxRTT && onTooSlow(client->first)) {
-				onLeave(client->first);
-				sendLeave(&client->first);
-				m_clientList.erase(client->first);
+		for(unsigned index = m_clientList.size(); index-- > 0; ) {
+			SockDesc desc = m_clientList[index].Sock;
+
+			if(m_clientList[index].RTT > maxRTT && onTooSlow(desc)) {
+				onLeave(desc);
+				sendLeave(&desc);
+				removeClient(index);
 			}
 		}
 
 		m_lastSlownessCheck = currentTime;
 	}
+
+	onTick();
 }
 
-bool UdpCastServer::allDataAccepted() const {
-	cFurEach(ClientList, client, m_clientList) {
-		if(short(m_maxSeq - client->second.Seq) > 0)
-			return false;
+void UdpCastServer::releaseQueue() {
+	if(m_queue.empty())
+		return;
+
+	// pakiety potrzebne potwierdzajacym i klientom, ktorzy zglosili braki
+	MclSeq limit = m_maxSeq;
+	if(m_seqIndex.size() && int(*m_seqIndex.begin() - limit) < 0)
+		limit = *m_seqIndex.begin();
+
+	// pozostali moga jeszcze przyslac NAK po losowym opoznieniu
+	double sendTime = timef() - holdTime();
+
+	while(int(limit - m_seq) > 0) {
+		QueueEntry& entry = m_queue[m_queueOffset];
+		if(entry.SendTime > sendTime)
+			break;
+
+		entry.Valid = false;
+		m_nakList.erase(m_seq);
+		m_queueOffset = (m_queueOffset + 1) % m_queue.size();
+		++m_seq;
 	}
-	return true;
+}
+
+double UdpCastServer::holdTime() const {
+	// brak wykrywa kolejny pakiet serii (lub keepAlive po RTT*3), NAK po losowym opoznieniu i czas przesylania,
+	// kilka opoznien NAK zapasu na opoznienia petli zdarzen po obu stronach
+	return min<double>(UDPCAST_KEEPALIVE_TIME, UDPCAST_HOLD_NAK_DELAYS * UDPCAST_NAK_DELAY + UDPCAST_PACE_QUANTUM + 6.0 * RTT / 1000000.0);
+}
+
+unsigned UdpCastServer::queueLimit() const {
+	return min<unsigned>(m_queue.size(), m_clientWindow);
+}
+
+void UdpCastServer::allocQueue() {
+	if(m_queueData.size())
+		return;
+
+	// jeden bufor na cale okno, dane pakietu sa skladane bezposrednio za naglowkiem
+	m_queueStride = sizeof(MclDataPacket) + min<unsigned>(MaxSize, MaxPacketSize);
+
+	// okno ograniczone rozmiarem bufora, duze pakiety skracaja okno
+	unsigned window = min(SendWindow, UDPCAST_MAX_WINDOW);
+	unsigned maxWindow = UDPCAST_MAX_QUEUE_SIZE / m_queueStride;
+	if(window > maxWindow) {
+		infof("Send window limited to %i packets of %i bytes (%iMB queue)", maxWindow, m_queueStride, UDPCAST_MAX_QUEUE_SIZE >> 20);
+		window = maxWindow;
+	}
+	m_queue.resize(max(2U, window));
+	m_queueData.resize(m_queueStride * m_queue.size());
+
+	// grupa FEC musi sie miescic w oknie
+	FecGroup = min(FecGroup, min(UDPCAST_FEC_MAX_GROUP, (unsigned)m_queue.size() / 2));
+	FecMaxParity = min(FecMaxParity, UDPCAST_FEC_MAX_PARITY);
+	if(FecGroup) {
+		m_fecStride = UdpCastFec::HeaderSize + m_queueStride - sizeof(MclDataPacket);
+		m_fecData.resize(m_fecStride * FecMaxParity);
+		m_fecPacket.resize(sizeof(MclParityPacket) + m_fecStride);
+	}
+}
+
+unsigned UdpCastServer::fecParity(float loss) const {
+	if(!FecGroup || loss <= 0)
+		return 0;
+
+	// srednia ilosc strat w grupie z zapasem na rozrzut
+	double lost = FecGroup * loss;
+	return min<unsigned>(FecMaxParity, (unsigned)ceil(lost + 2 * sqrt(lost)));
+}
+
+void UdpCastServer::fecAddPacket(MclSeq seq, const void* data, unsigned size) {
+	if(!FecGroup)
+		return;
+
+	unsigned col = seq % FecGroup;
+
+	// nowa grupa zaczyna sie od wyrownanego numeru sekwencyjnego
+	if(col == 0) {
+		m_fecSeq = seq;
+		m_fecCount = 0;
+		m_fecSize = 0;
+		m_fecRows = FecParity;
+		memset(&m_fecData[0], 0, m_fecStride * m_fecRows);
+	}
+	else if(!m_fecRows || seq != m_fecSeq + m_fecCount) {
+		m_fecRows = 0;
+		return;
+	}
+
+	for(unsigned row = 0; row < m_fecRows; ++row)
+		UdpCastFec::addPacket(&m_fecData[row * m_fecStride], row, col, data, size);
+
+	m_fecSize = max(m_fecSize, UdpCastFec::HeaderSize + size);
+
+	if(++m_fecCount == FecGroup)
+		fecSendParity();
+}
+
+void UdpCastServer::fecSendParity() {
+	MclParityPacket& packet = *(MclParityPacket*)&m_fecPacket[0];
+
+	for(unsigned row = 0; row < m_fecRows; ++row) {
+		packet.Type = MclParity;
+		packet.Seq = m_fecSeq;
+		packet.Count = m_fecCount;
+		packet.Index = row;
+		packet.Size = m_fecSize;
+		memcpy(packet.Data, &m_fecData[row * m_fecStride], m_fecSize);
+		queueDatagram(&packet, sizeof(MclParityPacket) - sizeof(packet.Data) + m_fecSize, NULL, true);
+		++FecCount;
+	}
+
+	m_fecRows = 0;
+}
+
+MclSeq UdpCastServer::ackedSeq() const {
+	// pozostali odbiorcy zglaszaja tylko braki
+	return m_ackers.empty() ? m_maxSeq : m_ackedSeq;
+}
+
+bool UdpCastServer::windowOpen() const {
+	return int(m_maxSeq - ackedSeq()) < (int)windowSize();
+}
+
+unsigned UdpCastServer::windowLimit(const Client& client) const {
+	if(!client.RTT)
+		return client.MaxWindow;
+
+	// ograniczenie historyczne: okno nie wieksze niz 1s / RTT
+	double limit = 1000.0 * 1000.0 / client.RTT;
+
+	// przy znanej predkosci okno musi pomiescic iloczyn predkosci i RTT (z zapasem)
+	if(TargetRate > 0 && MaxSize > 0)
+		limit = max(limit, 2.0 * TargetRate * client.RTT / (1000.0 * 1000.0) / MaxSize);
+
+	return (unsigned)max(2.0, min(limit, (double)client.MaxWindow));
 }
 
 bool UdpCastServer::waitForWrite() const {
 	if(m_clientList.empty())
 		return false;
 	
+	// bez kredytu pacer sam wznowi wysylanie
+	if(!paceReady())
+		return false;
+
 	if(m_nakList.size())
 		return true;
 
-	return allDataAccepted() && short(m_seq + windowSize() - m_maxSeq) > 0;
+	return windowOpen() && int(m_maxSeq - m_seq) < (int)queueLimit() && hasData();
 }
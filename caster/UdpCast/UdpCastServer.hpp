@@ -2,32 +2,72 @@
 
 #include "../AsyncLib/AsyncLib.hpp"
 #include "UdpCastPacket.hpp"
+#include "UdpCastFec.hpp"
 
-const int UDPCAST_MAX_SEND_WINDOW = 256;
+const unsigned UDPCAST_DEFAULT_SEND_WINDOW = 256;
 const float UDPCAST_KEEPALIVE_TIME = 1.0;
 const float UDPCAST_CLIENT_TIMEOUT = 15;
+const int UDPCAST_MAX_SEND_BATCH = 64;
+const unsigned UDPCAST_DEFAULT_ACKERS = 4;
+const float UDPCAST_ACKER_ROTATION = 2;
+const float UDPCAST_PROBE_TIME = 5;
 
-typedef set<unsigned short> UdpCastSeqNakList;
+//! Przetrzymanie wyslanych pakietow w wielokrotnosciach opoznienia NAK (zapas na opoznienia petli zdarzen)
+const double UDPCAST_HOLD_NAK_DELAYS = 4;
+
+//! Najwiekszy bufor kolejki wysylania (okno * rozmiar pakietu)
+const unsigned UDPCAST_MAX_QUEUE_SIZE = 64 << 20;
+
+//! Najdluzsza seria pakietow pacera (czas wysylania przy biezacej predkosci)
+const double UDPCAST_PACE_QUANTUM = 0.001;
+
+//! Predkosc pacera wzgledem okna na RTT (okno moze rosnac)
+const double UDPCAST_PACE_GAIN = 1.25;
+
+#ifdef __linux__
+#define UDPCAST_SENDMMSG
+#endif
+
+typedef set<MclSeq> UdpCastSeqNakList;
+
+//! Porzadek numerow sekwencyjnych z przekreceniem licznika
+struct UdpCastSeqLess {
+	bool operator () (MclSeq a, MclSeq b) const { return int(a - b) < 0; }
+};
+
+typedef multiset<MclSeq, UdpCastSeqLess> UdpCastSeqIndex;
 
 class UdpCastServer : public UdpSock {
 public:
 	struct Client {
 		SockDesc Sock;
-		unsigned short Seq;
+		MclSeq Seq;
 		float Window;
-		unsigned short WinSeq;
+		unsigned MaxWindow;
+		MclSeq WinSeq;
 		unsigned RTT;
-		UdpCastSeqNakList NakList;
 		unsigned short KeepAliveTimeout;
 		double UpdateTime, KeepAliveTime;
 		double NextKeepAliveTime;
 		long long ID;
 		unsigned LostCount;
 		float Rate;
+		float Loss;
+
+		//! Potwierdza kazdy keepAlive (steruje oknem)
+		bool Acker;
+
+		//! Zglosil brakujace pakiety, wstrzymuje zwalnianie okna
+		bool Lagging;
+
+		//! Numer sekwencyjny zapisany w indeksie m_seqIndex
+		bool Indexed;
+		MclSeq IndexSeq;
 
 		Client() {
 			Seq = 0;
 			Window = 0;
+			MaxWindow = UDPCAST_DEFAULT_SEND_WINDOW;
 			WinSeq = 0;
 			RTT = 0;
 			KeepAliveTimeout = 0;
@@ -35,33 +75,143 @@ public:
 			NextKeepAliveTime = 0;
 			LostCount = 0;
 			Rate = 0;
+			Loss = 0;
+			Acker = Lagging = Indexed = false;
+			IndexSeq = 0;
 		}
 	};
 
-	typedef map<SockDesc, Client> ClientList;
+	//! Klienci w ciaglej tablicy (usuwany jest zastepowany ostatnim), indeks po adresie i porcie
+	typedef vector<Client> ClientList;
+	typedef map<unsigned long long, unsigned> ClientIndex;
+	typedef vector<unsigned> AckerList;
+
+	//! Datagram oczekujacy na wyslanie w paczce
+	struct BatchEntry {
+		const void* Data;
+		unsigned Offset;
+		unsigned Size;
+		SockDesc Desc;
+		bool HasDesc;
+	};
+
+	struct QueueEntry {
+		unsigned Size;
+		bool Valid;
+
+		//! Pierwsze wyslanie i ostatnia retransmisja
+		double SendTime, RepairTime;
+
+		QueueEntry() {
+			Size = 0;
+			Valid = false;
+			SendTime = RepairTime = 0;
+		}
+	};
 	
 private:
 	ClientList m_clientList;
-	unsigned short m_seq, m_maxSeq;
-	bool m_update;
-	auto_ptr<string> m_queue[UDPCAST_MAX_SEND_WINDOW];
+	ClientIndex m_clientIndex;
+
+	//! Adresy odrzuconych klientow (zbyt stara wersja protokolu), logowane raz
+	set<unsigned long long> m_refusedList;
+	MclSeq m_seq, m_maxSeq;
+	vector<QueueEntry> m_queue;
+	vector<byte> m_queueData;
+	unsigned m_queueStride;
 	unsigned m_queueOffset;
-	set<unsigned short> m_nakList;
+	UdpCastSeqNakList m_nakList;
 	double m_updateTime;
 	double m_lastSlownessCheck;
 
+	//! Suma RTT klientow (RTT serwera bez przegladania listy)
+	double m_rttSum;
+	unsigned m_rttCount;
+
+	//! Numery sekwencyjne potwierdzajacych i opoznionych klientow (najmniejszy wstrzymuje okno)
+	UdpCastSeqIndex m_seqIndex;
+
+	//! Najmniejsze okno odbiorcy
+	unsigned m_clientWindow;
+
+	//! Stan potwierdzajacych uaktualniany z ich potwierdzeniami (najmniejszy Seq, najwieksze okno)
+	MclSeq m_ackedSeq;
+	float m_window;
+
+	//! Ilosc klientow zglaszajacych braki
+	unsigned m_laggingCount;
+
+	//! Wybrani odbiorcy potwierdzajacy, zmieniani co UDPCAST_ACKER_ROTATION
+	AckerList m_ackers;
+	unsigned m_ackerCursor;
+	double m_ackerTime;
+
+	//! Pakiet, ktory ostatnio prosil o potwierdzenie
+	MclSeq m_keepAliveSeq;
+
+	//! Pacer: kredyt w bajtach rosnie z predkoscia paceRate(), najwyzej o UDPCAST_PACE_QUANTUM
+	double m_paceCredit;
+	double m_paceTime;
+	bool m_paceWait;
+
+	//! Czas wyslania kolejnego pakietu paczki (SO_TXTIME, ns)
+	long long m_txTime;
+	int m_txTimeState;
+
+	//! Datagramy zebrane w jednym przebiegu (dane, keepAlive, retransmisje)
+	vector<BatchEntry> m_batch;
+	string m_batchControl;
+	unsigned m_batching;
+	SockDesc m_groupDesc;
+	bool m_groupDescValid;
+
+	//! Pakiety naprawcze biezacej grupy (liczone w trakcie wysylania danych)
+	vector<byte> m_fecData;
+	vector<byte> m_fecPacket;
+	unsigned m_fecStride;
+	unsigned m_fecRows;
+	unsigned m_fecSize;
+	unsigned m_fecCount;
+	MclSeq m_fecSeq;
+
 public: // configuration
 	double SlownessFactor;
 	unsigned MaxSize;
 
+	//! Pojemnosc okna wysylania (pakiety, najwyzej UDPCAST_MAX_WINDOW)
+	unsigned SendWindow;
+
+	//! Docelowa predkosc, z ktorej i z RTT wyznaczane jest okno klienta (0 - nieznana)
+	long long TargetRate;
+
+	//! Ilosc pakietow danych w grupie FEC (0 - wylaczone)
+	unsigned FecGroup;
+	unsigned FecMaxParity;
+
+	//! Wysylaj paczki jednym wywolaniem sendmmsg (omija limit predkosci gniazda)
+	bool BatchSend;
+
+	//! Ilosc odbiorcow potwierdzajacych (najwyzej UDPCAST_MAX_ACKERS)
+	unsigned AckerCount;
+
+	//! Stala predkosc wysylania (B/s), 0 - okno na RTT
+	long long PaceRate;
+
 public:	// statistics
 	unsigned ContentLength;
 	unsigned SendLength;
 	unsigned SendCount;
-	unsigned NakCount;
+	unsigned NakCount, SuppressedNakCount;
+
+	//! NAK dla juz zwolnionych pakietow (odbiorca pomija blok i pobiera go w kolejnej rundzie)
+	unsigned LateNakCount;
 	unsigned KeepAliveCount;
 	unsigned UpdateCount, InvalidUpdateCount, SlowStart;
 	unsigned RTT;
+	unsigned BatchCount, BatchPacketCount, MaxBatchSize;
+	unsigned BurstCount, BurstPacketCount, MaxBurstSize;
+	unsigned FecCount, FecParity;
+	Rate BatchRate;
 
 public:
 	UdpCastServer();
@@ -73,20 +223,85 @@ private:
 public:
 	void sendKeepAliveAfter(unsigned time);
 	void sendKeepAlive(bool resetKeepAliveTimeout = false, Client* client = NULL);
-	void sendSeqData(unsigned short seq, bool keepAlive = false);
+	void sendSeqData(MclSeq seq, bool keepAlive = false);
 	void sendLeave(const SockDesc* desc = NULL);
 	unsigned disconnect(const SockDesc& desc);
-	unsigned windowSize() const;
+	unsigned windowSize() const { return (unsigned)m_window; }
 	unsigned clientCount() const { return m_clientList.size(); }
+	unsigned laggingCount() const { return m_laggingCount; }
+
+	//! Ustawia adres grupy (rowniez dla wysylania paczkami)
+	void setGroupAddress(unsigned port, const string& address);
+
+	//! Srednia ilosc datagramow w paczce
+	float batchSize() const { return BatchCount ? float(BatchPacketCount) / BatchCount : 0; }
+
+	//! Srednia ilosc pakietow wysylanych jednym ciagiem przez pacer
+	float burstSize() const { return BurstCount ? float(BurstPacketCount) / BurstCount : 0; }
+
+	//! Predkosc pacera (B/s, 0 - bez ograniczenia)
+	double paceRate() const;
 
 private:
 	void updateRTT();
+	void setClientRTT(Client& client, unsigned rtt);
+
+	//! Uaktualnia wpis klienta w m_seqIndex
+	void indexClient(Client& client);
+	void setLagging(Client& client, bool lagging);
+
+	Client* findClient(const SockDesc& desc);
+	void removeClient(unsigned index);
+
+	//! Przelicza stan potwierdzajacych (tylko UDPCAST_MAX_ACKERS klientow)
+	void updateAckers();
+
+	//! Wybiera kolejnych odbiorcow potwierdzajacych i rozsyla ich liste
+	void rotateAckers();
+	void sendAckers();
+
+	//! Zwalnia pakiety potwierdzone przez nadzorowanych klientow i przetrzymane dla spoznionych NAK
+	void releaseQueue();
+	double holdTime() const;
+	unsigned queueLimit() const;
 	void gotUpdate(MclUpdatePacket2& update, int size, const SockDesc& desc);
 	void gotJoin(MclJoinPacket& update, int size, const SockDesc& desc);
 	void gotJoinResponse(MclJoinResponsePacket& update, int size, const SockDesc& desc);
 	void gotLeave(MclLeavePacket& update, int size, const SockDesc& desc);
 
-	bool allDataAccepted() const;
+	//! Najmniejszy numer sekwencyjny potwierdzony przez potwierdzajacych
+	MclSeq ackedSeq() const;
+
+	//! Czy okno pozwala wyslac kolejny pakiet
+	bool windowOpen() const;
+
+	//! Zuzywa kredyt pacera, bez kredytu planuje wznowienie wysylania
+	bool paceSend(unsigned size);
+	bool paceReady() const;
+	void paceRefill();
+	void paceWakeup();
+	double resumeSend(unsigned count);
+
+	//! Czas wyslania pakietu dla kolejki fq (SO_TXTIME)
+	long long nextTxTime(unsigned size, double rate);
+	bool enableTxTime();
+
+	//! Maksymalne okno klienta dla zmierzonego RTT
+	unsigned windowLimit(const Client& client) const;
+
+	//! Ilosc pakietow naprawczych dla zgloszonej straty pakietow
+	unsigned fecParity(float loss) const;
+	void fecAddPacket(MclSeq seq, const void* data, unsigned size);
+	void fecSendParity();
+
+	//! Gotowy pakiet danych w oknie wysylania (naglowek + dane)
+	MclDataPacket* queuePacket(unsigned offset) {
+		return (MclDataPacket*)&m_queueData[offset * m_queueStride];
+	}
+	void allocQueue();
+
+	void queueDatagram(const void* data, unsigned size, const SockDesc* desc = NULL, bool copy = false);
+	void flushBatch();
 
 private:
 	void onSockRead(const SockData& data);
@@ -95,10 +310,14 @@ private:
 	bool waitForWrite() const;
 
 protected:
-	virtual bool onGetData(string& data, unsigned maxSize) = 0;
+	virtual bool onGetData(void* data, unsigned& size, unsigned maxSize) = 0;
 	virtual bool onJoin(const SockDesc& desc) { return true; }
 	virtual void onLeave(const SockDesc& desc) { }
 	virtual void onTimeout(const SockDesc& desc) { }
 	virtual bool onTooSlow(const SockDesc& desc) { return false; }
 	virtual void onReset() { }
+	virtual void onTick() { }
+
+	//! Czy onGetData ma gotowe dane (bez czekania na dysk)
+	virtual bool hasData() const { return true; }
 };